@@ -0,0 +1,1335 @@
+/*
+Description: standalone throughput benchmark for the ikd-Tree map queries, with the ivox voxel map and the ikd-Tree forest
+             backends for comparison.
+Usage: ikdtree_benchmark [map_points] [query_num] [stress_seconds] [leaf_bucket_size] [build_thread_num]
+                         [--pcd=<recorded map.pcd>] [--json=<results.json>] [--case=<case>[,<case>...]]
+       --pcd replaces the synthetic scene by points drawn from a recorded map, map_points is then the
+       size of the recorded map. --json also writes every result to a file for comparing runs. --case
+       runs only the listed cases, --help lists them.
+*/
+#include <ikd-Tree/ikd_Tree.h>
+#include <map_backend/map_backend.h>
+#include <map_backend/map_evictor.h>
+#include <pcl/io/pcd_io.h>
+#include <pcl/point_cloud.h>
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <thread>
+
+typedef pcl::PointXYZINormal PointType;
+typedef KD_TREE<PointType>::PointVector PointVector;
+
+static double now_sec()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Bench_Result
+{
+    string name;
+    string metric;
+    double value;
+    string unit;
+};
+
+// Every result printed is also kept here for --json.
+static vector<Bench_Result> bench_results;
+// Points of the recorded map given with --pcd, empty for the synthetic scene.
+static PointVector recorded_points;
+
+static void record(const string &name, const string &metric, double value, const string &unit)
+{
+    bench_results.push_back({name, metric, value, unit});
+}
+
+static string json_string(const string &text)
+{
+    string quoted = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+            quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+static bool write_json(const string &path, const vector<pair<string, string>> &config)
+{
+    ofstream out(path);
+    if (!out)
+    {
+        printf("Cannot write %s\n", path.c_str());
+        return false;
+    }
+    out << "{\n  \"config\": {";
+    for (size_t i = 0; i < config.size(); i++)
+        out << (i > 0 ? ", " : "") << json_string(config[i].first) << ": " << config[i].second;
+    out << "},\n  \"results\": [\n";
+    for (size_t i = 0; i < bench_results.size(); i++)
+    {
+        const Bench_Result &r = bench_results[i];
+        char value[32];
+        snprintf(value, sizeof(value), "%.9g", isfinite(r.value) ? r.value : 0.0);
+        out << "    {\"name\": " << json_string(r.name) << ", \"metric\": " << json_string(r.metric) << ", \"value\": " << value
+            << ", \"unit\": " << json_string(r.unit) << "}" << (i + 1 < bench_results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+    return bool(out);
+}
+
+// Lidar-like synthetic scene: a ground plane and a few walls sampled with small noise. With a recorded
+// map the points are drawn from it instead, with the same noise.
+static void generate_scene(int point_num, PointVector &points, mt19937 &rng)
+{
+    uniform_real_distribution<float> uniform(-50.0f, 50.0f), height(0.0f, 5.0f);
+    normal_distribution<float> noise(0.0f, 0.02f);
+    points.resize(point_num);
+    if (!recorded_points.empty())
+    {
+        uniform_int_distribution<size_t> pick(0, recorded_points.size() - 1);
+        for (int i = 0; i < point_num; i++)
+        {
+            points[i] = recorded_points[pick(rng)];
+            points[i].x += noise(rng);
+            points[i].y += noise(rng);
+            points[i].z += noise(rng);
+        }
+        return;
+    }
+    for (int i = 0; i < point_num; i++)
+    {
+        PointType &p = points[i];
+        switch (i % 4)
+        {
+        case 0:
+        case 1:
+            p.x = uniform(rng);
+            p.y = uniform(rng);
+            p.z = noise(rng);
+            break;
+        case 2:
+            p.x = float(int(uniform(rng)) / 10 * 10) + noise(rng);
+            p.y = uniform(rng);
+            p.z = height(rng);
+            break;
+        default:
+            p.x = uniform(rng);
+            p.y = float(int(uniform(rng)) / 10 * 10) + noise(rng);
+            p.z = height(rng);
+            break;
+        }
+        p.intensity = float(i % 256);
+    }
+}
+
+static void bench_nearest_search(KD_TREE<PointType> &tree, const PointVector &queries)
+{
+    PointVector nearest;
+    vector<float> distance;
+    double t0 = now_sec();
+    for (size_t i = 0; i < queries.size(); i++)
+        tree.Nearest_Search(queries[i], Batch_Nearest_K, nearest, distance, 2.236);
+    double t = now_sec() - t0;
+    printf("Nearest_Search        : %10.0f queries/s\n", queries.size() / t);
+    record("Nearest_Search", "throughput", queries.size() / t, "queries/s");
+}
+
+static void bench_nearest_search_batch(KD_TREE<PointType> &tree, const PointVector &queries, int batch_size)
+{
+    KD_TREE<PointType>::Batch_Search_Context context;
+    PointVector nearest(batch_size * Batch_Nearest_K);
+    vector<float> distance(batch_size * Batch_Nearest_K);
+    vector<int> found(batch_size);
+    double t0 = now_sec();
+    for (size_t i = 0; i < queries.size(); i += batch_size)
+    {
+        int num = min(batch_size, int(queries.size() - i));
+        tree.Nearest_Search_Batch(&queries[i], num, context, nearest.data(), distance.data(), found.data(), 2.236);
+    }
+    double t = now_sec() - t0;
+    printf("Nearest_Search_Batch  : %10.0f queries/s (batch %d)\n", queries.size() / t, batch_size);
+    record("Nearest_Search_Batch batch " + to_string(batch_size), "throughput", queries.size() / t, "queries/s");
+}
+
+// Box_Search into a PointVector against the visitor form that only accumulates a centroid.
+static void bench_box_search(KD_TREE<PointType> &tree, const PointVector &queries, float half_size)
+{
+    const size_t query_num = min<size_t>(queries.size(), 20000);
+    PointVector storage;
+    long hits[2] = {0, 0};
+    double elapsed[2];
+    double t0 = now_sec();
+    for (size_t i = 0; i < query_num; i++)
+    {
+        const PointType &q = queries[i];
+        BoxPointType box = {{q.x - half_size, q.y - half_size, q.z - half_size}, {q.x + half_size, q.y + half_size, q.z + half_size}};
+        tree.Box_Search(box, storage);
+        hits[0] += storage.size();
+    }
+    elapsed[0] = now_sec() - t0;
+    t0 = now_sec();
+    float centroid[3] = {0.0f, 0.0f, 0.0f};
+    for (size_t i = 0; i < query_num; i++)
+    {
+        const PointType &q = queries[i];
+        BoxPointType box = {{q.x - half_size, q.y - half_size, q.z - half_size}, {q.x + half_size, q.y + half_size, q.z + half_size}};
+        tree.Box_Search(box, [&](const KD_TREE<PointType>::Node_Point &p)
+                        {
+            hits[1]++;
+            centroid[0] += p.x;
+            centroid[1] += p.y;
+            centroid[2] += p.z;
+            return true; });
+    }
+    elapsed[1] = now_sec() - t0;
+    printf("Box_Search %4.1f m box  : %10.0f boxes/s into a PointVector, %10.0f boxes/s visitor (%ld / %ld points)\n", 2 * half_size,
+           query_num / elapsed[0], query_num / elapsed[1], hits[0], hits[1]);
+    char name[64];
+    snprintf(name, sizeof(name), "Box_Search %.1f m", 2 * half_size);
+    record(name, "throughput", query_num / elapsed[0], "boxes/s");
+    record(string(name) + " visitor", "throughput", query_num / elapsed[1], "boxes/s");
+}
+
+// Radius_Search into a PointVector against the visitor form that only counts.
+static void bench_radius_search(KD_TREE<PointType> &tree, const PointVector &queries, float radius)
+{
+    const size_t query_num = min<size_t>(queries.size(), 20000);
+    PointVector storage;
+    long hits[2] = {0, 0};
+    double elapsed[2];
+    double t0 = now_sec();
+    for (size_t i = 0; i < query_num; i++)
+    {
+        tree.Radius_Search(queries[i], radius, storage);
+        hits[0] += storage.size();
+    }
+    elapsed[0] = now_sec() - t0;
+    t0 = now_sec();
+    for (size_t i = 0; i < query_num; i++)
+        tree.Radius_Search(queries[i], radius, [&](const KD_TREE<PointType>::Node_Point &p)
+                           {
+            hits[1]++;
+            return true; });
+    elapsed[1] = now_sec() - t0;
+    printf("Radius_Search %4.1f m   : %10.0f queries/s into a PointVector, %10.0f queries/s visitor (%ld / %ld points)\n", radius,
+           query_num / elapsed[0], query_num / elapsed[1], hits[0], hits[1]);
+    char name[64];
+    snprintf(name, sizeof(name), "Radius_Search %.1f m", radius);
+    record(name, "throughput", query_num / elapsed[0], "queries/s");
+    record(string(name) + " visitor", "throughput", query_num / elapsed[1], "queries/s");
+}
+
+// Approximate batched k-NN against the exact result, with the gate of the odometry matcher: a match
+// is used when all Batch_Nearest_K neighbours lie within sqrt(5).
+static void bench_approximate_search(KD_TREE<PointType> &tree, const PointVector &queries, float epsilon, int max_visit)
+{
+    const int batch_size = 64;
+    KD_TREE<PointType>::Batch_Search_Context context;
+    PointVector nearest(queries.size() * Batch_Nearest_K);
+    vector<float> exact_dist(queries.size() * Batch_Nearest_K), dist(queries.size() * Batch_Nearest_K);
+    vector<int> exact_found(queries.size()), found(queries.size());
+    tree.Nearest_Search_Batch(queries.data(), queries.size(), context, nearest.data(), exact_dist.data(), exact_found.data(), 2.236);
+    double t0 = now_sec();
+    for (size_t i = 0; i < queries.size(); i += batch_size)
+    {
+        int num = min(batch_size, int(queries.size() - i));
+        tree.Nearest_Search_Batch(&queries[i], num, context, &nearest[i * Batch_Nearest_K], &dist[i * Batch_Nearest_K], &found[i], 2.236,
+                                  epsilon, max_visit);
+    }
+    double t = now_sec() - t0;
+    int differ = 0, gate_lost = 0, matched = 0;
+    double ratio_sum = 0.0;
+    for (size_t i = 0; i < queries.size(); i++)
+    {
+        if (exact_found[i] < Batch_Nearest_K)
+            continue;
+        matched++;
+        float exact_kth = exact_dist[i * Batch_Nearest_K + Batch_Nearest_K - 1];
+        float kth = found[i] == Batch_Nearest_K ? dist[i * Batch_Nearest_K + Batch_Nearest_K - 1] : INFINITY;
+        if (kth > exact_kth)
+            differ++;
+        if (exact_kth <= 5.0f && kth > 5.0f)
+            gate_lost++;
+        if (exact_kth > 0.0f && kth < INFINITY)
+            ratio_sum += sqrt(kth / exact_kth);
+    }
+    printf("Approximate eps %4.2f visit %4d: %10.0f queries/s, %5.2f%% differ, k-th distance x%.4f, %d of %d matches lost\n", epsilon,
+           max_visit, queries.size() / t, 100.0 * differ / max(matched, 1), ratio_sum / max(matched, 1), gate_lost, matched);
+    char name[64];
+    snprintf(name, sizeof(name), "Approximate eps %.2f visit %d", epsilon, max_visit);
+    record(name, "throughput", queries.size() / t, "queries/s");
+    record(name, "differ", 100.0 * differ / max(matched, 1), "%");
+    record(name, "matches_lost", gate_lost, "matches");
+}
+
+// Per-query latency of Nearest_Search. With update_points > 0 a scan's worth of points is added every
+// update_every queries, so large subtrees go through the background rebuild while queries run.
+static void bench_nearest_latency(KD_TREE<PointType> &tree, const PointVector &queries, const PointVector &updates, int update_every, int update_points)
+{
+    PointVector nearest;
+    vector<float> distance;
+    vector<double> latency(queries.size());
+    size_t update_idx = 0;
+    for (size_t i = 0; i < queries.size(); i++)
+    {
+        if (update_points > 0 && i % update_every == 0 && update_idx + update_points <= updates.size())
+        {
+            PointVector scan(updates.begin() + update_idx, updates.begin() + update_idx + update_points);
+            tree.Add_Points(scan, false);
+            update_idx += update_points;
+        }
+        double t0 = now_sec();
+        tree.Nearest_Search(queries[i], Batch_Nearest_K, nearest, distance, 2.236);
+        latency[i] = now_sec() - t0;
+    }
+    sort(latency.begin(), latency.end());
+    printf("Nearest_Search latency: p50 %6.2f us, p99 %6.2f us%s\n", latency[latency.size() / 2] * 1e6,
+           latency[latency.size() * 99 / 100] * 1e6, update_points > 0 ? " (with updates)" : "");
+    string name = update_points > 0 ? "Nearest_Search latency with updates" : "Nearest_Search latency";
+    record(name, "p50", latency[latency.size() / 2] * 1e6, "us");
+    record(name, "p99", latency[latency.size() * 99 / 100] * 1e6, "us");
+}
+
+// Downsampled insertion of dense scans over the already mapped scene, the map_incremental() workload.
+static void bench_downsampled_insert(KD_TREE<PointType> &tree, int scan_num, int scan_size, mt19937 &rng)
+{
+    PointVector scan;
+    double elapsed = 0.0;
+    int added = 0;
+    for (int i = 0; i < scan_num; i++)
+    {
+        generate_scene(scan_size, scan, rng);
+        double t0 = now_sec();
+        added += tree.Add_Points(scan, true);
+        elapsed += now_sec() - t0;
+    }
+    printf("Add_Points downsampled: %10.3f ms per %d-point scan, %d kept, voxel map %s\n", elapsed * 1e3 / scan_num,
+           scan_size, added, tree.voxel_map_memory() > 0 ? "on" : "off");
+    record(string("Add_Points downsampled voxel map ") + (tree.voxel_map_memory() > 0 ? "on" : "off"), "scan_time", elapsed * 1e3 / scan_num, "ms");
+}
+
+// Raw insertion of whole scans, one Add_by_point per point against one partitioning pass per scan.
+static void bench_bulk_insert(KD_TREE<PointType> &tree, int scan_size, mt19937 &rng)
+{
+    PointVector scan;
+    double elapsed[2] = {0.0, 0.0};
+    const int scan_num = max(2000000 / scan_size, 5) / 5;
+    for (int i = 0; i < scan_num; i++)
+    {
+        for (int bulk = 0; bulk < 2; bulk++)
+        {
+            generate_scene(scan_size, scan, rng);
+            tree.Set_bulk_insert(bulk == 1);
+            double t0 = now_sec();
+            tree.Add_Points(scan, false);
+            elapsed[bulk] += now_sec() - t0;
+        }
+    }
+    tree.Set_bulk_insert(true);
+    printf("Add_Points %5d points: %10.3f ms point by point, %10.3f ms bulk\n", scan_size, elapsed[0] * 1e3 / scan_num,
+           elapsed[1] * 1e3 / scan_num);
+    record("Add_Points " + to_string(scan_size) + " point by point", "scan_time", elapsed[0] * 1e3 / scan_num, "ms");
+    record("Add_Points " + to_string(scan_size) + " bulk", "scan_time", elapsed[1] * 1e3 / scan_num, "ms");
+}
+
+// Readers on other threads run k-NN against snapshots while the main thread keeps inserting scans and
+// publishing, the layout of a planner or relocalizer next to the odometry.
+static void bench_snapshot_readers(KD_TREE<PointType> &tree, const PointVector &queries, int reader_num, double duration, mt19937 &rng)
+{
+    atomic<bool> stop(false);
+    atomic<long> query_count(0);
+    vector<thread> readers;
+    for (int r = 0; r < reader_num; r++)
+    {
+        readers.emplace_back([&, r]()
+                             {
+            PointVector nearest;
+            vector<float> distance;
+            size_t i = r * queries.size() / reader_num;
+            while (!stop.load())
+            {
+                shared_ptr<const KD_TREE<PointType>::SNAPSHOT> snapshot = tree.Get_Snapshot();
+                for (int j = 0; j < 1000; j++, i = (i + 1) % queries.size())
+                    snapshot->Nearest_Search(queries[i], Batch_Nearest_K, nearest, distance, 2.236);
+                query_count += 1000;
+            } });
+    }
+    PointVector scan;
+    double publish_time = 0.0;
+    int scan_num = 0;
+    uint64_t snapshot_num = 0;
+    double t_start = now_sec();
+    // Readers block in Get_Snapshot until a first snapshot exists, publish one before they are joined
+    while (now_sec() - t_start < duration || snapshot_num == 0)
+    {
+        generate_scene(10000, scan, rng);
+        tree.Add_Points(scan, true);
+        double t0 = now_sec();
+        snapshot_num += tree.Publish_Snapshot();
+        publish_time += now_sec() - t0;
+        scan_num++;
+        usleep(1000);
+    }
+    double elapsed = now_sec() - t_start;
+    stop = true;
+    for (size_t r = 0; r < readers.size(); r++)
+        readers[r].join();
+    printf("Snapshot readers %d    : %10.0f queries/s total, %d scans, %llu snapshots, %6.2f ms per published copy\n", reader_num,
+           query_count.load() / elapsed, scan_num, (unsigned long long)snapshot_num, publish_time * 1e3 / max<uint64_t>(snapshot_num, 1));
+    record("Snapshot readers " + to_string(reader_num), "throughput", query_count.load() / elapsed, "queries/s");
+    record("Snapshot readers " + to_string(reader_num), "publish_time", publish_time * 1e3 / max<uint64_t>(snapshot_num, 1), "ms");
+}
+
+// Last-level cache misses of this thread, -1 when perf counters are not available.
+static int open_cache_miss_counter()
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void bench_nearest_cache(KD_TREE<PointType> &tree, const PointVector &queries, const char *label)
+{
+    PointVector nearest;
+    vector<float> distance;
+    int counter = open_cache_miss_counter();
+    if (counter >= 0)
+    {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    double t0 = now_sec();
+    for (size_t i = 0; i < queries.size(); i++)
+        tree.Nearest_Search(queries[i], Batch_Nearest_K, nearest, distance, 2.236);
+    double t = now_sec() - t0;
+    long long misses = -1;
+    if (counter >= 0)
+    {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &misses, sizeof(misses)) != sizeof(misses))
+            misses = -1;
+        close(counter);
+    }
+    record(string("Nearest_Search ") + label, "throughput", queries.size() / t, "queries/s");
+    if (misses >= 0)
+        record(string("Nearest_Search ") + label, "cache_misses", double(misses) / queries.size(), "misses/query");
+    if (misses >= 0)
+        printf("Nearest_Search %-7s: %10.0f queries/s, %6.1f cache misses/query, node memory %zu MB\n", label, queries.size() / t,
+               double(misses) / queries.size(), tree.node_memory() >> 20);
+    else
+        printf("Nearest_Search %-7s: %10.0f queries/s, cache misses n/a (perf counters unavailable), node memory %zu MB\n", label,
+               queries.size() / t, tree.node_memory() >> 20);
+}
+
+// Worst-case search stall while the map keeps sweeping forward: every step adds a slab of points ahead
+// of the sensor and deletes the slab behind it, which keeps large subtrees going through background rebuilds.
+static void bench_rebuild_stall(KD_TREE<PointType> &tree, double duration, mt19937 &rng)
+{
+    uniform_real_distribution<float> uniform(-50.0f, 50.0f), slab(0.0f, 1.0f), height(0.0f, 5.0f);
+    PointVector scan(2000), nearest;
+    vector<float> distance, latency;
+    vector<BoxPointType> boxes(1);
+    float front = 50.0f;
+    int blocked = 0;
+    double t_start = now_sec();
+    while (now_sec() - t_start < duration)
+    {
+        for (size_t i = 0; i < scan.size(); i++)
+        {
+            scan[i].x = front + slab(rng);
+            scan[i].y = uniform(rng);
+            scan[i].z = (i % 2 == 0) ? 0.0f : height(rng);
+        }
+        tree.Add_Points(scan, false);
+        boxes[0] = {{front - 101.0f, -60.0f, -10.0f}, {front - 100.0f, 60.0f, 10.0f}};
+        tree.Delete_Point_Boxes(boxes);
+        front += 1.0f;
+        for (int i = 0; i < 500; i++)
+        {
+            PointType query;
+            query.x = front - 50.0f + uniform(rng);
+            query.y = uniform(rng);
+            query.z = height(rng);
+            // Voluntary context switches tell a search that slept on the rebuild thread apart from plain preemption.
+            struct rusage usage_before, usage_after;
+            getrusage(RUSAGE_THREAD, &usage_before);
+            double t0 = now_sec();
+            tree.Nearest_Search(query, Batch_Nearest_K, nearest, distance, 2.236);
+            latency.push_back(now_sec() - t0);
+            getrusage(RUSAGE_THREAD, &usage_after);
+            if (usage_after.ru_nvcsw != usage_before.ru_nvcsw)
+                blocked++;
+        }
+    }
+    sort(latency.begin(), latency.end());
+    printf("Search stall under rebuilds: p99.9 %8.2f us, max %8.2f us, %d of %zu queries blocked\n",
+           latency[latency.size() * 999 / 1000] * 1e6, latency.back() * 1e6, blocked, latency.size());
+    record("Search stall under rebuilds", "p99.9", latency[latency.size() * 999 / 1000] * 1e6, "us");
+    record("Search stall under rebuilds", "max", latency.back() * 1e6, "us");
+    record("Search stall under rebuilds", "blocked", blocked, "queries");
+}
+
+// Delete_Point_Boxes with small boxes spread over the map, the per-box cost of cutting the map.
+static void bench_delete_boxes(KD_TREE<PointType> &tree, const PointVector &queries, float half_size)
+{
+    const size_t box_num = min<size_t>(queries.size(), 2000);
+    vector<BoxPointType> boxes(1);
+    int deleted = 0;
+    double t0 = now_sec();
+    for (size_t i = 0; i < box_num; i++)
+    {
+        const PointType &q = queries[i];
+        boxes[0] = {{q.x - half_size, q.y - half_size, q.z - half_size}, {q.x + half_size, q.y + half_size, q.z + half_size}};
+        deleted += tree.Delete_Point_Boxes(boxes);
+    }
+    double t = now_sec() - t0;
+    printf("Delete_Point_Boxes    : %10.0f boxes/s (%.1f m boxes, %d points deleted)\n", box_num / t, 2 * half_size, deleted);
+    record("Delete_Point_Boxes", "throughput", box_num / t, "boxes/s");
+}
+
+// Scans sweep forward while the map behind them is cut away, as lasermap_fov_segment does. With a budget the
+// small rebuilds move out of the update into Run_Pending_Rebuilds between scans.
+static void bench_deferred_rebuild(float budget_ms, int scan_num, mt19937 &rng)
+{
+    uniform_real_distribution<float> uniform(-50.0f, 50.0f), slab(0.0f, 1.0f), height(0.0f, 5.0f);
+    KD_TREE<PointType> tree(0.3, 0.6, 0.2);
+    tree.Set_rebuild_budget(budget_ms);
+    PointVector scan(2000);
+    for (size_t i = 0; i < scan.size(); i++)
+    {
+        scan[i].x = uniform(rng);
+        scan[i].y = uniform(rng);
+        scan[i].z = height(rng);
+    }
+    tree.Build(scan);
+    vector<BoxPointType> boxes(1);
+    vector<double> update_time, gap_time;
+    float front = 50.0f;
+    int rebuild_num = 0;
+    for (int n = 0; n < scan_num; n++)
+    {
+        for (size_t i = 0; i < scan.size(); i++)
+        {
+            scan[i].x = front + slab(rng);
+            scan[i].y = uniform(rng);
+            scan[i].z = (i % 2 == 0) ? 0.0f : height(rng);
+        }
+        double t0 = now_sec();
+        tree.Add_Points(scan, false);
+        boxes[0] = {{front - 101.0f, -60.0f, -10.0f}, {front - 100.0f, 60.0f, 10.0f}};
+        tree.Delete_Point_Boxes(boxes);
+        double t1 = now_sec();
+        rebuild_num += tree.Run_Pending_Rebuilds();
+        update_time.push_back(t1 - t0);
+        gap_time.push_back(now_sec() - t1);
+        front += 1.0f;
+    }
+    sort(update_time.begin(), update_time.end());
+    sort(gap_time.begin(), gap_time.end());
+    printf("Rebuild budget %4.2f ms: update p50 %7.3f ms, p99 %7.3f ms, max %7.3f ms, between scans max %7.3f ms, %d deferred rebuilds, debt %d points\n",
+           budget_ms, update_time[update_time.size() / 2] * 1e3, update_time[update_time.size() * 99 / 100] * 1e3,
+           update_time.back() * 1e3, gap_time.back() * 1e3, rebuild_num, tree.rebuild_debt());
+    char name[64];
+    snprintf(name, sizeof(name), "Rebuild budget %.2f ms", budget_ms);
+    record(name, "update_p99", update_time[update_time.size() * 99 / 100] * 1e3, "ms");
+    record(name, "update_max", update_time.back() * 1e3, "ms");
+    record(name, "gap_max", gap_time.back() * 1e3, "ms");
+}
+
+// Cost of one Get_Statistics call, the per-scan sampling done by the mapping node.
+static void bench_statistics(KD_TREE<PointType> &tree)
+{
+    KD_TREE<PointType>::Tree_Statistics stats;
+    const int call_num = 1000;
+    double t0 = now_sec();
+    for (int i = 0; i < call_num; i++)
+        tree.Get_Statistics(stats);
+    double t = now_sec() - t0;
+    int deepest = Stats_Depth_Bins - 1;
+    while (deepest > 0 && stats.depth_histogram[deepest] == 0)
+        deepest--;
+    printf("Get_Statistics        : %10.1f us per call, %d nodes, %d deleted, deepest sampled depth %d%s\n", t * 1e6 / call_num,
+           stats.node_num, stats.deleted_num, deepest, deepest == Stats_Depth_Bins - 1 ? "+" : "");
+    record("Get_Statistics", "call_time", t * 1e6 / call_num, "us");
+    printf("Rebuilds              : %ld foreground in %.3f s, %ld background in %.3f s, %ld push downs, %ld boxes deleted\n",
+           stats.foreground_rebuild_num, stats.foreground_rebuild_time, stats.background_rebuild_num,
+           stats.background_rebuild_time, stats.push_down_num, stats.box_delete_num);
+}
+
+// The voxel hash map against the tree on the same map and queries, driven through MAP_BACKEND as the
+// mapping node does. Recall counts the queries whose neighbours match the exact k nearest ones, the voxel
+// map only looks at the voxels around the query.
+static void bench_ivox(KD_TREE<PointType> &tree, const PointVector &map_points, const PointVector &queries, float resolution, int nearby_type, mt19937 &rng)
+{
+    Map_Backend_Config config;
+    config.downsample_size = resolution / 2;
+    config.ivox_resolution = resolution;
+    config.ivox_nearby_type = nearby_type;
+    MAP_BACKEND<PointType>::Ptr backend = Create_Map_Backend<PointType>("ivox", config);
+    PointVector build_points(map_points);
+    double t0 = now_sec();
+    backend->Build(std::move(build_points));
+    double t_build = now_sec() - t0;
+
+    const int batch_size = 64;
+    KD_TREE<PointType>::Batch_Search_Context context;
+    PointVector nearest(batch_size * Batch_Nearest_K), exact(batch_size * Batch_Nearest_K);
+    vector<float> distance(batch_size * Batch_Nearest_K), exact_distance(batch_size * Batch_Nearest_K);
+    vector<int> found(batch_size), exact_found(batch_size);
+    double elapsed = 0.0;
+    int matched = 0;
+    for (size_t i = 0; i < queries.size(); i += batch_size)
+    {
+        int num = min(batch_size, int(queries.size() - i));
+        t0 = now_sec();
+        backend->Nearest_Search_Batch(&queries[i], num, nearest.data(), distance.data(), found.data(), 2.236);
+        elapsed += now_sec() - t0;
+        tree.Nearest_Search_Batch(&queries[i], num, context, exact.data(), exact_distance.data(), exact_found.data(), 2.236);
+        for (int j = 0; j < num; j++)
+        {
+            bool same = found[j] == exact_found[j];
+            for (int n = 0; same && n < found[j]; n++)
+                same = fabs(distance[j * Batch_Nearest_K + n] - exact_distance[j * Batch_Nearest_K + n]) < 1e-5f;
+            matched += same;
+        }
+    }
+
+    PointVector scan;
+    double insert_time = 0.0;
+    const int scan_num = 50, scan_size = 20000;
+    for (int i = 0; i < scan_num; i++)
+    {
+        generate_scene(scan_size, scan, rng);
+        t0 = now_sec();
+        backend->Add_Points(scan, true);
+        backend->Map_Updated();
+        insert_time += now_sec() - t0;
+    }
+    string name = "IVOX " + to_string(resolution).substr(0, 4) + " m nearby " + to_string(nearby_type);
+    printf("IVOX %.2f m nearby %2d : %10.0f queries/s (batch %d), recall %.3f, build %.3f s, %.3f ms per %d-point scan, %.1f bytes/point\n",
+           resolution, nearby_type, queries.size() / elapsed, batch_size, double(matched) / queries.size(), t_build,
+           insert_time * 1e3 / scan_num, scan_size, double(backend->memory()) / backend->size());
+    record(name, "throughput", queries.size() / elapsed, "queries/s");
+    record(name, "recall", double(matched) / queries.size(), "fraction");
+    record(name, "build_time", t_build, "s");
+    record(name, "scan_time", insert_time * 1e3 / scan_num, "ms");
+}
+
+#define Trajectory_Cube_Len 200.0f
+#define Trajectory_Det_Range 60.0f
+#define Trajectory_Mov_Threshold 1.5f
+
+// Moves the local map cube with the sensor as lasermap_fov_segment does, boxes receives what it left behind.
+static void segment_local_map(BoxPointType &local_map, const float *pos, vector<BoxPointType> &boxes)
+{
+    const float mov_dist = max((Trajectory_Cube_Len - 2.0f * Trajectory_Mov_Threshold * Trajectory_Det_Range) * 0.5f * 0.9f, Trajectory_Det_Range * (Trajectory_Mov_Threshold - 1));
+    boxes.clear();
+    for (int i = 0; i < 3; i++)
+    {
+        BoxPointType box = local_map;
+        if (pos[i] - local_map.vertex_min[i] <= Trajectory_Mov_Threshold * Trajectory_Det_Range)
+        {
+            local_map.vertex_max[i] -= mov_dist;
+            local_map.vertex_min[i] -= mov_dist;
+            box.vertex_min[i] = local_map.vertex_max[i];
+            boxes.push_back(box);
+        }
+        else if (local_map.vertex_max[i] - pos[i] <= Trajectory_Mov_Threshold * Trajectory_Det_Range)
+        {
+            local_map.vertex_max[i] += mov_dist;
+            local_map.vertex_min[i] += mov_dist;
+            box.vertex_max[i] = local_map.vertex_min[i];
+            boxes.push_back(box);
+        }
+    }
+}
+
+// A drive through a scene of ground and walls, as the mapping node runs it: each scan is matched against the
+// map, inserted downsampled, and the local map cube is moved and cut as lasermap_fov_segment does. Compares
+// the single tree with the forest of column trees on a straight line, where the forest drops whole columns
+// behind the sensor, and on a loop, where it keeps revisiting the same columns.
+static void bench_trajectory(const string &type, bool loop, int scan_num, mt19937 &rng)
+{
+    const int scan_size = 8000;
+    Map_Backend_Config config;
+    config.downsample_size = 0.5f;
+    config.build_thread_num = 4;
+    MAP_BACKEND<PointType>::Ptr backend = Create_Map_Backend<PointType>(type, config);
+    uniform_real_distribution<float> angle(0.0f, 2.0f * M_PI), range(2.0f, Trajectory_Det_Range), height(0.0f, 10.0f), noise(-0.02f, 0.02f);
+    auto pose = [&](int n, float *pos)
+    {
+        // 1 m per scan, the loop is a circle of 150 m radius
+        pos[0] = loop ? 150.0f * cos(n / 150.0f) : float(n);
+        pos[1] = loop ? 150.0f * sin(n / 150.0f) : 0.0f;
+        pos[2] = 1.5f;
+    };
+    auto make_scan = [&](const float *pos, PointVector &scan)
+    {
+        scan.resize(scan_size);
+        for (int i = 0; i < scan_size; i++)
+        {
+            float a = angle(rng), r = range(rng);
+            scan[i].x = pos[0] + r * cos(a);
+            scan[i].y = pos[1] + r * sin(a);
+            scan[i].z = noise(rng);
+            // Half the points land on walls every 10 m
+            if (i % 2 == 1)
+            {
+                scan[i].x = round(scan[i].x / 10.0f) * 10.0f + noise(rng);
+                scan[i].z = height(rng);
+            }
+        }
+    };
+    float pos[3];
+    PointVector scan;
+    pose(0, pos);
+    make_scan(pos, scan);
+    backend->Build(std::move(scan));
+    BoxPointType local_map;
+    for (int i = 0; i < 3; i++)
+    {
+        local_map.vertex_min[i] = pos[i] - Trajectory_Cube_Len / 2;
+        local_map.vertex_max[i] = pos[i] + Trajectory_Cube_Len / 2;
+    }
+    PointVector nearest(scan_size * Batch_Nearest_K);
+    vector<float> distance(scan_size * Batch_Nearest_K);
+    vector<int> found(scan_size);
+    vector<BoxPointType> boxes;
+    vector<double> update_time;
+    double search_time = 0.0, delete_time = 0.0;
+    size_t peak_memory = 0;
+    for (int n = 1; n < scan_num; n++)
+    {
+        pose(n, pos);
+        make_scan(pos, scan);
+        double t0 = now_sec();
+        backend->Nearest_Search_Batch(scan.data(), scan_size, nearest.data(), distance.data(), found.data(), 2.236);
+        double t1 = now_sec();
+        segment_local_map(local_map, pos, boxes);
+        if (!boxes.empty())
+            backend->Delete_Point_Boxes(boxes);
+        double t2 = now_sec();
+        backend->Add_Points(scan, true);
+        backend->Map_Updated();
+        double t3 = now_sec();
+        backend->Scan_Done();
+        search_time += t1 - t0;
+        delete_time += t2 - t1;
+        update_time.push_back(t3 - t1);
+        peak_memory = max(peak_memory, backend->memory());
+    }
+    sort(update_time.begin(), update_time.end());
+    string name = string(backend->name()) + (loop ? " loop" : " straight");
+    printf("%-21s : %7.3f ms k-NN per %d-point scan, update p50 %7.3f ms, p99 %7.3f ms, max %7.3f ms, box deletes %7.3f ms in total, %d points, %.1f MB peak\n",
+           name.c_str(), search_time * 1e3 / (scan_num - 1), scan_size, update_time[update_time.size() / 2] * 1e3,
+           update_time[update_time.size() * 99 / 100] * 1e3, update_time.back() * 1e3, delete_time * 1e3, backend->size(), peak_memory / 1048576.0);
+    record(name, "search_time", search_time * 1e3 / (scan_num - 1), "ms");
+    record(name, "update_p50", update_time[update_time.size() / 2] * 1e3, "ms");
+    record(name, "update_p99", update_time[update_time.size() * 99 / 100] * 1e3, "ms");
+    record(name, "update_max", update_time.back() * 1e3, "ms");
+    record(name, "delete_time", delete_time * 1e3, "ms");
+    record(name, "peak_memory", peak_memory / 1048576.0, "MB");
+}
+
+// A 70 degree lidar driving the loop of bench_trajectory, matched against the forest with and without the
+// map culled to its view. Differ counts the queries whose neighbours are not those of the full map.
+static void bench_fov_culling(int scan_num, mt19937 &rng)
+{
+    const int scan_size = 8000;
+    const double fov_deg = 70.0;
+    Map_Backend_Config config;
+    config.downsample_size = 0.5f;
+    MAP_BACKEND<PointType>::Ptr full = Create_Map_Backend<PointType>("ikdforest", config);
+    MAP_BACKEND<PointType>::Ptr culled = Create_Map_Backend<PointType>("ikdforest", config);
+    uniform_real_distribution<float> angle(-fov_deg / 2 * M_PI / 180, fov_deg / 2 * M_PI / 180), range(2.0f, Trajectory_Det_Range), height(0.0f, 10.0f), noise(-0.02f, 0.02f);
+    float pos[3];
+    double heading;
+    auto make_scan = [&](int n, PointVector &scan)
+    {
+        pos[0] = 150.0f * cos(n / 150.0f);
+        pos[1] = 150.0f * sin(n / 150.0f);
+        pos[2] = 1.5f;
+        heading = n / 150.0 + M_PI / 2;
+        scan.resize(scan_size);
+        for (int i = 0; i < scan_size; i++)
+        {
+            float a = heading + angle(rng), r = range(rng);
+            scan[i].x = pos[0] + r * cos(a);
+            scan[i].y = pos[1] + r * sin(a);
+            scan[i].z = noise(rng);
+            if (i % 2 == 1)
+            {
+                scan[i].x = round(scan[i].x / 10.0f) * 10.0f + noise(rng);
+                scan[i].z = height(rng);
+            }
+        }
+    };
+    PointVector scan;
+    make_scan(0, scan);
+    PointVector first_scan(scan);
+    full->Build(std::move(first_scan));
+    culled->Build(std::move(scan));
+    BoxPointType local_map;
+    for (int i = 0; i < 3; i++)
+    {
+        local_map.vertex_min[i] = pos[i] - Trajectory_Cube_Len / 2;
+        local_map.vertex_max[i] = pos[i] + Trajectory_Cube_Len / 2;
+    }
+    PointVector nearest[2];
+    vector<float> distance[2];
+    vector<int> found[2];
+    for (int j = 0; j < 2; j++)
+    {
+        nearest[j].resize(scan_size * Batch_Nearest_K);
+        distance[j].resize(scan_size * Batch_Nearest_K);
+        found[j].resize(scan_size);
+    }
+    vector<BoxPointType> boxes;
+    MAP_BACKEND<PointType>::Map_Statistics stats;
+    double search_time[2] = {0.0, 0.0}, view_time = 0.0;
+    long differ = 0, searched_points = 0, map_points = 0;
+    for (int n = 1; n < scan_num; n++)
+    {
+        make_scan(n, scan);
+        double t0 = now_sec();
+        culled->Set_View(Eigen::Vector3d(pos[0], pos[1], pos[2]), Eigen::Vector3d(cos(heading), sin(heading), 0.0), (fov_deg + 10.0) / 2 * M_PI / 180, Trajectory_Det_Range);
+        view_time += now_sec() - t0;
+        MAP_BACKEND<PointType> *backends[2] = {full.get(), culled.get()};
+        for (int j = 0; j < 2; j++)
+        {
+            t0 = now_sec();
+            backends[j]->Nearest_Search_Batch(scan.data(), scan_size, nearest[j].data(), distance[j].data(), found[j].data(), 2.236);
+            search_time[j] += now_sec() - t0;
+        }
+        for (int i = 0; i < scan_size; i++)
+        {
+            bool same = found[0][i] == found[1][i];
+            for (int k = 0; same && k < found[0][i]; k++)
+                same = distance[0][i * Batch_Nearest_K + k] == distance[1][i * Batch_Nearest_K + k];
+            differ += !same;
+        }
+        culled->Get_Statistics(stats);
+        for (size_t i = 0; i < stats.fields.size(); i++)
+            if (stats.fields[i].first == "searched_point_num")
+                searched_points += stoi(stats.fields[i].second);
+        map_points += culled->size();
+        segment_local_map(local_map, pos, boxes);
+        for (int j = 0; j < 2; j++)
+        {
+            if (!boxes.empty())
+                backends[j]->Delete_Point_Boxes(boxes);
+            backends[j]->Add_Points(scan, true);
+            backends[j]->Scan_Done();
+        }
+    }
+    printf("FOV culling %2.0f deg   : k-NN %7.3f -> %7.3f ms per %d-point scan, view update %.3f ms, %.1f%% of the map searched, %.4f%% queries differ\n",
+           fov_deg, search_time[0] * 1e3 / (scan_num - 1), search_time[1] * 1e3 / (scan_num - 1), scan_size, view_time * 1e3 / (scan_num - 1),
+           100.0 * searched_points / max(map_points, 1L), 100.0 * differ / (double(scan_size) * (scan_num - 1)));
+    record("FOV culling", "search_time_full", search_time[0] * 1e3 / (scan_num - 1), "ms");
+    record("FOV culling", "search_time_culled", search_time[1] * 1e3 / (scan_num - 1), "ms");
+    record("FOV culling", "view_time", view_time * 1e3 / (scan_num - 1), "ms");
+    record("FOV culling", "searched", 100.0 * searched_points / max(map_points, 1L), "%");
+    record("FOV culling", "differ", 100.0 * differ / (double(scan_size) * (scan_num - 1)), "%");
+}
+
+// Laps around a 60 x 40 m warehouse at 10 scans per second, where pallets show up in the aisles and are
+// moved again after 10 s. Their points are never matched once they are gone, without a point budget the map
+// keeps them for good. Matched counts the scan points off the pallets with Batch_Nearest_K neighbours within
+// the map matching gate, to check that eviction leaves the structure that is still seen in place.
+static void bench_eviction(int point_budget, int lap_num, mt19937 &rng)
+{
+    const int scan_size = 4000, lap_len = 200, pallet_num = 20;
+    const float width = 60.0f, depth = 40.0f, sensor_range = 30.0f;
+    Map_Backend_Config config;
+    config.downsample_size = 0.5f;
+    MAP_BACKEND<PointType>::Ptr backend = Create_Map_Backend<PointType>("ikdtree", config);
+    MAP_EVICTOR<PointType> evictor;
+    evictor.InitializeMapEvictor(config.downsample_size, point_budget, 60.0);
+    uniform_real_distribution<float> unit(0.0f, 1.0f), noise(-0.02f, 0.02f);
+    vector<array<float, 2>> pallets(pallet_num);
+    auto place_pallet = [&](int i)
+    {
+        pallets[i] = {{5.0f + unit(rng) * (width - 10.0f), 5.0f + unit(rng) * (depth - 10.0f)}};
+    };
+    for (int i = 0; i < pallet_num; i++)
+        place_pallet(i);
+    float pos[2];
+    auto pose = [&](int n)
+    {
+        // Rectangle 5 m inside the walls
+        float s = n % lap_len * (2 * (width - 10.0f) + 2 * (depth - 10.0f)) / lap_len;
+        if (s < width - 10.0f)
+            pos[0] = 5.0f + s, pos[1] = 5.0f;
+        else if ((s -= width - 10.0f) < depth - 10.0f)
+            pos[0] = width - 5.0f, pos[1] = 5.0f + s;
+        else if ((s -= depth - 10.0f) < width - 10.0f)
+            pos[0] = width - 5.0f - s, pos[1] = depth - 5.0f;
+        else
+            pos[0] = 5.0f, pos[1] = depth - 5.0f - (s - width + 10.0f);
+    };
+    // Static structure: floor, outer walls and racks every 10 m along x. A fifth of the points hit pallets.
+    vector<bool> on_pallet(scan_size);
+    auto make_scan = [&](PointVector &scan)
+    {
+        scan.resize(scan_size);
+        for (int i = 0; i < scan_size; i++)
+        {
+            PointType &p = scan[i];
+            float x = pos[0] + (unit(rng) * 2 - 1) * sensor_range, y = pos[1] + (unit(rng) * 2 - 1) * sensor_range;
+            x = min(max(x, 0.0f), width);
+            y = min(max(y, 0.0f), depth);
+            on_pallet[i] = i % 5 == 0;
+            int kind = i % 5;
+            if (kind == 0)
+            {
+                const array<float, 2> &pallet = pallets[i / 5 % pallet_num];
+                p.x = pallet[0] + unit(rng) * 1.2f;
+                p.y = pallet[1] + unit(rng) * 1.2f;
+                p.z = unit(rng) * 1.5f;
+            }
+            else if (kind == 1 || kind == 2)
+            {
+                p.x = x, p.y = y, p.z = noise(rng);
+            }
+            else if (kind == 3)
+            {
+                p.x = round(x / 10.0f) * 10.0f + noise(rng), p.y = y, p.z = unit(rng) * 6.0f;
+            }
+            else
+            {
+                bool along_x = unit(rng) < 0.5f;
+                p.x = along_x ? x : (unit(rng) < 0.5f ? 0.0f : width) + noise(rng);
+                p.y = along_x ? (unit(rng) < 0.5f ? 0.0f : depth) + noise(rng) : y;
+                p.z = unit(rng) * 8.0f;
+            }
+        }
+    };
+    PointVector scan, to_add, neighbours;
+    pose(0);
+    make_scan(scan);
+    evictor.Set_Time(0.0);
+    evictor.Points_Added(scan);
+    backend->Build(std::move(scan));
+    PointVector nearest(scan_size * Batch_Nearest_K);
+    vector<float> distance(scan_size * Batch_Nearest_K);
+    vector<int> found(scan_size);
+    vector<BoxPointType> boxes;
+    int scan_num = lap_num * lap_len;
+    long matched = 0, static_num = 0;
+    double search_time = 0.0, evict_time = 0.0;
+    int search_scans = 0, half_way_size = 0;
+    for (int n = 1; n < scan_num; n++)
+    {
+        if (n % 100 == 0)
+            for (int i = 0; i < pallet_num; i++)
+                place_pallet(i);
+        if (n == scan_num / 2)
+            half_way_size = backend->size();
+        pose(n);
+        make_scan(scan);
+        evictor.Set_Time(n * 0.1);
+        double t0 = now_sec();
+        backend->Nearest_Search_Batch(scan.data(), scan_size, nearest.data(), distance.data(), found.data(), 2.236);
+        if (n >= scan_num - lap_len)
+        {
+            search_time += now_sec() - t0;
+            search_scans++;
+        }
+        // Match and insert as the mapping node does: a point adds to the map only if no map point shares its
+        // downsample cube
+        to_add.clear();
+        for (int i = 0; i < scan_size; i++)
+        {
+            const PointType *near = &nearest[i * Batch_Nearest_K];
+            bool match = found[i] == Batch_Nearest_K && distance[i * Batch_Nearest_K + Batch_Nearest_K - 1] <= 5.0f;
+            if (match)
+            {
+                neighbours.assign(near, near + Batch_Nearest_K);
+                evictor.Points_Matched(neighbours);
+            }
+            if (!on_pallet[i] && n >= scan_num - lap_len)
+            {
+                static_num++;
+                matched += match;
+            }
+            bool covered = found[i] > 0 && floor(near[0].x / 0.5f) == floor(scan[i].x / 0.5f) && floor(near[0].y / 0.5f) == floor(scan[i].y / 0.5f) &&
+                           floor(near[0].z / 0.5f) == floor(scan[i].z / 0.5f);
+            if (!covered)
+                to_add.push_back(scan[i]);
+        }
+        backend->Add_Points(to_add, true);
+        evictor.Points_Added(to_add);
+        backend->Scan_Done();
+        t0 = now_sec();
+        evictor.Select_Stale(backend->size(), boxes);
+        if (!boxes.empty())
+            evictor.Points_Evicted(backend->Delete_Point_Boxes(boxes));
+        evict_time += now_sec() - t0;
+    }
+    MAP_EVICTOR<PointType>::Map_Evictor_Statistics stats;
+    evictor.Get_Statistics(stats);
+    string name = "Eviction budget " + to_string(point_budget);
+    printf("%-21s : %d laps, %d points half way, %d at the end, k-NN %7.3f ms per %d-point scan on the last lap, %.4f of static points matched, %ld evicted, %.3f ms per scan evicting, %.1f kB tracking\n",
+           name.c_str(), lap_num, half_way_size, backend->size(), search_time * 1e3 / max(search_scans, 1), scan_size, double(matched) / max(static_num, 1L),
+           stats.evicted_point_num, evict_time * 1e3 / (scan_num - 1), stats.memory / 1024.0);
+    record(name, "map_points_half_way", half_way_size, "points");
+    record(name, "map_points", backend->size(), "points");
+    record(name, "search_time", search_time * 1e3 / max(search_scans, 1), "ms");
+    record(name, "matched", double(matched) / max(static_num, 1L), "fraction");
+    record(name, "evict_time", evict_time * 1e3 / (scan_num - 1), "ms");
+}
+
+// Eviction passes on a large map: a 300 x 300 m floor and 6 m racks every 10 m along x at one point per
+// 0.5 m voxel. The map was swept row by row along y, the cells of one row last used together, and the rows
+// of the first half are stale. Each pass removes the oldest rows down to the low water mark of a budget 10 %
+// under the map size, and is timed from the selection of the cells to the end of the deletion.
+static void bench_eviction_pass(const string &type, mt19937 &rng)
+{
+    const float size = 300.0f, voxel = 0.5f;
+    const int row_num = int(size / voxel), pass_num = 200;
+    Map_Backend_Config config;
+    config.downsample_size = voxel;
+    MAP_BACKEND<PointType>::Ptr backend = Create_Map_Backend<PointType>(type, config);
+    MAP_EVICTOR<PointType> evictor;
+    uniform_real_distribution<float> jitter(0.1f * voxel, 0.9f * voxel);
+    vector<PointVector> rows(row_num);
+    for (int iy = 0; iy < row_num; iy++)
+        for (int ix = 0; ix < row_num; ix++)
+        {
+            bool rack = ix % int(10.0f / voxel) == 0;
+            for (int iz = 0; iz < (rack ? int(6.0f / voxel) : 1); iz++)
+            {
+                PointType p;
+                p.x = ix * voxel + jitter(rng), p.y = iy * voxel + jitter(rng), p.z = iz * voxel + jitter(rng);
+                rows[iy].push_back(p);
+            }
+        }
+    PointVector map_points;
+    for (const PointVector &row : rows)
+        map_points.insert(map_points.end(), row.begin(), row.end());
+    int map_size = map_points.size();
+    evictor.InitializeMapEvictor(voxel, int(map_size * 0.9), 60.0);
+    for (int iy = 0; iy < row_num; iy++)
+    {
+        evictor.Set_Time(iy * 120.0 / row_num);
+        evictor.Points_Added(rows[iy]);
+    }
+    backend->Build(std::move(map_points));
+    vector<BoxPointType> boxes;
+    vector<double> pass_time;
+    long box_num = 0, evicted = 0;
+    for (int n = 0; n < pass_num; n++)
+    {
+        evictor.Set_Time(120.0 + n * 0.1);
+        double t0 = now_sec();
+        evictor.Select_Stale(backend->size(), boxes);
+        if (boxes.empty())
+            break;
+        int removed = backend->Delete_Point_Boxes(boxes);
+        evictor.Points_Evicted(removed);
+        pass_time.push_back(now_sec() - t0);
+        box_num += boxes.size();
+        evicted += removed;
+    }
+    int passes = pass_time.size();
+    double mean = accumulate(pass_time.begin(), pass_time.end(), 0.0) / max(passes, 1);
+    double max_time = passes > 0 ? *max_element(pass_time.begin(), pass_time.end()) : 0.0;
+    string name = "Eviction pass " + type;
+    printf("%-21s : %d-point map, %d passes, %.1f boxes and %.1f points per pass, %.3f ms mean, %.3f ms max per pass\n",
+           name.c_str(), map_size, passes, double(box_num) / max(passes, 1), double(evicted) / max(passes, 1), mean * 1e3, max_time * 1e3);
+    record(name, "boxes", double(box_num) / max(passes, 1), "boxes");
+    record(name, "pass_time", mean * 1e3, "ms");
+    record(name, "pass_time_max", max_time * 1e3, "ms");
+}
+
+// Benchmark cases selectable with --case, in the order they run.
+static const vector<string> bench_cases = {"search", "approximate", "latency", "ivox", "insert", "snapshot", "rebuild",
+                                           "trajectory", "fov", "eviction", "relayout", "statistics", "delete"};
+// Cases that do not use the tree built from the map.
+static const vector<string> standalone_cases = {"trajectory", "fov", "eviction"};
+
+static void print_usage(const char *program)
+{
+    printf("Usage: %s [map_points] [query_num] [stress_seconds] [leaf_bucket_size] [build_thread_num]\n"
+           "       %*s [--pcd=<recorded map.pcd>] [--json=<results.json>] [--case=<case>[,<case>...]]\n"
+           "Cases:",
+           program, int(strlen(program)), "");
+    for (const string &name : bench_cases)
+        printf(" %s", name.c_str());
+    printf("\nWithout --case every case runs. The trajectory, fov and eviction cases run fixed-size scenes.\n");
+}
+
+// False unless the whole argument is a number at least min_value.
+static bool parse_number(const string &arg, double min_value, double &value)
+{
+    char *end = nullptr;
+    value = strtod(arg.c_str(), &end);
+    return !arg.empty() && end == arg.c_str() + arg.size() && value >= min_value;
+}
+
+int main(int argc, char **argv)
+{
+    vector<string> args, cases;
+    string pcd_path, json_path;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "-h" || arg == "--help")
+        {
+            print_usage(argv[0]);
+            return 0;
+        }
+        if (arg.compare(0, 6, "--pcd=") == 0)
+            pcd_path = arg.substr(6);
+        else if (arg.compare(0, 7, "--json=") == 0)
+            json_path = arg.substr(7);
+        else if (arg.compare(0, 7, "--case=") == 0)
+        {
+            stringstream case_list(arg.substr(7));
+            string name;
+            while (getline(case_list, name, ','))
+            {
+                if (find(bench_cases.begin(), bench_cases.end(), name) == bench_cases.end())
+                {
+                    printf("Unknown case %s\n", name.c_str());
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                cases.push_back(name);
+            }
+        }
+        else if (arg.compare(0, 1, "-") == 0 && arg.size() > 1 && !isdigit(arg[1]))
+        {
+            printf("Unknown option %s\n", arg.c_str());
+            print_usage(argv[0]);
+            return 1;
+        }
+        else
+            args.push_back(arg);
+    }
+    // Minimum of each positional argument, integers except the stress seconds
+    const double min_values[5] = {1, 1, 0.001, 0, 1};
+    double values[5] = {1000000, 200000, 10.0, 0, 1};
+    if (args.size() > 5)
+    {
+        printf("Too many arguments\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        if (!parse_number(args[i], min_values[i], values[i]) || (i != 2 && values[i] != floor(values[i])) || values[i] > INT_MAX)
+        {
+            printf("Invalid argument %s\n", args[i].c_str());
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    int map_points = int(values[0]);
+    int query_num = int(values[1]);
+    double stress_seconds = values[2];
+    int leaf_bucket_size = int(values[3]);
+    int build_thread_num = int(values[4]);
+    auto run_case = [&cases](const string &name)
+    {
+        return cases.empty() || find(cases.begin(), cases.end(), name) != cases.end();
+    };
+    bool tree_needed = false;
+    for (const string &name : bench_cases)
+        if (run_case(name) && find(standalone_cases.begin(), standalone_cases.end(), name) == standalone_cases.end())
+            tree_needed = true;
+    mt19937 rng(42);
+    PointVector map_cloud, queries;
+    if (!pcd_path.empty())
+    {
+        pcl::PointCloud<PointType> cloud;
+        if (pcl::io::loadPCDFile(pcd_path, cloud) != 0 || cloud.points.empty())
+        {
+            printf("Cannot read %s\n", pcd_path.c_str());
+            return 1;
+        }
+        recorded_points.assign(cloud.points.begin(), cloud.points.end());
+        map_cloud = recorded_points;
+        map_points = map_cloud.size();
+    }
+    else if (tree_needed)
+    {
+        generate_scene(map_points, map_cloud, rng);
+    }
+    if (tree_needed)
+        generate_scene(query_num, queries, rng);
+
+    KD_TREE<PointType> *tree = nullptr;
+    if (tree_needed)
+    {
+        // Build consumes the cloud, the voxel map comparison needs it once more.
+        PointVector ivox_cloud;
+        if (run_case("ivox"))
+            ivox_cloud = map_cloud;
+
+        tree = new KD_TREE<PointType>(0.3, 0.6, 0.2);
+        tree->Set_leaf_bucket_size(leaf_bucket_size);
+        tree->Set_build_thread_num(build_thread_num);
+        double t0 = now_sec();
+        tree->Build(std::move(map_cloud));
+        double t_build = now_sec() - t0;
+        printf("Build %d points       : %10.3f s\n", map_points, t_build);
+        record("Build", "time", t_build, "s");
+        printf("Tree object           : %10zu bytes\n", sizeof(KD_TREE<PointType>));
+        printf("Node memory           : %10.1f bytes/point (%zu-byte nodes)\n", double(tree->node_memory()) / map_points,
+               sizeof(KD_TREE<PointType>::KD_TREE_NODE));
+
+        if (run_case("search"))
+        {
+            bench_nearest_search(*tree, queries);
+            bench_nearest_search_batch(*tree, queries, 1);
+            bench_nearest_search_batch(*tree, queries, 64);
+            bench_box_search(*tree, queries, 0.5f);
+            bench_box_search(*tree, queries, 2.0f);
+            bench_radius_search(*tree, queries, 0.5f);
+            bench_radius_search(*tree, queries, 2.0f);
+        }
+        if (run_case("approximate"))
+        {
+            bench_approximate_search(*tree, queries, 0.0f, 0);
+            bench_approximate_search(*tree, queries, 0.1f, 0);
+            bench_approximate_search(*tree, queries, 0.3f, 0);
+            bench_approximate_search(*tree, queries, 0.5f, 0);
+            bench_approximate_search(*tree, queries, 1.0f, 0);
+            bench_approximate_search(*tree, queries, 0.0f, 64);
+            bench_approximate_search(*tree, queries, 0.0f, 32);
+        }
+        if (run_case("latency"))
+            bench_nearest_latency(*tree, queries, PointVector(), 0, 0);
+        if (run_case("ivox"))
+        {
+            // Fresh generators keep the workload after this comparison independent of it.
+            mt19937 ivox_rng(7);
+            bench_ivox(*tree, ivox_cloud, queries, 0.5f, IVOX<PointType>::NEARBY_FACES, ivox_rng);
+            bench_ivox(*tree, ivox_cloud, queries, 0.5f, IVOX<PointType>::NEARBY_EDGES, ivox_rng);
+            bench_ivox(*tree, ivox_cloud, queries, 1.0f, IVOX<PointType>::NEARBY_EDGES, ivox_rng);
+            PointVector().swap(ivox_cloud);
+        }
+
+        if (run_case("latency"))
+        {
+            PointVector updates;
+            generate_scene(map_points / 2, updates, rng);
+            bench_nearest_latency(*tree, queries, updates, 200, 1000);
+        }
+        if (run_case("insert"))
+        {
+            bench_bulk_insert(*tree, 1000, rng);
+            bench_bulk_insert(*tree, 10000, rng);
+            bench_bulk_insert(*tree, 50000, rng);
+            bench_downsampled_insert(*tree, 50, 20000, rng);
+            tree->Set_voxel_map_enabled(false);
+            bench_downsampled_insert(*tree, 50, 20000, rng);
+            tree->Set_voxel_map_enabled(true);
+        }
+        if (run_case("snapshot"))
+        {
+            bench_snapshot_readers(*tree, queries, 1, stress_seconds / 2, rng);
+            bench_snapshot_readers(*tree, queries, 4, stress_seconds / 2, rng);
+        }
+        if (run_case("rebuild"))
+            bench_rebuild_stall(*tree, stress_seconds, rng);
+    }
+    if (run_case("rebuild"))
+    {
+        bench_deferred_rebuild(0.0f, 1000, rng);
+        bench_deferred_rebuild(0.2f, 1000, rng);
+        bench_deferred_rebuild(1.0f, 1000, rng);
+    }
+    if (run_case("trajectory"))
+    {
+        for (const char *type : {"ikdtree", "ikdforest"})
+        {
+            mt19937 trajectory_rng(11);
+            bench_trajectory(type, false, 1000, trajectory_rng);
+            bench_trajectory(type, true, 1000, trajectory_rng);
+        }
+    }
+    if (run_case("fov"))
+    {
+        mt19937 fov_rng(13);
+        bench_fov_culling(1000, fov_rng);
+    }
+    if (run_case("eviction"))
+    {
+        // The floor, walls and racks fill about 43000 map voxels, the pallets about 8000 more over the laps
+        for (int point_budget : {0, 45000})
+        {
+            mt19937 eviction_rng(17);
+            bench_eviction(point_budget, 30, eviction_rng);
+        }
+        for (const char *type : {"ikdtree", "ikdforest"})
+        {
+            mt19937 eviction_rng(19);
+            bench_eviction_pass(type, eviction_rng);
+        }
+    }
+    if (tree != nullptr)
+    {
+        if (run_case("relayout"))
+        {
+            // After the update benchmarks above the tree has seen a long session of inserts, deletes and rebuilds
+            bench_nearest_cache(*tree, queries, "aged");
+            double t_relayout = now_sec();
+            bool relaid = tree->Relayout();
+            while (!relaid)
+            {
+                usleep(1000);
+                t_relayout = now_sec();
+                relaid = tree->Relayout();
+            }
+            printf("Relayout              : %10.3f ms\n", (now_sec() - t_relayout) * 1e3);
+            record("Relayout", "time", (now_sec() - t_relayout) * 1e3, "ms");
+            bench_nearest_cache(*tree, queries, "relaid");
+        }
+        if (run_case("statistics"))
+            bench_statistics(*tree);
+        if (run_case("delete"))
+            bench_delete_boxes(*tree, queries, 0.5f);
+        printf("Rebuild log           : high water %d operations, %zu bytes held, %d rebuilds aborted\n", tree->max_queue_size,
+               tree->rebuild_log_memory(), tree->rebuild_abort_num());
+        record("Rebuild log", "high_water", tree->max_queue_size, "operations");
+        record("Rebuild log", "aborted", tree->rebuild_abort_num(), "rebuilds");
+        delete tree;
+    }
+    if (!json_path.empty())
+    {
+        vector<pair<string, string>> config = {{"map", json_string(pcd_path.empty() ? "synthetic" : pcd_path)},
+                                               {"map_points", to_string(map_points)},
+                                               {"query_num", to_string(query_num)},
+                                               {"stress_seconds", to_string(stress_seconds)},
+                                               {"leaf_bucket_size", to_string(leaf_bucket_size)},
+                                               {"build_thread_num", to_string(build_thread_num)}};
+        string case_names;
+        for (const string &name : cases)
+            case_names += (case_names.empty() ? "" : ",") + name;
+        config.emplace_back("cases", json_string(case_names.empty() ? "all" : case_names));
+        if (!write_json(json_path, config))
+            return 1;
+        printf("Results written to %s\n", json_path.c_str());
+    }
+    return 0;
+}
@@ -4,6 +4,7 @@
 #include <cmath>
 #include "ikd-Tree/ikd_Tree.h"
 #include <Eigen/Core>
+#include <Eigen/Geometry>
 #include <algorithm>
 
 #define eps_value 1e-6
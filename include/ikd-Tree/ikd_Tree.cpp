@@ -1,4 +1,12 @@
 #include "ikd_Tree.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /*
 Description: ikd-Tree: an incremental k-d tree for robotic applications 
@@ -7,12 +15,22 @@ email: yixicai@connect.hku.hk
 */
 
 template <typename PointType>
-KD_TREE<PointType>::KD_TREE(float delete_param, float balance_param, float box_length)
+KD_TREE<PointType>::KD_TREE(float delete_param, float balance_param, float box_length, bool background_rebuild_)
 {
+    background_rebuild = background_rebuild_;
     delete_criterion_param = delete_param;
     balance_criterion_param = balance_param;
     downsample_size = box_length;
     Rebuild_Logger.clear();
+    rebuild_abort_counter.store(0);
+    background_rebuild_counter.store(0);
+    background_rebuild_nanoseconds.store(0);
+    push_down_counter.store(0);
+    leaf_bucket_bytes.store(0);
+    search_epoch.store(0);
+    search_epoch_readers[0].store(0);
+    search_epoch_readers[1].store(0);
+    snapshot_requested.store(false);
     termination_flag = false;
     start_thread();
 }
@@ -43,6 +61,7 @@ void KD_TREE<PointType>::InitTreeNode(KD_TREE_NODE *root)
     root->point.x = 0.0f;
     root->point.y = 0.0f;
     root->point.z = 0.0f;
+    root->point.intensity = 0.0f;
     root->node_range_x[0] = 0.0f;
     root->node_range_x[1] = 0.0f;
     root->node_range_y[0] = 0.0f;
@@ -54,6 +73,7 @@ void KD_TREE<PointType>::InitTreeNode(KD_TREE_NODE *root)
     root->father_ptr = nullptr;
     root->left_son_ptr = nullptr;
     root->right_son_ptr = nullptr;
+    root->bucket = nullptr;
     root->TreeSize = 0;
     root->invalid_point_num = 0;
     root->down_del_num = 0;
@@ -62,8 +82,10 @@ void KD_TREE<PointType>::InitTreeNode(KD_TREE_NODE *root)
     root->need_push_down_to_left = false;
     root->need_push_down_to_right = false;
     root->point_downsample_deleted = false;
+    root->tree_downsample_deleted = false;
     root->working_flag = false;
-    pthread_mutex_init(&(root->push_down_mutex_lock), NULL);
+    root->rebuild_pending = false;
+    root->rebuild_debt = 0;
 }
 
 template <typename PointType>
@@ -96,6 +118,99 @@ int KD_TREE<PointType>::size()
     }
 }
 
+template <typename PointType>
+size_t KD_TREE<PointType>::node_memory()
+{
+    return Node_Pool.capacity_bytes() + leaf_bucket_bytes.load();
+}
+
+template <typename PointType>
+size_t KD_TREE<PointType>::rebuild_log_memory()
+{
+    pthread_mutex_lock(&rebuild_logger_mutex_lock);
+    size_t bytes = Rebuild_Logger.memory();
+    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+    return bytes;
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::rebuild_abort_num()
+{
+    return rebuild_abort_counter.load();
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Get_Statistics(Tree_Statistics &stats)
+{
+    stats.node_num = size();
+    stats.deleted_num = stats.node_num - validnum();
+    root_alpha(stats.alpha_bal, stats.alpha_del);
+    stats.foreground_rebuild_num = foreground_rebuild_counter;
+    stats.foreground_rebuild_time = foreground_rebuild_seconds;
+    stats.background_rebuild_num = background_rebuild_counter.load();
+    stats.background_rebuild_time = background_rebuild_nanoseconds.load() * 1e-9;
+    stats.push_down_num = push_down_counter.load();
+    stats.box_delete_num = box_delete_counter;
+    stats.rebuild_debt = rebuild_debt();
+    stats.rebuild_abort_num = rebuild_abort_num();
+    stats.log_high_water = max_queue_size;
+    stats.node_bytes = node_memory();
+    stats.voxel_map_bytes = voxel_map_memory();
+    stats.rebuild_log_bytes = rebuild_log_memory();
+    // Each sample walks down from the root, stopping at a node or moving on to a son in proportion to
+    // the subtree sizes, which draws every node with the same probability.
+    int depth_samples[Stats_Depth_Bins] = {0};
+    int epoch_index = Search_Epoch_Enter();
+    KD_TREE_NODE *root = Load_Ptr(&Root_Node);
+    int tree_size = (root != nullptr) ? root->TreeSize : 0;
+    for (int i = 0; i < Stats_Depth_Samples && tree_size > 0; i++)
+    {
+        KD_TREE_NODE *node = root;
+        int depth = 0;
+        while (true)
+        {
+            // The right son's size follows from the node's, so only the son taken is loaded
+            KD_TREE_NODE *left_son = Load_Ptr(&node->left_son_ptr);
+            int left_size = (left_son != nullptr) ? left_son->TreeSize : 0;
+            int right_size = max(node->TreeSize - 1 - left_size, 0);
+            stats_random_state ^= stats_random_state << 13;
+            stats_random_state ^= stats_random_state >> 7;
+            stats_random_state ^= stats_random_state << 17;
+            int draw = int((stats_random_state >> 32) % uint64_t(left_size + right_size + 1));
+            if (draw < left_size)
+                node = left_son;
+            else if (draw < left_size + right_size && Load_Ptr(&node->right_son_ptr) != nullptr)
+                node = Load_Ptr(&node->right_son_ptr);
+            else
+                break;
+            depth++;
+        }
+        depth_samples[min(depth, Stats_Depth_Bins - 1)]++;
+    }
+    Search_Epoch_Exit(epoch_index);
+    for (int i = 0; i < Stats_Depth_Bins; i++)
+        stats.depth_histogram[i] = int(float(depth_samples[i]) * tree_size / Stats_Depth_Samples + 0.5f);
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::rebuild_debt()
+{
+    if (Root_Node == nullptr)
+        return 0;
+    // Pending subtrees inside the one on the rebuild thread go away with it
+    KD_TREE_NODE **rebuild_ptr = Rebuild_Ptr;
+    int rebuilding_debt = (rebuild_ptr != nullptr && *rebuild_ptr != nullptr) ? (*rebuild_ptr)->rebuild_debt : 0;
+    return max(Root_Node->rebuild_debt - rebuilding_debt, 0);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Set_rebuild_log_cap(int cap)
+{
+    pthread_mutex_lock(&rebuild_logger_mutex_lock);
+    Rebuild_Logger.set_max_len(cap);
+    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+}
+
 template <typename PointType>
 BoxPointType KD_TREE<PointType>::tree_range()
 {
@@ -157,7 +272,8 @@ int KD_TREE<PointType>::validnum()
         }
         else
         {
-            return -1;
+            // The root is being rebuilt, report the count it had when the rebuild started like size() does
+            return Validnum_tmp;
         }
     }
 }
@@ -167,16 +283,16 @@ void KD_TREE<PointType>::root_alpha(float &alpha_bal, float &alpha_del)
 {
     if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
     {
-        alpha_bal = Root_Node->alpha_bal;
-        alpha_del = Root_Node->alpha_del;
+        alpha_bal = root_alpha_bal;
+        alpha_del = root_alpha_del;
         return;
     }
     else
     {
         if (!pthread_mutex_trylock(&working_flag_mutex))
         {
-            alpha_bal = Root_Node->alpha_bal;
-            alpha_del = Root_Node->alpha_del;
+            alpha_bal = root_alpha_bal;
+            alpha_del = root_alpha_del;
             pthread_mutex_unlock(&working_flag_mutex);
             return;
         }
@@ -197,8 +313,11 @@ void KD_TREE<PointType>::start_thread()
     pthread_mutex_init(&rebuild_logger_mutex_lock, NULL);
     pthread_mutex_init(&points_deleted_rebuild_mutex_lock, NULL);
     pthread_mutex_init(&working_flag_mutex, NULL);
-    pthread_mutex_init(&search_flag_mutex, NULL);
-    pthread_create(&rebuild_thread, NULL, multi_thread_ptr, (void *)this);
+    pthread_mutex_init(&snapshot_mutex_lock, NULL);
+    pthread_cond_init(&snapshot_ready_cond, NULL);
+    if (!background_rebuild)
+        return;
+    rebuild_thread_started = pthread_create(&rebuild_thread, NULL, multi_thread_ptr, (void *)this) == 0;
     printf("Multi thread started \n");
 }
 
@@ -208,14 +327,15 @@ void KD_TREE<PointType>::stop_thread()
     pthread_mutex_lock(&termination_flag_mutex_lock);
     termination_flag = true;
     pthread_mutex_unlock(&termination_flag_mutex_lock);
-    if (rebuild_thread)
+    if (rebuild_thread_started)
         pthread_join(rebuild_thread, NULL);
     pthread_mutex_destroy(&termination_flag_mutex_lock);
     pthread_mutex_destroy(&rebuild_logger_mutex_lock);
     pthread_mutex_destroy(&rebuild_ptr_mutex_lock);
     pthread_mutex_destroy(&points_deleted_rebuild_mutex_lock);
     pthread_mutex_destroy(&working_flag_mutex);
-    pthread_mutex_destroy(&search_flag_mutex);
+    pthread_mutex_destroy(&snapshot_mutex_lock);
+    pthread_cond_destroy(&snapshot_ready_cond);
 }
 
 template <typename PointType>
@@ -246,39 +366,26 @@ void KD_TREE<PointType>::multi_thread_rebuild()
                 printf("\n\n\n\n\n\n\n\n\n\n\n ERROR!!! \n\n\n\n\n\n\n\n\n");
             }
             rebuild_flag = true;
+            auto t_start = chrono::steady_clock::now();
             if (*Rebuild_Ptr == Root_Node)
             {
                 Treesize_tmp = Root_Node->TreeSize;
                 Validnum_tmp = Root_Node->TreeSize - Root_Node->invalid_point_num;
-                alpha_bal_tmp = Root_Node->alpha_bal;
-                alpha_del_tmp = Root_Node->alpha_del;
+                alpha_bal_tmp = root_alpha_bal;
+                alpha_del_tmp = root_alpha_del;
             }
             KD_TREE_NODE *old_root_node = (*Rebuild_Ptr);
             father_ptr = (*Rebuild_Ptr)->father_ptr;
             PointVector().swap(Rebuild_PCL_Storage);
-            // Lock Search
-            pthread_mutex_lock(&search_flag_mutex);
-            while (search_mutex_counter != 0)
-            {
-                pthread_mutex_unlock(&search_flag_mutex);
-                usleep(1);
-                pthread_mutex_lock(&search_flag_mutex);
-            }
-            search_mutex_counter = -1;
-            pthread_mutex_unlock(&search_flag_mutex);
-            // Lock deleted points cache
-            pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
-            flatten(*Rebuild_Ptr, Rebuild_PCL_Storage, MULTI_THREAD_REC);
-            // Unlock deleted points cache
-            pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
-            // Unlock Search
-            pthread_mutex_lock(&search_flag_mutex);
-            search_mutex_counter = 0;
-            pthread_mutex_unlock(&search_flag_mutex);
+            // Read-only flatten, so searches may keep running in the subtree. Deleted points are staged
+            // in Rebuild_Points_deleted and only reported once the new subtree replaces the old one.
+            Rebuild_Points_deleted.clear();
+            flatten(*Rebuild_Ptr, Push_Down_State(), Rebuild_PCL_Storage, MULTI_THREAD_REC);
             pthread_mutex_unlock(&working_flag_mutex);
             /* Rebuild and update missed operations*/
             Operation_Logger_Type Operation;
             KD_TREE_NODE *new_root_node = nullptr;
+            bool log_overflow = false;
             if (int(Rebuild_PCL_Storage.size()) > 0)
             {
                 BuildTree(&new_root_node, 0, Rebuild_PCL_Storage.size() - 1, Rebuild_PCL_Storage);
@@ -289,7 +396,7 @@ void KD_TREE<PointType>::multi_thread_rebuild()
                 while (!Rebuild_Logger.empty())
                 {
                     Operation = Rebuild_Logger.front();
-                    max_queue_size = max(max_queue_size, Rebuild_Logger.size());
+                    max_queue_size = Rebuild_Logger.max_size();
                     Rebuild_Logger.pop();
                     pthread_mutex_unlock(&rebuild_logger_mutex_lock);
                     pthread_mutex_unlock(&working_flag_mutex);
@@ -300,38 +407,45 @@ void KD_TREE<PointType>::multi_thread_rebuild()
                     pthread_mutex_lock(&working_flag_mutex);
                     pthread_mutex_lock(&rebuild_logger_mutex_lock);
                 }
+                max_queue_size = Rebuild_Logger.max_size();
+                log_overflow = Rebuild_Logger.overflow();
+                Rebuild_Logger.clear();
                 pthread_mutex_unlock(&rebuild_logger_mutex_lock);
             }
-            /* Replace to original tree*/
-            // pthread_mutex_lock(&working_flag_mutex);
-            pthread_mutex_lock(&search_flag_mutex);
-            while (search_mutex_counter != 0)
+            if (log_overflow)
             {
-                pthread_mutex_unlock(&search_flag_mutex);
-                usleep(1);
-                pthread_mutex_lock(&search_flag_mutex);
+                /* Operations were dropped from the log, abandon the new subtree and keep the original one */
+                delete_tree_nodes(&new_root_node);
+                Rebuild_Points_deleted.clear();
+                Rebuild_Ptr = nullptr;
+                rebuild_flag = false;
+                pthread_mutex_unlock(&working_flag_mutex);
+                rebuild_abort_counter++;
+                pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+                usleep(100);
+                continue;
             }
-            search_mutex_counter = -1;
-            pthread_mutex_unlock(&search_flag_mutex);
+            /* Replace to original tree*/
+            // pthread_mutex_lock(&working_flag_mutex);
+            if (new_root_node != nullptr)
+                new_root_node->father_ptr = father_ptr;
             if (father_ptr->left_son_ptr == *Rebuild_Ptr)
             {
-                father_ptr->left_son_ptr = new_root_node;
+                Publish_Ptr(&father_ptr->left_son_ptr, new_root_node);
             }
             else if (father_ptr->right_son_ptr == *Rebuild_Ptr)
             {
-                father_ptr->right_son_ptr = new_root_node;
+                Publish_Ptr(&father_ptr->right_son_ptr, new_root_node);
             }
             else
             {
                 throw "Error: Father ptr incompatible with current node\n";
             }
-            if (new_root_node != nullptr)
-                new_root_node->father_ptr = father_ptr;
-            (*Rebuild_Ptr) = new_root_node;
+            Publish_Ptr(Rebuild_Ptr, new_root_node);
             int valid_old = old_root_node->TreeSize - old_root_node->invalid_point_num;
             int valid_new = new_root_node->TreeSize - new_root_node->invalid_point_num;
             if (father_ptr == STATIC_ROOT_NODE)
-                Root_Node = STATIC_ROOT_NODE->left_son_ptr;
+                Publish_Ptr(&Root_Node, STATIC_ROOT_NODE->left_son_ptr);
             KD_TREE_NODE *update_root = *Rebuild_Ptr;
             while (update_root != nullptr && update_root != Root_Node)
             {
@@ -344,13 +458,18 @@ void KD_TREE<PointType>::multi_thread_rebuild()
                     break;
                 Update(update_root);
             }
-            pthread_mutex_lock(&search_flag_mutex);
-            search_mutex_counter = 0;
-            pthread_mutex_unlock(&search_flag_mutex);
             Rebuild_Ptr = nullptr;
-            pthread_mutex_unlock(&working_flag_mutex);
+            // Clear the flag before releasing the writers, a writer already waiting on the mutex must not log into the next rebuild
             rebuild_flag = false;
-            /* Delete discarded tree nodes */
+            pthread_mutex_unlock(&working_flag_mutex);
+            pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
+            Multithread_Points_deleted.insert(Multithread_Points_deleted.end(), Rebuild_Points_deleted.begin(), Rebuild_Points_deleted.end());
+            pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
+            Rebuild_Points_deleted.clear();
+            background_rebuild_counter++;
+            background_rebuild_nanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t_start).count();
+            /* Delete discarded tree nodes once no search can still be inside them */
+            Wait_For_Search_Readers();
             delete_tree_nodes(&old_root_node);
         }
         else
@@ -406,48 +525,382 @@ void KD_TREE<PointType>::run_operation(KD_TREE_NODE **root, Operation_Logger_Typ
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Build(PointVector point_cloud)
+void KD_TREE<PointType>::Build(const PointVector &point_cloud)
+{
+    Build(PointVector(point_cloud));
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Build(PointVector &&point_cloud)
 {
+    PointVector Storage(std::move(point_cloud));
+    voxel_map_valid = false;
     if (Root_Node != nullptr)
     {
         delete_tree_nodes(&Root_Node);
     }
-    if (point_cloud.size() == 0)
+    if (Storage.size() == 0)
         return;
-    STATIC_ROOT_NODE = new KD_TREE_NODE;
+    STATIC_ROOT_NODE = Node_Pool.allocate();
     InitTreeNode(STATIC_ROOT_NODE);
-    BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, point_cloud.size() - 1, point_cloud);
+    BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, Storage.size() - 1, Storage);
     Update(STATIC_ROOT_NODE);
     STATIC_ROOT_NODE->TreeSize = 0;
     Root_Node = STATIC_ROOT_NODE->left_son_ptr;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist)
+bool KD_TREE<PointType>::Save(const string &path)
+{
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (fp == nullptr)
+    {
+        printf("ikd-Tree: cannot open %s for writing\n", path.c_str());
+        return false;
+    }
+    Snapshot_Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "IKDT", 4);
+    header.version = Snapshot_Version;
+    header.node_size = sizeof(Snapshot_Node);
+    bool success = fwrite(&header, sizeof(header), 1, fp) == 1;
+    int epoch_index = Search_Epoch_Enter();
+    KD_TREE_NODE *root = Load_Ptr(&Root_Node);
+    if (success && root != nullptr && !Tree_Deleted(root, Push_Down_State()))
+        success = Save_Subtree(root, Push_Down_State(), fp, header.node_num);
+    Search_Epoch_Exit(epoch_index);
+    // The node count is only known once the tree has been written
+    success = success && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+    success = (fclose(fp) == 0) && success;
+    if (!success)
+        printf("ikd-Tree: failed to write %s\n", path.c_str());
+    return success;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::Save_Subtree(KD_TREE_NODE *root, Push_Down_State state, FILE *fp, uint64_t &node_num)
+{
+    KD_TREE_NODE *left_son = Load_Ptr(&root->left_son_ptr);
+    KD_TREE_NODE *right_son = Load_Ptr(&root->right_son_ptr);
+    Push_Down_State left_state = Son_State(root, state, true);
+    Push_Down_State right_state = Son_State(root, state, false);
+    bool save_left = left_son != nullptr && !Tree_Deleted(left_son, left_state);
+    bool save_right = right_son != nullptr && !Tree_Deleted(right_son, right_state);
+    Snapshot_Node node;
+    node.x = root->point.x;
+    node.y = root->point.y;
+    node.z = root->point.z;
+    node.intensity = root->point.intensity;
+    node.division_axis = root->division_axis;
+    node.flags = 0;
+    if (Point_Deleted(root, state))
+        node.flags |= Snapshot_Point_Deleted;
+    if (root->point_downsample_deleted || (state.active && state.tree_downsample_deleted))
+        node.flags |= Snapshot_Downsample_Deleted;
+    if (save_left)
+        node.flags |= Snapshot_Left_Son;
+    if (save_right)
+        node.flags |= Snapshot_Right_Son;
+    node.reserved[0] = node.reserved[1] = 0;
+    if (fwrite(&node, sizeof(node), 1, fp) != 1)
+        return false;
+    node_num++;
+    if (save_left && !Save_Subtree(left_son, left_state, fp, node_num))
+        return false;
+    if (save_right && !Save_Subtree(right_son, right_state, fp, node_num))
+        return false;
+    return true;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::Load(const string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        printf("ikd-Tree: cannot open %s\n", path.c_str());
+        return false;
+    }
+    struct stat file_stat;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &file_stat) == 0 && size_t(file_stat.st_size) >= sizeof(Snapshot_Header))
+        data = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        printf("ikd-Tree: cannot map %s\n", path.c_str());
+        return false;
+    }
+    const Snapshot_Header *header = static_cast<const Snapshot_Header *>(data);
+    size_t node_bytes = file_stat.st_size - sizeof(Snapshot_Header);
+    if (memcmp(header->magic, "IKDT", 4) != 0 || header->version != Snapshot_Version || header->node_size != sizeof(Snapshot_Node) ||
+        header->node_num != node_bytes / sizeof(Snapshot_Node) || node_bytes % sizeof(Snapshot_Node) != 0)
+    {
+        printf("ikd-Tree: %s is not a version %d snapshot\n", path.c_str(), Snapshot_Version);
+        munmap(data, file_stat.st_size);
+        return false;
+    }
+    madvise(data, file_stat.st_size, MADV_SEQUENTIAL);
+    const Snapshot_Node *nodes = reinterpret_cast<const Snapshot_Node *>(header + 1);
+    uint64_t index = 0;
+    bool valid = true;
+    KD_TREE_NODE *new_root = nullptr;
+    if (header->node_num > 0)
+        new_root = Load_Subtree(nodes, header->node_num, index, valid);
+    valid = valid && index == header->node_num;
+    munmap(data, file_stat.st_size);
+    if (!valid)
+    {
+        printf("ikd-Tree: %s is corrupted\n", path.c_str());
+        delete_tree_nodes(&new_root);
+        return false;
+    }
+    voxel_map_valid = false;
+    if (Root_Node != nullptr)
+    {
+        delete_tree_nodes(&Root_Node);
+    }
+    if (new_root == nullptr)
+        return true;
+    STATIC_ROOT_NODE = Node_Pool.allocate();
+    InitTreeNode(STATIC_ROOT_NODE);
+    STATIC_ROOT_NODE->left_son_ptr = new_root;
+    Update(STATIC_ROOT_NODE);
+    STATIC_ROOT_NODE->TreeSize = 0;
+    Root_Node = STATIC_ROOT_NODE->left_son_ptr;
+    return true;
+}
+
+template <typename PointType>
+typename KD_TREE<PointType>::KD_TREE_NODE *KD_TREE<PointType>::Load_Subtree(const Snapshot_Node *nodes, uint64_t node_num, uint64_t &index, bool &valid)
+{
+    if (index >= node_num || nodes[index].division_axis > 2)
+    {
+        valid = false;
+        return nullptr;
+    }
+    const Snapshot_Node &node = nodes[index++];
+    KD_TREE_NODE *root = Node_Pool.allocate();
+    InitTreeNode(root);
+    root->point.x = node.x;
+    root->point.y = node.y;
+    root->point.z = node.z;
+    root->point.intensity = node.intensity;
+    root->division_axis = node.division_axis;
+    root->point_deleted = (node.flags & Snapshot_Point_Deleted) != 0;
+    root->point_downsample_deleted = (node.flags & Snapshot_Downsample_Deleted) != 0;
+    if (valid && (node.flags & Snapshot_Left_Son))
+        root->left_son_ptr = Load_Subtree(nodes, node_num, index, valid);
+    if (valid && (node.flags & Snapshot_Right_Son))
+        root->right_son_ptr = Load_Subtree(nodes, node_num, index, valid);
+    Update(root);
+    if (leaf_bucket_size > 0 && root->TreeSize > leaf_bucket_size)
+    {
+        if (root->left_son_ptr != nullptr && root->left_son_ptr->TreeSize <= leaf_bucket_size)
+            Build_Leaf_Bucket(root->left_son_ptr);
+        if (root->right_son_ptr != nullptr && root->right_son_ptr->TreeSize <= leaf_bucket_size)
+            Build_Leaf_Bucket(root->right_son_ptr);
+    }
+    return root;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::Relayout()
+{
+    if (pthread_mutex_trylock(&rebuild_ptr_mutex_lock))
+        return false;
+    if (Rebuild_Ptr != nullptr)
+    {
+        pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+        return false;
+    }
+    if (Root_Node != nullptr)
+    {
+        NODE_POOL Relayout_Pool;
+        KD_TREE_NODE *next_node = Relayout_Pool.allocate_run(Root_Node->TreeSize + 1);
+        KD_TREE_NODE *new_static_root = new (next_node++) KD_TREE_NODE(*STATIC_ROOT_NODE);
+        new_static_root->left_son_ptr = Relayout_Subtree(Root_Node, new_static_root, next_node);
+        STATIC_ROOT_NODE = new_static_root;
+        Publish_Ptr(&Root_Node, new_static_root->left_son_ptr);
+        Node_Pool.swap(Relayout_Pool);
+        // The old slabs, now held by Relayout_Pool, are freed once no search can still be inside them
+        Wait_For_Search_Readers();
+    }
+    pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+    return true;
+}
+
+template <typename PointType>
+typename KD_TREE<PointType>::KD_TREE_NODE *KD_TREE<PointType>::Relayout_Subtree(KD_TREE_NODE *root, KD_TREE_NODE *father, KD_TREE_NODE *&next_node)
+{
+    if (root == nullptr)
+        return nullptr;
+    KD_TREE_NODE *node = new (next_node++) KD_TREE_NODE(*root);
+    node->father_ptr = father;
+    node->left_son_ptr = Relayout_Subtree(root->left_son_ptr, node, next_node);
+    node->right_son_ptr = Relayout_Subtree(root->right_son_ptr, node, next_node);
+    // The bucket moves with its node but still lists the old addresses
+    if (node->bucket != nullptr)
+        Refresh_Leaf_Bucket(node);
+    return node;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist, float epsilon, int max_visit)
 {
     MANUAL_HEAP q(2 * k_nearest);
     q.clear();
+    int epoch_index = Search_Epoch_Enter();
+    Search(k_nearest, point, q, max_dist * max_dist, epsilon, max_visit);
+    Search_Epoch_Exit(epoch_index);
+    int k_found = min(k_nearest, int(q.size()));
+    PointVector().swap(Nearest_Points);
     vector<float>().swap(Point_Distance);
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    for (int i = 0; i < k_found; i++)
     {
-        Search(Root_Node, k_nearest, point, q, max_dist);
+        Nearest_Points.insert(Nearest_Points.begin(), q.top().point);
+        Point_Distance.insert(Point_Distance.begin(), q.top().dist);
+        q.pop();
     }
-    else
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Nearest_Search_Batch(const PointType *Points, int Point_Num, Batch_Search_Context &Context, PointType *Nearest_Points, float *Point_Distance, int *Found_Num, float max_dist, float epsilon, int max_visit)
+{
+    KNN_HEAP &q = Context.q;
+    float max_dist_sqr = max_dist * max_dist;
+    int epoch_index = Search_Epoch_Enter();
+    for (int i = 0; i < Point_Num; i++)
+    {
+        q.clear();
+        Search(Batch_Nearest_K, Points[i], q, max_dist_sqr, epsilon, max_visit);
+        int k_found = q.size();
+        Found_Num[i] = k_found;
+        PointType *nearest = Nearest_Points + i * Batch_Nearest_K;
+        float *distance = Point_Distance + i * Batch_Nearest_K;
+        for (int j = k_found - 1; j >= 0; j--)
+        {
+            nearest[j] = q.top().node->point;
+            distance[j] = q.top().dist;
+            q.pop();
+        }
+    }
+    Search_Epoch_Exit(epoch_index);
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage)
+{
+    Storage.clear();
+    Box_Search(Box_of_Point, [&Storage](const Node_Point &point)
+               {
+        Storage.push_back(point);
+        return true; });
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Radius_Search(PointType point, const float radius, PointVector &Storage)
+{
+    Storage.clear();
+    Radius_Search(point, radius, [&Storage](const Node_Point &point)
+                  {
+        Storage.push_back(point);
+        return true; });
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::Publish_Snapshot()
+{
+    if (!snapshot_requested.load() || chrono::duration<double>(chrono::steady_clock::now() - last_snapshot_time).count() < snapshot_interval)
+        return false;
+    if (pthread_mutex_trylock(&snapshot_mutex_lock))
+        return false;
+    // Only this thread holds the retired snapshot once use_count is 1, no reader can reach it anymore
+    if (!snapshot_storage_ready && Retired_Snapshot != nullptr && Retired_Snapshot.use_count() == 1)
+        Snapshot_Storage.swap(Retired_Snapshot->points);
+    Retired_Snapshot.reset();
+    Snapshot_Storage.clear();
+    Snapshot_Storage.reserve(max(validnum(), 0));
+    int epoch_index = Search_Epoch_Enter();
+    flatten(Load_Ptr(&Root_Node), Push_Down_State(), Snapshot_Storage, NOT_RECORD);
+    Search_Epoch_Exit(epoch_index);
+    snapshot_storage_ready = true;
+    snapshot_version++;
+    snapshot_requested = false;
+    last_snapshot_time = chrono::steady_clock::now();
+    pthread_cond_broadcast(&snapshot_ready_cond);
+    pthread_mutex_unlock(&snapshot_mutex_lock);
+    return true;
+}
+
+template <typename PointType>
+std::shared_ptr<const typename KD_TREE<PointType>::SNAPSHOT> KD_TREE<PointType>::Get_Snapshot()
+{
+    snapshot_requested = true;
+    bool first = std::atomic_load(&Snapshot) == nullptr;
+    if (first)
+    {
+        // Nothing to hand out yet, wait for the first copy of the writer
+        pthread_mutex_lock(&snapshot_mutex_lock);
+        while (!snapshot_storage_ready && std::atomic_load(&Snapshot) == nullptr)
+            pthread_cond_wait(&snapshot_ready_cond, &snapshot_mutex_lock);
+    }
+    if (first || !pthread_mutex_trylock(&snapshot_mutex_lock))
     {
-        pthread_mutex_lock(&search_flag_mutex);
-        while (search_mutex_counter == -1)
+        if (snapshot_storage_ready)
         {
-            pthread_mutex_unlock(&search_flag_mutex);
-            usleep(1);
-            pthread_mutex_lock(&search_flag_mutex);
+            Retired_Snapshot = std::move(Current_Snapshot);
+            Current_Snapshot = std::make_shared<SNAPSHOT>(std::move(Snapshot_Storage), snapshot_version);
+            std::atomic_store(&Snapshot, std::shared_ptr<const SNAPSHOT>(Current_Snapshot));
+            snapshot_storage_ready = false;
         }
-        search_mutex_counter += 1;
-        pthread_mutex_unlock(&search_flag_mutex);
-        Search(Root_Node, k_nearest, point, q, max_dist);
-        pthread_mutex_lock(&search_flag_mutex);
-        search_mutex_counter -= 1;
-        pthread_mutex_unlock(&search_flag_mutex);
+        pthread_mutex_unlock(&snapshot_mutex_lock);
     }
+    return std::atomic_load(&Snapshot);
+}
+
+template <typename PointType>
+KD_TREE<PointType>::SNAPSHOT::SNAPSHOT(vector<Node_Point> &&snapshot_points, uint64_t snapshot_version)
+    : points(std::move(snapshot_points)), division_axis(points.size(), 0), snapshot_version(snapshot_version)
+{
+    Build_Range(0, int(points.size()) - 1);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::SNAPSHOT::Build_Range(int l, int r)
+{
+    if (l >= r)
+        return;
+    int mid = (l + r) >> 1;
+    float min_value[3] = {INFINITY, INFINITY, INFINITY};
+    float max_value[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int i = l; i <= r; i++)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            min_value[axis] = min(min_value[axis], axis_value(points[i], axis));
+            max_value[axis] = max(max_value[axis], axis_value(points[i], axis));
+        }
+    }
+    int div_axis = 0;
+    for (int axis = 1; axis < 3; axis++)
+        if (max_value[axis] - min_value[axis] > max_value[div_axis] - min_value[div_axis])
+            div_axis = axis;
+    division_axis[mid] = div_axis;
+    nth_element(points.begin() + l, points.begin() + mid, points.begin() + r + 1, [div_axis](const Node_Point &a, const Node_Point &b)
+                { return axis_value(a, div_axis) < axis_value(b, div_axis); });
+    Build_Range(l, mid - 1);
+    Build_Range(mid + 1, r);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::SNAPSHOT::Nearest_Search(const PointType &point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist) const
+{
+    MANUAL_HEAP q(2 * k_nearest);
+    q.clear();
+    Search_Range(0, int(points.size()) - 1, point, k_nearest, q, max_dist * max_dist);
     int k_found = min(k_nearest, int(q.size()));
     PointVector().swap(Nearest_Points);
     vector<float>().swap(Point_Distance);
@@ -457,21 +910,79 @@ void KD_TREE<PointType>::Nearest_Search(PointType point, int k_nearest, PointVec
         Point_Distance.insert(Point_Distance.begin(), q.top().dist);
         q.pop();
     }
-    return;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage)
+void KD_TREE<PointType>::SNAPSHOT::Search_Range(int l, int r, const PointType &point, int k_nearest, MANUAL_HEAP &q, float max_dist_sqr) const
+{
+    if (l > r)
+        return;
+    int mid = (l + r) >> 1;
+    const Node_Point &node_point = points[mid];
+    float dist = calc_dist(node_point, point);
+    if (dist <= max_dist_sqr && (q.size() < k_nearest || dist < q.top().dist))
+    {
+        if (q.size() >= k_nearest)
+            q.pop();
+        q.push(PointType_CMP(node_point, dist));
+    }
+    int axis = division_axis[mid];
+    float plane_dist = axis_value(point, axis) - axis_value(node_point, axis);
+    // Points below the median sit left of it, so the half holding the query is searched first
+    bool query_left = plane_dist < 0;
+    Search_Range(query_left ? l : mid + 1, query_left ? mid - 1 : r, point, k_nearest, q, max_dist_sqr);
+    plane_dist = plane_dist * plane_dist;
+    if (plane_dist > max_dist_sqr || (q.size() >= k_nearest && plane_dist >= q.top().dist))
+        return;
+    Search_Range(query_left ? mid + 1 : l, query_left ? r : mid - 1, point, k_nearest, q, max_dist_sqr);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::SNAPSHOT::Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage) const
 {
     Storage.clear();
-    Search_by_range(Root_Node, Box_of_Point, Storage);
+    Box_Search_Range(0, int(points.size()) - 1, Box_of_Point, Storage);
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Radius_Search(PointType point, const float radius, PointVector &Storage)
+void KD_TREE<PointType>::SNAPSHOT::Box_Search_Range(int l, int r, const BoxPointType &boxpoint, PointVector &Storage) const
+{
+    if (l > r)
+        return;
+    int mid = (l + r) >> 1;
+    const Node_Point &node_point = points[mid];
+    if (boxpoint.vertex_min[0] <= node_point.x && boxpoint.vertex_max[0] > node_point.x && boxpoint.vertex_min[1] <= node_point.y && boxpoint.vertex_max[1] > node_point.y && boxpoint.vertex_min[2] <= node_point.z && boxpoint.vertex_max[2] > node_point.z)
+        Storage.push_back(node_point);
+    int axis = division_axis[mid];
+    float split = axis_value(node_point, axis);
+    if (boxpoint.vertex_min[axis] <= split)
+        Box_Search_Range(l, mid - 1, boxpoint, Storage);
+    if (boxpoint.vertex_max[axis] > split)
+        Box_Search_Range(mid + 1, r, boxpoint, Storage);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::SNAPSHOT::Radius_Search(const PointType &point, const float radius, PointVector &Storage) const
 {
     Storage.clear();
-    Search_by_radius(Root_Node, point, radius, Storage);
+    Radius_Search_Range(0, int(points.size()) - 1, point, radius * radius, Storage);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::SNAPSHOT::Radius_Search_Range(int l, int r, const PointType &point, float radius_sqr, PointVector &Storage) const
+{
+    if (l > r)
+        return;
+    int mid = (l + r) >> 1;
+    const Node_Point &node_point = points[mid];
+    if (calc_dist(node_point, point) <= radius_sqr)
+        Storage.push_back(node_point);
+    int axis = division_axis[mid];
+    float plane_dist = axis_value(point, axis) - axis_value(node_point, axis);
+    if (plane_dist <= 0 || plane_dist * plane_dist <= radius_sqr)
+        Radius_Search_Range(l, mid - 1, point, radius_sqr, Storage);
+    if (plane_dist >= 0 || plane_dist * plane_dist <= radius_sqr)
+        Radius_Search_Range(mid + 1, r, point, radius_sqr, Storage);
 }
 
 template <typename PointType>
@@ -483,7 +994,8 @@ int KD_TREE<PointType>::Add_Points(PointVector &PointToAdd, bool downsample_on)
     PointType downsample_result, mid_point;
     bool downsample_switch = downsample_on && DOWNSAMPLE_SWITCH;
     float min_dist, tmp_dist;
-    int tmp_counter = 0;
+    int tmp_counter = 0, voxel_point_num;
+    const BoxPointType Unbounded_Region = {{-INFINITY, -INFINITY, -INFINITY}, {INFINITY, INFINITY, INFINITY}};
     for (int i = 0; i < PointToAdd.size(); i++)
     {
         if (downsample_switch)
@@ -497,24 +1009,67 @@ int KD_TREE<PointType>::Add_Points(PointVector &PointToAdd, bool downsample_on)
             mid_point.x = Box_of_Point.vertex_min[0] + (Box_of_Point.vertex_max[0] - Box_of_Point.vertex_min[0]) / 2.0;
             mid_point.y = Box_of_Point.vertex_min[1] + (Box_of_Point.vertex_max[1] - Box_of_Point.vertex_min[1]) / 2.0;
             mid_point.z = Box_of_Point.vertex_min[2] + (Box_of_Point.vertex_max[2] - Box_of_Point.vertex_min[2]) / 2.0;
-            PointVector().swap(Downsample_Storage);
-            Search_by_range(Root_Node, Box_of_Point, Downsample_Storage);
             min_dist = calc_dist(PointToAdd[i], mid_point);
             downsample_result = PointToAdd[i];
-            for (int index = 0; index < Downsample_Storage.size(); index++)
+            typename VOXEL_MAP::Voxel_Entry *voxel = nullptr;
+            bool new_voxel = false;
+            if (voxel_map_enabled && !voxel_map_valid)
+                Voxel_Map_Reset();
+            if (voxel_map_valid)
+                voxel = Voxel_Map.insert(voxel_key(PointToAdd[i]), new_voxel);
+            bool voxel_representative = voxel != nullptr && voxel->state != VOXEL_MAP::Dirty;
+            if (voxel_representative)
             {
-                tmp_dist = calc_dist(Downsample_Storage[index], mid_point);
-                if (tmp_dist < min_dist)
+                // The voxel holds its representative or nothing, no need to look into the tree
+                voxel_point_num = new_voxel ? 0 : 1;
+                if (!new_voxel && voxel->dist <= min_dist)
+                    continue;
+                if (bulk_insert_enabled && (new_voxel || voxel->state >= 0))
                 {
-                    min_dist = tmp_dist;
-                    downsample_result = Downsample_Storage[index];
+                    // Empty voxel, or its representative is still waiting in the batch
+                    if (new_voxel)
+                    {
+                        voxel->state = Bulk_Storage.size();
+                        Bulk_Storage.push_back(PointToAdd[i]);
+                    }
+                    else
+                    {
+                        Bulk_Storage[voxel->state] = PointToAdd[i];
+                    }
+                    voxel->dist = min_dist;
+                    tmp_counter++;
+                    continue;
                 }
             }
+            else
+            {
+                voxel_point_num = 0;
+                Box_Search(Box_of_Point, [&](const Node_Point &point)
+                           {
+                    voxel_point_num++;
+                    tmp_dist = calc_dist(point, mid_point);
+                    if (tmp_dist < min_dist)
+                    {
+                        min_dist = tmp_dist;
+                        downsample_result = point;
+                    }
+                    return true; });
+            }
+            if (voxel != nullptr)
+            {
+                voxel->dist = min_dist;
+                voxel->state = VOXEL_MAP::In_Tree;
+            }
             if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
             {
-                if (Downsample_Storage.size() > 1 || same_point(PointToAdd[i], downsample_result))
+                if (voxel_representative && voxel_point_num == 1 && Replace_by_range(Root_Node, Box_of_Point, downsample_result, Unbounded_Region) == 1)
+                {
+                    tmp_counter++;
+                    continue;
+                }
+                if (voxel_point_num > 1 || same_point(PointToAdd[i], downsample_result))
                 {
-                    if (Downsample_Storage.size() > 0)
+                    if (voxel_point_num > 0)
                         Delete_by_range(&Root_Node, Box_of_Point, true, true);
                     Add_by_point(&Root_Node, downsample_result, true, Root_Node->division_axis);
                     tmp_counter++;
@@ -522,7 +1077,7 @@ int KD_TREE<PointType>::Add_Points(PointVector &PointToAdd, bool downsample_on)
             }
             else
             {
-                if (Downsample_Storage.size() > 1 || same_point(PointToAdd[i], downsample_result))
+                if (voxel_point_num > 1 || same_point(PointToAdd[i], downsample_result))
                 {
                     Operation_Logger_Type operation_delete, operation;
                     operation_delete.boxpoint = Box_of_Point;
@@ -530,14 +1085,14 @@ int KD_TREE<PointType>::Add_Points(PointVector &PointToAdd, bool downsample_on)
                     operation.point = downsample_result;
                     operation.op = ADD_POINT;
                     pthread_mutex_lock(&working_flag_mutex);
-                    if (Downsample_Storage.size() > 0)
+                    if (voxel_point_num > 0)
                         Delete_by_range(&Root_Node, Box_of_Point, false, true);
                     Add_by_point(&Root_Node, downsample_result, false, Root_Node->division_axis);
                     tmp_counter++;
                     if (rebuild_flag)
                     {
                         pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                        if (Downsample_Storage.size() > 0)
+                        if (voxel_point_num > 0)
                             Rebuild_Logger.push(operation_delete);
                         Rebuild_Logger.push(operation);
                         pthread_mutex_unlock(&rebuild_logger_mutex_lock);
@@ -548,6 +1103,12 @@ int KD_TREE<PointType>::Add_Points(PointVector &PointToAdd, bool downsample_on)
         }
         else
         {
+            Voxel_Map_Add(PointToAdd[i]);
+            if (bulk_insert_enabled)
+            {
+                Bulk_Storage.push_back(PointToAdd[i]);
+                continue;
+            }
             if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
             {
                 Add_by_point(&Root_Node, PointToAdd[i], true, Root_Node->division_axis);
@@ -569,12 +1130,49 @@ int KD_TREE<PointType>::Add_Points(PointVector &PointToAdd, bool downsample_on)
             }
         }
     }
+    if (!Bulk_Storage.empty())
+    {
+        if (downsample_switch && voxel_map_valid)
+        {
+            for (size_t i = 0; i < Bulk_Storage.size(); i++)
+            {
+                typename VOXEL_MAP::Voxel_Entry *voxel = Voxel_Map.find(voxel_key(Bulk_Storage[i]));
+                if (voxel != nullptr && voxel->state >= 0)
+                    voxel->state = VOXEL_MAP::In_Tree;
+            }
+        }
+        Add_Batch(Bulk_Storage);
+        Bulk_Storage.clear();
+    }
     return tmp_counter;
 }
 
+template <typename PointType>
+void KD_TREE<PointType>::Add_Batch(PointVector &Storage)
+{
+    if (Root_Node == nullptr)
+    {
+        Build(std::move(Storage));
+        return;
+    }
+    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    {
+        Add_by_batch(&Root_Node, Storage, 0, Storage.size() - 1, true);
+    }
+    else
+    {
+        pthread_mutex_lock(&working_flag_mutex);
+        Add_by_batch(&Root_Node, Storage, 0, Storage.size() - 1, false);
+        Log_Batch(Storage, 0, Storage.size() - 1);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+}
+
 template <typename PointType>
 void KD_TREE<PointType>::Add_Point_Boxes(vector<BoxPointType> &BoxPoints)
 {
+    // Restored points are not known one by one, rebuild the voxel map from the tree when next needed
+    voxel_map_valid = false;
     for (int i = 0; i < BoxPoints.size(); i++)
     {
         if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
@@ -605,6 +1203,7 @@ void KD_TREE<PointType>::Delete_Points(PointVector &PointToDel)
 {
     for (int i = 0; i < PointToDel.size(); i++)
     {
+        Voxel_Map_Delete_Point(PointToDel[i]);
         if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
         {
             Delete_by_point(&Root_Node, PointToDel[i], true);
@@ -632,6 +1231,8 @@ template <typename PointType>
 int KD_TREE<PointType>::Delete_Point_Boxes(vector<BoxPointType> &BoxPoints)
 {
     int tmp_counter = 0;
+    box_delete_counter += BoxPoints.size();
+    Voxel_Map_Delete_Boxes(BoxPoints);
     for (int i = 0; i < BoxPoints.size(); i++)
     {
         if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
@@ -657,6 +1258,93 @@ int KD_TREE<PointType>::Delete_Point_Boxes(vector<BoxPointType> &BoxPoints)
     return tmp_counter;
 }
 
+template <typename PointType>
+int64_t KD_TREE<PointType>::voxel_key(const PointType &point)
+{
+    int64_t ix = int64_t(floor(point.x / downsample_size)) & 0x1FFFFF;
+    int64_t iy = int64_t(floor(point.y / downsample_size)) & 0x1FFFFF;
+    int64_t iz = int64_t(floor(point.z / downsample_size)) & 0x1FFFFF;
+    return (ix << 42) | (iy << 21) | iz;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Voxel_Map_Reset()
+{
+    Voxel_Map.clear();
+    voxel_map_valid = true;
+    PointVector points;
+    int epoch_index = Search_Epoch_Enter();
+    flatten(Root_Node, Push_Down_State(), points, NOT_RECORD);
+    Search_Epoch_Exit(epoch_index);
+    for (size_t i = 0; i < points.size(); i++)
+        Voxel_Map_Add(points[i]);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Voxel_Map_Add(const PointType &point)
+{
+    if (!voxel_map_valid)
+        return;
+    bool new_voxel;
+    typename VOXEL_MAP::Voxel_Entry *voxel = Voxel_Map.insert(voxel_key(point), new_voxel);
+    if (!new_voxel)
+    {
+        voxel->state = VOXEL_MAP::Dirty;
+        return;
+    }
+    // Same voxel centre as Add_Points computes, so that distances compare exactly
+    PointType mid_point;
+    float vertex_min[3] = {float(floor(point.x / downsample_size) * downsample_size), float(floor(point.y / downsample_size) * downsample_size), float(floor(point.z / downsample_size) * downsample_size)};
+    mid_point.x = vertex_min[0] + ((vertex_min[0] + downsample_size) - vertex_min[0]) / 2.0;
+    mid_point.y = vertex_min[1] + ((vertex_min[1] + downsample_size) - vertex_min[1]) / 2.0;
+    mid_point.z = vertex_min[2] + ((vertex_min[2] + downsample_size) - vertex_min[2]) / 2.0;
+    voxel->dist = calc_dist(point, mid_point);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Voxel_Map_Delete_Point(const PointType &point)
+{
+    if (!voxel_map_valid)
+        return;
+    typename VOXEL_MAP::Voxel_Entry *voxel = Voxel_Map.find(voxel_key(point));
+    if (voxel != nullptr)
+        voxel->state = VOXEL_MAP::Dirty;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Voxel_Map_Delete_Boxes(const vector<BoxPointType> &BoxPoints)
+{
+    if (!voxel_map_valid)
+        return;
+    // Only the voxels of the points about to be deleted change, so they are visited instead of the whole
+    // table, at the cost of the deletion itself
+    float margin = 1e-3f * downsample_size;
+    for (const BoxPointType &box : BoxPoints)
+        Box_Search(box, [&](const Node_Point &point) {
+            int64_t index[3] = {int64_t(floor(point.x / downsample_size)), int64_t(floor(point.y / downsample_size)), int64_t(floor(point.z / downsample_size))};
+            typename VOXEL_MAP::Voxel_Entry *voxel = Voxel_Map.find(((index[0] & 0x1FFFFF) << 42) | ((index[1] & 0x1FFFFF) << 21) | (index[2] & 0x1FFFFF));
+            if (voxel == nullptr)
+                return true;
+            // A clean voxel only held this point, a dirty one is emptied only if it is well inside the box
+            bool inside = true;
+            for (int k = 0; k < 3; k++)
+            {
+                float low = index[k] * downsample_size, high = low + downsample_size;
+                if (low < box.vertex_min[k] + margin || high > box.vertex_max[k] - margin)
+                    inside = false;
+            }
+            if (voxel->state != VOXEL_MAP::Dirty || inside)
+                Voxel_Map.erase(voxel);
+            return true;
+        });
+}
+
+template <typename PointType>
+size_t KD_TREE<PointType>::voxel_map_memory()
+{
+    return Voxel_Map.memory();
+}
+
 template <typename PointType>
 void KD_TREE<PointType>::acquire_removed_points(PointVector &removed_points)
 {
@@ -677,10 +1365,25 @@ void KD_TREE<PointType>::acquire_removed_points(PointVector &removed_points)
 
 template <typename PointType>
 void KD_TREE<PointType>::BuildTree(KD_TREE_NODE **root, int l, int r, PointVector &Storage)
+{
+#ifdef _OPENMP
+    if (build_thread_num > 1 && r - l + 1 >= Parallel_Build_Point_Num)
+    {
+#pragma omp parallel num_threads(build_thread_num)
+#pragma omp single
+        Build_Subtree(root, l, r, Storage, true);
+        return;
+    }
+#endif
+    Build_Subtree(root, l, r, Storage, false);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Build_Subtree(KD_TREE_NODE **root, int l, int r, PointVector &Storage, bool spawn_tasks)
 {
     if (l > r)
         return;
-    *root = new KD_TREE_NODE;
+    *root = Node_Pool.allocate();
     InitTreeNode(*root);
     int mid = (l + r) >> 1;
     int div_axis = 0;
@@ -724,19 +1427,40 @@ void KD_TREE<PointType>::BuildTree(KD_TREE_NODE **root, int l, int r, PointVecto
     }
     (*root)->point = Storage[mid];
     KD_TREE_NODE *left_son = nullptr, *right_son = nullptr;
-    BuildTree(&left_son, l, mid - 1, Storage);
-    BuildTree(&right_son, mid + 1, r, Storage);
+    // The halves are disjoint ranges of Storage, and the node pool is locked, so they can be built concurrently
+    if (spawn_tasks && mid - l >= Parallel_Build_Point_Num)
+    {
+#ifdef _OPENMP
+#pragma omp task shared(left_son, Storage)
+#endif
+        Build_Subtree(&left_son, l, mid - 1, Storage, true);
+        Build_Subtree(&right_son, mid + 1, r, Storage, true);
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+    }
+    else
+    {
+        Build_Subtree(&left_son, l, mid - 1, Storage, false);
+        Build_Subtree(&right_son, mid + 1, r, Storage, false);
+    }
     (*root)->left_son_ptr = left_son;
     (*root)->right_son_ptr = right_son;
     Update((*root));
+    if (leaf_bucket_size > 0 && r - l + 1 > leaf_bucket_size)
+    {
+        if (left_son != nullptr && left_son->TreeSize <= leaf_bucket_size)
+            Build_Leaf_Bucket(left_son);
+        if (right_son != nullptr && right_son->TreeSize <= leaf_bucket_size)
+            Build_Leaf_Bucket(right_son);
+    }
     return;
 }
 
 template <typename PointType>
 void KD_TREE<PointType>::Rebuild(KD_TREE_NODE **root)
 {
-    KD_TREE_NODE *father_ptr;
-    if ((*root)->TreeSize >= Multi_Thread_Rebuild_Point_Num)
+    if (background_rebuild && (*root)->TreeSize >= Multi_Thread_Rebuild_Point_Num)
     {
         if (!pthread_mutex_trylock(&rebuild_ptr_mutex_lock))
         {
@@ -747,22 +1471,102 @@ void KD_TREE<PointType>::Rebuild(KD_TREE_NODE **root)
             pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
         }
     }
+    else if (rebuild_budget_ms > 0.0f && rebuild_debt() + (*root)->TreeSize <= Max_Rebuild_Debt_Percentage * Root_Node->TreeSize)
+    {
+        (*root)->rebuild_pending = true;
+        (*root)->rebuild_debt = (*root)->TreeSize;
+    }
     else
     {
-        father_ptr = (*root)->father_ptr;
-        int size_rec = (*root)->TreeSize;
-        PCL_Storage.clear();
-        flatten(*root, PCL_Storage, DELETE_POINTS_REC);
-        delete_tree_nodes(root);
-        BuildTree(root, 0, PCL_Storage.size() - 1, PCL_Storage);
-        if (*root != nullptr)
-            (*root)->father_ptr = father_ptr;
-        if (*root == Root_Node)
-            STATIC_ROOT_NODE->left_son_ptr = *root;
+        Rebuild_In_Place(root);
     }
     return;
 }
 
+template <typename PointType>
+void KD_TREE<PointType>::Rebuild_In_Place(KD_TREE_NODE **root)
+{
+    auto t_start = chrono::steady_clock::now();
+    KD_TREE_NODE *father_ptr = (*root)->father_ptr;
+    PCL_Storage.clear();
+    flatten(*root, PCL_Storage, DELETE_POINTS_REC);
+    delete_tree_nodes(root);
+    BuildTree(root, 0, PCL_Storage.size() - 1, PCL_Storage);
+    if (*root != nullptr)
+        (*root)->father_ptr = father_ptr;
+    if (*root != nullptr && (*root)->TreeSize <= leaf_bucket_size && (father_ptr == STATIC_ROOT_NODE || father_ptr->TreeSize > leaf_bucket_size))
+        Build_Leaf_Bucket(*root);
+    if (*root == Root_Node)
+        STATIC_ROOT_NODE->left_son_ptr = *root;
+    foreground_rebuild_counter++;
+    foreground_rebuild_seconds += chrono::duration<double>(chrono::steady_clock::now() - t_start).count();
+    return;
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::Run_Pending_Rebuilds()
+{
+    int debt = rebuild_debt();
+    if (debt == 0)
+        return 0;
+    // Pending subtrees keep growing while they wait. Past the cap the budget is ignored until the debt is
+    // back under half of it, so a budget too short for the scans cannot pile up debt to pay in one spike.
+    int debt_cap = Max_Rebuild_Debt_Percentage * Root_Node->TreeSize;
+    int drain_num = debt > debt_cap ? debt - debt_cap / 2 : 0;
+    int rebuild_num = 0;
+    auto deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<float, milli>(rebuild_budget_ms));
+    Rebuild_Pending(&Root_Node, deadline, drain_num, rebuild_num);
+    return rebuild_num;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::Rebuild_Pending(KD_TREE_NODE **root, chrono::steady_clock::time_point deadline, int &drain_num, int &rebuild_num)
+{
+    // Returns false once the budget is spent and drain_num points of debt are paid. The subtree of the
+    // rebuild thread is replaced as a whole.
+    if (*root == nullptr || (*root)->rebuild_debt == 0)
+        return true;
+    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root)
+        return true;
+    if ((*root)->rebuild_pending)
+    {
+        if (rebuild_num > 0 && drain_num <= 0 && chrono::steady_clock::now() >= deadline)
+            return false;
+        (*root)->rebuild_pending = false;
+        drain_num -= (*root)->TreeSize;
+        if (Criterion_Check(*root))
+        {
+            if ((*root)->TreeSize < Multi_Thread_Rebuild_Point_Num || !background_rebuild)
+            {
+                Rebuild_In_Place(root);
+                rebuild_num++;
+                return true;
+            }
+            // Grown past the threshold while it waited. If the rebuild thread is busy the subtree is
+            // walked like any other, so the pending subtrees inside it still get their turn.
+            Rebuild(root);
+            if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root)
+            {
+                (*root)->rebuild_debt = 0;
+                return true;
+            }
+        }
+    }
+    (*root)->working_flag = true;
+    Push_Down(*root);
+    KD_TREE_NODE **first = &((*root)->left_son_ptr);
+    KD_TREE_NODE **second = &((*root)->right_son_ptr);
+    if (*second != nullptr && (*first == nullptr || (*second)->rebuild_debt > (*first)->rebuild_debt))
+        swap(first, second);
+    bool in_budget = Rebuild_Pending(first, deadline, drain_num, rebuild_num);
+    if (in_budget)
+        in_budget = Rebuild_Pending(second, deadline, drain_num, rebuild_num);
+    Update(*root);
+    Refresh_Leaf_Bucket(*root);
+    (*root)->working_flag = false;
+    return in_budget;
+}
+
 template <typename PointType>
 int KD_TREE<PointType>::Delete_by_range(KD_TREE_NODE **root, BoxPointType boxpoint, bool allow_rebuild, bool is_downsample)
 {
@@ -791,6 +1595,7 @@ int KD_TREE<PointType>::Delete_by_range(KD_TREE_NODE **root, BoxPointType boxpoi
             (*root)->point_downsample_deleted = true;
             (*root)->down_del_num = (*root)->TreeSize;
         }
+        Refresh_Leaf_Bucket(*root);
         return tmp_counter;
     }
     if (!(*root)->point_deleted && boxpoint.vertex_min[0] <= (*root)->point.x && boxpoint.vertex_max[0] > (*root)->point.x && boxpoint.vertex_min[1] <= (*root)->point.y && boxpoint.vertex_max[1] > (*root)->point.y && boxpoint.vertex_min[2] <= (*root)->point.z && boxpoint.vertex_max[2] > (*root)->point.z)
@@ -821,33 +1626,97 @@ int KD_TREE<PointType>::Delete_by_range(KD_TREE_NODE **root, BoxPointType boxpoi
             Rebuild_Logger.push(delete_box_log);
             pthread_mutex_unlock(&rebuild_logger_mutex_lock);
         }
-        pthread_mutex_unlock(&working_flag_mutex);
-    }
-    if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr)
-    {
-        tmp_counter += Delete_by_range(&((*root)->right_son_ptr), boxpoint, allow_rebuild, is_downsample);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr)
+    {
+        tmp_counter += Delete_by_range(&((*root)->right_son_ptr), boxpoint, allow_rebuild, is_downsample);
+    }
+    else
+    {
+        pthread_mutex_lock(&working_flag_mutex);
+        tmp_counter += Delete_by_range(&((*root)->right_son_ptr), boxpoint, false, is_downsample);
+        if (rebuild_flag)
+        {
+            pthread_mutex_lock(&rebuild_logger_mutex_lock);
+            Rebuild_Logger.push(delete_box_log);
+            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+        }
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    Update(*root);
+    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num)
+        Rebuild_Ptr = nullptr;
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild)
+        Rebuild(root);
+    if ((*root) != nullptr)
+    {
+        Refresh_Leaf_Bucket(*root);
+        (*root)->working_flag = false;
+    }
+    return tmp_counter;
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::Replace_by_range(KD_TREE_NODE *root, const BoxPointType &boxpoint, const PointType &point, BoxPointType region)
+{
+    if (root == nullptr || root->tree_deleted)
+        return 0;
+    if (boxpoint.vertex_max[0] <= root->node_range_x[0] || boxpoint.vertex_min[0] > root->node_range_x[1])
+        return 0;
+    if (boxpoint.vertex_max[1] <= root->node_range_y[0] || boxpoint.vertex_min[1] > root->node_range_y[1])
+        return 0;
+    if (boxpoint.vertex_max[2] <= root->node_range_z[0] || boxpoint.vertex_min[2] > root->node_range_z[1])
+        return 0;
+    // The rebuild thread copies this subtree, changes have to go through the operation log
+    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == root)
+        return -1;
+    root->working_flag = true;
+    Push_Down(root);
+    int axis = root->division_axis;
+    float split = (axis == 0) ? root->point.x : ((axis == 1) ? root->point.y : root->point.z);
+    int result = 0;
+    if (!root->point_deleted && boxpoint.vertex_min[0] <= root->point.x && boxpoint.vertex_max[0] > root->point.x && boxpoint.vertex_min[1] <= root->point.y && boxpoint.vertex_max[1] > root->point.y && boxpoint.vertex_min[2] <= root->point.z && boxpoint.vertex_max[2] > root->point.z)
+    {
+        // The node keeps its place only if the new point still separates its sons and stays on the side
+        // of every ancestor the node was inserted on, so that point lookups keep finding it.
+        float new_split = (axis == 0) ? point.x : ((axis == 1) ? point.y : point.z);
+        float left_max = -INFINITY, right_min = INFINITY;
+        if (root->left_son_ptr != nullptr)
+            left_max = (axis == 0) ? root->left_son_ptr->node_range_x[1] : ((axis == 1) ? root->left_son_ptr->node_range_y[1] : root->left_son_ptr->node_range_z[1]);
+        if (root->right_son_ptr != nullptr)
+            right_min = (axis == 0) ? root->right_son_ptr->node_range_x[0] : ((axis == 1) ? root->right_son_ptr->node_range_y[0] : root->right_son_ptr->node_range_z[0]);
+        bool in_region = region.vertex_min[0] <= point.x && point.x < region.vertex_max[0] && region.vertex_min[1] <= point.y && point.y < region.vertex_max[1] && region.vertex_min[2] <= point.z && point.z < region.vertex_max[2];
+        if (in_region && left_max < new_split && new_split <= right_min)
+        {
+            root->point = point;
+            result = 1;
+        }
+        else
+        {
+            result = -1;
+        }
     }
     else
     {
-        pthread_mutex_lock(&working_flag_mutex);
-        tmp_counter += Delete_by_range(&((*root)->right_son_ptr), boxpoint, false, is_downsample);
-        if (rebuild_flag)
+        BoxPointType son_region = region;
+        son_region.vertex_max[axis] = split;
+        result = Replace_by_range(root->left_son_ptr, boxpoint, point, son_region);
+        if (result == 0)
         {
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
-            Rebuild_Logger.push(delete_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            son_region = region;
+            son_region.vertex_min[axis] = split;
+            result = Replace_by_range(root->right_son_ptr, boxpoint, point, son_region);
         }
-        pthread_mutex_unlock(&working_flag_mutex);
     }
-    Update(*root);
-    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num)
-        Rebuild_Ptr = nullptr;
-    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
-    if (need_rebuild)
-        Rebuild(root);
-    if ((*root) != nullptr)
-        (*root)->working_flag = false;
-    return tmp_counter;
+    if (result == 1)
+    {
+        Update(root);
+        Refresh_Leaf_Bucket(root);
+    }
+    root->working_flag = false;
+    return result;
 }
 
 template <typename PointType>
@@ -863,6 +1732,7 @@ void KD_TREE<PointType>::Delete_by_point(KD_TREE_NODE **root, PointType point, b
         (*root)->invalid_point_num += 1;
         if ((*root)->invalid_point_num == (*root)->TreeSize)
             (*root)->tree_deleted = true;
+        Refresh_Leaf_Bucket(*root);
         return;
     }
     Operation_Logger_Type delete_log;
@@ -914,10 +1784,86 @@ void KD_TREE<PointType>::Delete_by_point(KD_TREE_NODE **root, PointType point, b
     if (need_rebuild)
         Rebuild(root);
     if ((*root) != nullptr)
+    {
+        Refresh_Leaf_Bucket(*root);
+        (*root)->working_flag = false;
+    }
+    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Add_by_batch(KD_TREE_NODE **root, PointVector &Storage, int l, int r, bool allow_rebuild)
+{
+    if (l > r)
+        return;
+    if (*root == nullptr)
+    {
+        // The partition reached an empty son and becomes a balanced subtree in one go
+        BuildTree(root, l, r, Storage);
+        return;
+    }
+    (*root)->working_flag = true;
+    Push_Down(*root);
+    int axis = (*root)->division_axis;
+    float split = (axis == 0) ? (*root)->point.x : ((axis == 1) ? (*root)->point.y : (*root)->point.z);
+    // Same side rule as Add_by_point: strictly smaller goes left
+    auto first_right = partition(begin(Storage) + l, begin(Storage) + r + 1, [axis, split](const PointType &point) {
+        return ((axis == 0) ? point.x : ((axis == 1) ? point.y : point.z)) < split;
+    });
+    int mid = first_right - begin(Storage);
+    if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr)
+    {
+        Add_by_batch(&(*root)->left_son_ptr, Storage, l, mid - 1, allow_rebuild);
+    }
+    else
+    {
+        pthread_mutex_lock(&working_flag_mutex);
+        Add_by_batch(&(*root)->left_son_ptr, Storage, l, mid - 1, false);
+        Log_Batch(Storage, l, mid - 1);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr)
+    {
+        Add_by_batch(&(*root)->right_son_ptr, Storage, mid, r, allow_rebuild);
+    }
+    else
+    {
+        pthread_mutex_lock(&working_flag_mutex);
+        Add_by_batch(&(*root)->right_son_ptr, Storage, mid, r, false);
+        Log_Batch(Storage, mid, r);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    Update(*root);
+    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num)
+        Rebuild_Ptr = nullptr;
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild)
+        Rebuild(root);
+    if ((*root) != nullptr)
+    {
+        Refresh_Leaf_Bucket(*root);
         (*root)->working_flag = false;
+    }
     return;
 }
 
+// Called with working_flag_mutex held: replays a batch that went into the subtree being rebuilt
+template <typename PointType>
+void KD_TREE<PointType>::Log_Batch(PointVector &Storage, int l, int r)
+{
+    if (!rebuild_flag)
+        return;
+    Operation_Logger_Type operation;
+    operation.op = ADD_POINT;
+    pthread_mutex_lock(&rebuild_logger_mutex_lock);
+    for (int i = l; i <= r; i++)
+    {
+        operation.point = Storage[i];
+        Rebuild_Logger.push(operation);
+    }
+    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+}
+
 template <typename PointType>
 void KD_TREE<PointType>::Add_by_range(KD_TREE_NODE **root, BoxPointType boxpoint, bool allow_rebuild)
 {
@@ -938,6 +1884,7 @@ void KD_TREE<PointType>::Add_by_range(KD_TREE_NODE **root, BoxPointType boxpoint
         (*root)->need_push_down_to_left = true;
         (*root)->need_push_down_to_right = true;
         (*root)->invalid_point_num = (*root)->down_del_num;
+        Refresh_Leaf_Bucket(*root);
         return;
     }
     if (boxpoint.vertex_min[0] <= (*root)->point.x && boxpoint.vertex_max[0] > (*root)->point.x && boxpoint.vertex_min[1] <= (*root)->point.y && boxpoint.vertex_max[1] > (*root)->point.y && boxpoint.vertex_min[2] <= (*root)->point.z && boxpoint.vertex_max[2] > (*root)->point.z)
@@ -987,7 +1934,10 @@ void KD_TREE<PointType>::Add_by_range(KD_TREE_NODE **root, BoxPointType boxpoint
     if (need_rebuild)
         Rebuild(root);
     if ((*root) != nullptr)
+    {
+        Refresh_Leaf_Bucket(*root);
         (*root)->working_flag = false;
+    }
     return;
 }
 
@@ -996,7 +1946,7 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE **root, PointType point, bool
 {
     if (*root == nullptr)
     {
-        *root = new KD_TREE_NODE;
+        *root = Node_Pool.allocate();
         InitTreeNode(*root);
         (*root)->point = point;
         (*root)->division_axis = (father_axis + 1) % 3;
@@ -1054,281 +2004,301 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE **root, PointType point, bool
     if (need_rebuild)
         Rebuild(root);
     if ((*root) != nullptr)
+    {
+        Refresh_Leaf_Bucket(*root);
         (*root)->working_flag = false;
+    }
     return;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Search(KD_TREE_NODE *root, int k_nearest, PointType point, MANUAL_HEAP &q, float max_dist)
+template <typename Heap_Type>
+void KD_TREE<PointType>::Search(int k_nearest, const PointType &point, Heap_Type &q, float max_dist_sqr, float epsilon, int max_visit)
 {
-    if (root == nullptr || root->tree_deleted)
-        return;
-    float cur_dist = calc_box_dist(root, point);
-    float max_dist_sqr = max_dist * max_dist;
-    if (cur_dist > max_dist_sqr)
-        return;
-    int retval;
-    if (root->need_push_down_to_left || root->need_push_down_to_right)
-    {
-        retval = pthread_mutex_trylock(&(root->push_down_mutex_lock));
-        if (retval == 0)
-        {
-            Push_Down(root);
-            pthread_mutex_unlock(&(root->push_down_mutex_lock));
-        }
-        else
-        {
-            pthread_mutex_lock(&(root->push_down_mutex_lock));
-            pthread_mutex_unlock(&(root->push_down_mutex_lock));
-        }
-    }
-    if (!root->point_deleted)
-    {
-        float dist = calc_dist(point, root->point);
-        if (dist <= max_dist_sqr && (q.size() < k_nearest || dist < q.top().dist))
-        {
-            if (q.size() >= k_nearest)
-                q.pop();
-            PointType_CMP current_point{root->point, dist};
-            q.push(current_point);
-        }
-    }
-    int cur_search_counter;
-    float dist_left_node = calc_box_dist(root->left_son_ptr, point);
-    float dist_right_node = calc_box_dist(root->right_son_ptr, point);
-    if (q.size() < k_nearest || dist_left_node < q.top().dist && dist_right_node < q.top().dist)
-    {
-        if (dist_left_node <= dist_right_node)
-        {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr)
-            {
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-            }
-            else
-            {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
-            if (q.size() < k_nearest || dist_right_node < q.top().dist)
-            {
-                if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr)
-                {
-                    Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-                }
-                else
-                {
-                    pthread_mutex_lock(&search_flag_mutex);
-                    while (search_mutex_counter == -1)
-                    {
-                        pthread_mutex_unlock(&search_flag_mutex);
-                        usleep(1);
-                        pthread_mutex_lock(&search_flag_mutex);
-                    }
-                    search_mutex_counter += 1;
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-                    pthread_mutex_lock(&search_flag_mutex);
-                    search_mutex_counter -= 1;
-                    pthread_mutex_unlock(&search_flag_mutex);
-                }
-            }
-        }
-        else
+    /* Depth-first: descend into the nearer son directly and keep the farther one on an explicit
+       stack. The caller holds a search epoch, so every node reached stays allocated until the
+       search returns even if the rebuild thread swaps its subtree out meanwhile. */
+    SEARCH_STACK stack;
+    KD_TREE_NODE *node = Load_Ptr(&Root_Node);
+    Push_Down_State state;
+    // Branch distances are scaled up before the comparison with the k-th neighbour, 1 for the exact search
+    float prune_scale = (1.0f + epsilon) * (1.0f + epsilon);
+    int visit_num = 0;
+    if (calc_box_dist(node, point) > max_dist_sqr)
+        node = nullptr;
+    while (true)
+    {
+        while (node != nullptr)
         {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr)
+            if (Tree_Deleted(node, state))
+                break;
+            // A pending push down from above may revive points the bucket does not list.
+            if (node->bucket != nullptr && !state.active)
             {
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);
+                Search_Leaf_Bucket(node->bucket, point, k_nearest, q, max_dist_sqr);
+                visit_num += node->bucket->size;
+                break;
             }
-            else
+            if (!Point_Deleted(node, state))
             {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
+                float dist = calc_dist(point, node->point);
+                if (dist <= max_dist_sqr && (!heap_full(q, k_nearest) || dist < q.top().dist))
+                    heap_insert(q, k_nearest, dist, node);
+                visit_num++;
             }
-            if (q.size() < k_nearest || dist_left_node < q.top().dist)
+            KD_TREE_NODE *near_son = Load_Ptr(&node->left_son_ptr), *far_son = Load_Ptr(&node->right_son_ptr);
+            bool near_is_left = true;
+            float near_dist = calc_box_dist(near_son, point);
+            float far_dist = calc_box_dist(far_son, point);
+            if (far_dist < near_dist)
             {
-                if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr)
-                {
-                    Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-                }
-                else
-                {
-                    pthread_mutex_lock(&search_flag_mutex);
-                    while (search_mutex_counter == -1)
-                    {
-                        pthread_mutex_unlock(&search_flag_mutex);
-                        usleep(1);
-                        pthread_mutex_lock(&search_flag_mutex);
-                    }
-                    search_mutex_counter += 1;
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-                    pthread_mutex_lock(&search_flag_mutex);
-                    search_mutex_counter -= 1;
-                    pthread_mutex_unlock(&search_flag_mutex);
-                }
+                swap(near_son, far_son);
+                swap(near_dist, far_dist);
+                near_is_left = false;
             }
-        }
-    }
-    else
-    {
-        if (dist_left_node < q.top().dist)
-        {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr)
+            bool full = heap_full(q, k_nearest);
+            if (far_dist <= max_dist_sqr && (!full || far_dist * prune_scale < q.top().dist))
+                stack.push(far_son, far_dist, Son_State(node, state, !near_is_left));
+            if (near_dist <= max_dist_sqr && (!full || near_dist * prune_scale < q.top().dist))
             {
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);
+                state = Son_State(node, state, near_is_left);
+                node = near_son;
             }
             else
             {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
+                node = nullptr;
             }
         }
-        if (dist_right_node < q.top().dist)
+        if (stack.empty() || (max_visit > 0 && visit_num >= max_visit && heap_full(q, k_nearest)))
+            break;
+        Search_Stack_Entry cur = stack.pop();
+        node = nullptr;
+        if (!heap_full(q, k_nearest) || cur.box_dist * prune_scale < q.top().dist)
         {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr)
-            {
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-            }
-            else
-            {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
+            node = cur.node;
+            state = cur.state;
         }
     }
     return;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector &Storage)
+template <typename Heap_Type>
+void KD_TREE<PointType>::Search_Leaf_Bucket(const LEAF_BUCKET *bucket, const PointType &point, int k_nearest, Heap_Type &q, float max_dist_sqr)
 {
-    if (root == nullptr)
-        return;
-    Push_Down(root);
-    if (boxpoint.vertex_max[0] <= root->node_range_x[0] || boxpoint.vertex_min[0] > root->node_range_x[1])
-        return;
-    if (boxpoint.vertex_max[1] <= root->node_range_y[0] || boxpoint.vertex_min[1] > root->node_range_y[1])
-        return;
-    if (boxpoint.vertex_max[2] <= root->node_range_z[0] || boxpoint.vertex_min[2] > root->node_range_z[1])
-        return;
-    if (boxpoint.vertex_min[0] <= root->node_range_x[0] && boxpoint.vertex_max[0] > root->node_range_x[1] && boxpoint.vertex_min[1] <= root->node_range_y[0] && boxpoint.vertex_max[1] > root->node_range_y[1] && boxpoint.vertex_min[2] <= root->node_range_z[0] && boxpoint.vertex_max[2] > root->node_range_z[1])
-    {
-        flatten(root, Storage, NOT_RECORD);
-        return;
-    }
-    if (boxpoint.vertex_min[0] <= root->point.x && boxpoint.vertex_max[0] > root->point.x && boxpoint.vertex_min[1] <= root->point.y && boxpoint.vertex_max[1] > root->point.y && boxpoint.vertex_min[2] <= root->point.z && boxpoint.vertex_max[2] > root->point.z)
-    {
-        if (!root->point_deleted)
-            Storage.push_back(root->point);
-    }
-    if ((Rebuild_Ptr == nullptr) || root->left_son_ptr != *Rebuild_Ptr)
-    {
-        Search_by_range(root->left_son_ptr, boxpoint, Storage);
-    }
-    else
-    {
-        pthread_mutex_lock(&search_flag_mutex);
-        Search_by_range(root->left_son_ptr, boxpoint, Storage);
-        pthread_mutex_unlock(&search_flag_mutex);
-    }
-    if ((Rebuild_Ptr == nullptr) || root->right_son_ptr != *Rebuild_Ptr)
+    float dist[Leaf_Bucket_Max];
+    bucket_dist(bucket, point, dist);
+    for (int i = 0; i < bucket->size; i++)
     {
-        Search_by_range(root->right_son_ptr, boxpoint, Storage);
+        if (dist[i] <= max_dist_sqr && (!heap_full(q, k_nearest) || dist[i] < q.top().dist))
+            heap_insert(q, k_nearest, dist[i], bucket->nodes[i]);
     }
-    else
-    {
-        pthread_mutex_lock(&search_flag_mutex);
-        Search_by_range(root->right_son_ptr, boxpoint, Storage);
-        pthread_mutex_unlock(&search_flag_mutex);
-    }
-    return;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Search_by_radius(KD_TREE_NODE *root, PointType point, float radius, PointVector &Storage)
+void KD_TREE<PointType>::bucket_dist(const LEAF_BUCKET *bucket, const PointType &point, float *dist)
 {
-    if (root == nullptr)
+    // Bucket arrays are padded to a multiple of 8, so the vector loops need no scalar tail.
+    int i = 0;
+#if defined(__AVX__)
+    __m256 px = _mm256_set1_ps(point.x), py = _mm256_set1_ps(point.y), pz = _mm256_set1_ps(point.z);
+    for (; i < bucket->size; i += 8)
+    {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(bucket->x + i), px);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(bucket->y + i), py);
+        __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(bucket->z + i), pz);
+        __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+        _mm256_storeu_ps(dist + i, d);
+    }
+#elif defined(__SSE2__)
+    __m128 px = _mm_set1_ps(point.x), py = _mm_set1_ps(point.y), pz = _mm_set1_ps(point.z);
+    for (; i < bucket->size; i += 4)
+    {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(bucket->x + i), px);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(bucket->y + i), py);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(bucket->z + i), pz);
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        _mm_storeu_ps(dist + i, d);
+    }
+#elif defined(__ARM_NEON)
+    float32x4_t px = vdupq_n_f32(point.x), py = vdupq_n_f32(point.y), pz = vdupq_n_f32(point.z);
+    for (; i < bucket->size; i += 4)
+    {
+        float32x4_t dx = vsubq_f32(vld1q_f32(bucket->x + i), px);
+        float32x4_t dy = vsubq_f32(vld1q_f32(bucket->y + i), py);
+        float32x4_t dz = vsubq_f32(vld1q_f32(bucket->z + i), pz);
+        float32x4_t d = vaddq_f32(vaddq_f32(vmulq_f32(dx, dx), vmulq_f32(dy, dy)), vmulq_f32(dz, dz));
+        vst1q_f32(dist + i, d);
+    }
+#else
+    for (; i < bucket->size; i++)
+    {
+        float dx = bucket->x[i] - point.x, dy = bucket->y[i] - point.y, dz = bucket->z[i] - point.z;
+        dist[i] = dx * dx + dy * dy + dz * dz;
+    }
+#endif
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Build_Leaf_Bucket(KD_TREE_NODE *root)
+{
+    int capacity = (leaf_bucket_size + 7) / 8 * 8;
+    size_t bytes = sizeof(LEAF_BUCKET) + capacity * (sizeof(KD_TREE_NODE *) + 3 * sizeof(float));
+    char *block = static_cast<char *>(::operator new(bytes));
+    LEAF_BUCKET *bucket = reinterpret_cast<LEAF_BUCKET *>(block);
+    bucket->capacity = capacity;
+    bucket->nodes = reinterpret_cast<KD_TREE_NODE **>(block + sizeof(LEAF_BUCKET));
+    bucket->x = reinterpret_cast<float *>(bucket->nodes + capacity);
+    bucket->y = bucket->x + capacity;
+    bucket->z = bucket->y + capacity;
+    leaf_bucket_bytes += bytes;
+    root->bucket = bucket;
+    Refresh_Leaf_Bucket(root);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Refresh_Leaf_Bucket(KD_TREE_NODE *root)
+{
+    if (root == nullptr || root->bucket == nullptr)
         return;
-    Push_Down(root);
-    PointType range_center;
-    range_center.x = (root->node_range_x[0] + root->node_range_x[1]) * 0.5;
-    range_center.y = (root->node_range_y[0] + root->node_range_y[1]) * 0.5;
-    range_center.z = (root->node_range_z[0] + root->node_range_z[1]) * 0.5;
-    float dist = sqrt(calc_dist(range_center, point));
-    if (dist > radius + sqrt(root->radius_sq)) return;
-    if (dist <= radius - sqrt(root->radius_sq)) 
-    {
-        flatten(root, Storage, NOT_RECORD);
+    LEAF_BUCKET *bucket = root->bucket;
+    if (root->TreeSize > bucket->capacity)
+    {
+        // Outgrown: hand the bucket down to the sons, which are small enough again.
+        Release_Leaf_Bucket(root);
+        if (root->left_son_ptr != nullptr && root->left_son_ptr->TreeSize <= leaf_bucket_size)
+            Build_Leaf_Bucket(root->left_son_ptr);
+        if (root->right_son_ptr != nullptr && root->right_son_ptr->TreeSize <= leaf_bucket_size)
+            Build_Leaf_Bucket(root->right_son_ptr);
         return;
     }
-    if (!root->point_deleted && calc_dist(root->point, point) <= radius * radius){
-        Storage.push_back(root->point);
-    }
-    if ((Rebuild_Ptr == nullptr) || root->left_son_ptr != *Rebuild_Ptr)
+    bucket->size = 0;
+    Fill_Leaf_Bucket(root, Push_Down_State(), bucket);
+    for (int i = bucket->size; i < bucket->capacity; i++)
     {
-        Search_by_radius(root->left_son_ptr, point, radius, Storage);
+        bucket->x[i] = 0.0f;
+        bucket->y[i] = 0.0f;
+        bucket->z[i] = 0.0f;
     }
-    else
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Release_Leaf_Bucket(KD_TREE_NODE *root)
+{
+    if (root->bucket == nullptr)
+        return;
+    leaf_bucket_bytes -= sizeof(LEAF_BUCKET) + root->bucket->capacity * (sizeof(KD_TREE_NODE *) + 3 * sizeof(float));
+    ::operator delete(root->bucket);
+    root->bucket = nullptr;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Fill_Leaf_Bucket(KD_TREE_NODE *root, Push_Down_State state, LEAF_BUCKET *bucket)
+{
+    if (root == nullptr || Tree_Deleted(root, state))
+        return;
+    if (!Point_Deleted(root, state))
     {
-        pthread_mutex_lock(&search_flag_mutex);
-        Search_by_radius(root->left_son_ptr, point, radius, Storage);
-        pthread_mutex_unlock(&search_flag_mutex);
+        bucket->x[bucket->size] = root->point.x;
+        bucket->y[bucket->size] = root->point.y;
+        bucket->z[bucket->size] = root->point.z;
+        bucket->nodes[bucket->size] = root;
+        bucket->size++;
     }
-    if ((Rebuild_Ptr == nullptr) || root->right_son_ptr != *Rebuild_Ptr)
+    Fill_Leaf_Bucket(root->left_son_ptr, Son_State(root, state, true), bucket);
+    Fill_Leaf_Bucket(root->right_son_ptr, Son_State(root, state, false), bucket);
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::Search_Epoch_Enter()
+{
+    while (true)
     {
-        Search_by_radius(root->right_son_ptr, point, radius, Storage);
+        int epoch_index = search_epoch.load() & 1;
+        search_epoch_readers[epoch_index].fetch_add(1);
+        if (int(search_epoch.load() & 1) == epoch_index)
+            return epoch_index;
+        search_epoch_readers[epoch_index].fetch_sub(1);
     }
-    else
-    {
-        pthread_mutex_lock(&search_flag_mutex);
-        Search_by_radius(root->right_son_ptr, point, radius, Storage);
-        pthread_mutex_unlock(&search_flag_mutex);
-    }    
-    return;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Search_Epoch_Exit(int epoch_index)
+{
+    search_epoch_readers[epoch_index].fetch_sub(1);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Wait_For_Search_Readers()
+{
+    // Searches entering after the flip can only reach the subtrees published before it.
+    int epoch_index = search_epoch.fetch_add(1) & 1;
+    while (search_epoch_readers[epoch_index].load() != 0)
+        usleep(1);
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::Tree_Deleted(KD_TREE_NODE *root, const Push_Down_State &state)
+{
+    if (!state.active)
+        return root->tree_deleted;
+    return state.tree_deleted || state.tree_downsample_deleted || root->tree_downsample_deleted;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::Point_Deleted(KD_TREE_NODE *root, const Push_Down_State &state)
+{
+    if (!state.active)
+        return root->point_deleted;
+    return Tree_Deleted(root, state) || state.tree_downsample_deleted || root->point_downsample_deleted;
+}
+
+template <typename PointType>
+typename KD_TREE<PointType>::Push_Down_State KD_TREE<PointType>::Son_State(KD_TREE_NODE *root, const Push_Down_State &state, bool left_son)
+{
+    Push_Down_State son_state;
+    son_state.active = state.active || (left_son ? root->need_push_down_to_left : root->need_push_down_to_right);
+    son_state.tree_deleted = Tree_Deleted(root, state);
+    son_state.tree_downsample_deleted = state.tree_downsample_deleted || root->tree_downsample_deleted;
+    return son_state;
+}
+
+template <typename PointType>
+typename KD_TREE<PointType>::KD_TREE_NODE *KD_TREE<PointType>::Load_Ptr(KD_TREE_NODE *const *ptr)
+{
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Publish_Ptr(KD_TREE_NODE **ptr, KD_TREE_NODE *value)
+{
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::heap_full(MANUAL_HEAP &q, int k_nearest)
+{
+    return q.size() >= k_nearest;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::heap_full(KNN_HEAP &q, int k_nearest)
+{
+    return q.full();
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::heap_insert(MANUAL_HEAP &q, int k_nearest, float dist, KD_TREE_NODE *node)
+{
+    if (q.size() >= k_nearest)
+        q.pop();
+    q.push(PointType_CMP(node->point, dist));
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::heap_insert(KNN_HEAP &q, int k_nearest, float dist, KD_TREE_NODE *node)
+{
+    q.push(dist, node);
 }
 
 template <typename PointType>
@@ -1365,6 +2335,8 @@ void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root)
     operation.op = PUSH_DOWN;
     operation.tree_deleted = root->tree_deleted;
     operation.tree_downsample_deleted = root->tree_downsample_deleted;
+    if ((root->need_push_down_to_left && root->left_son_ptr != nullptr) || (root->need_push_down_to_right && root->right_son_ptr != nullptr))
+        push_down_counter++;
     if (root->need_push_down_to_left && root->left_son_ptr != nullptr)
     {
         if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr)
@@ -1382,6 +2354,7 @@ void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root)
             root->left_son_ptr->need_push_down_to_left = true;
             root->left_son_ptr->need_push_down_to_right = true;
             root->need_push_down_to_left = false;
+            Refresh_Leaf_Bucket(root->left_son_ptr);
         }
         else
         {
@@ -1425,6 +2398,7 @@ void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root)
             root->right_son_ptr->need_push_down_to_left = true;
             root->right_son_ptr->need_push_down_to_right = true;
             root->need_push_down_to_right = false;
+            Refresh_Leaf_Bucket(root->right_son_ptr);
         }
         else
         {
@@ -1607,6 +2581,10 @@ void KD_TREE<PointType>::Update(KD_TREE_NODE *root)
     float y_L = (root->node_range_y[1] - root->node_range_y[0]) * 0.5;
     float z_L = (root->node_range_z[1] - root->node_range_z[0]) * 0.5;
     root->radius_sq = x_L*x_L + y_L * y_L + z_L * z_L;
+    if (root->rebuild_pending)
+        root->rebuild_debt = root->TreeSize;
+    else
+        root->rebuild_debt = (left_son_ptr != nullptr ? left_son_ptr->rebuild_debt : 0) + (right_son_ptr != nullptr ? right_son_ptr->rebuild_debt : 0);
     if (left_son_ptr != nullptr)
         left_son_ptr->father_ptr = root;
     if (right_son_ptr != nullptr)
@@ -1617,8 +2595,8 @@ void KD_TREE<PointType>::Update(KD_TREE_NODE *root)
         if (son_ptr == nullptr)
             son_ptr = root->right_son_ptr;
         float tmp_bal = float(son_ptr->TreeSize) / (root->TreeSize - 1);
-        root->alpha_del = float(root->invalid_point_num) / root->TreeSize;
-        root->alpha_bal = (tmp_bal >= 0.5 - EPSS) ? tmp_bal : 1 - tmp_bal;
+        root_alpha_del = float(root->invalid_point_num) / root->TreeSize;
+        root_alpha_bal = (tmp_bal >= 0.5 - EPSS) ? tmp_bal : 1 - tmp_bal;
     }
     return;
 }
@@ -1657,36 +2635,44 @@ void KD_TREE<PointType>::flatten(KD_TREE_NODE *root, PointVector &Storage, delet
     return;
 }
 
+// Read-only variant for searches and the rebuild thread: applies pending push downs on the fly.
+template <typename PointType>
+template <typename Storage_Type>
+void KD_TREE<PointType>::flatten(KD_TREE_NODE *root, Push_Down_State state, Storage_Type &Storage, delete_point_storage_set storage_type)
+{
+    if (root == nullptr)
+        return;
+    bool point_deleted = Point_Deleted(root, state);
+    if (!point_deleted)
+    {
+        Storage.push_back(root->point);
+    }
+    flatten(Load_Ptr(&root->left_son_ptr), Son_State(root, state, true), Storage, storage_type);
+    flatten(Load_Ptr(&root->right_son_ptr), Son_State(root, state, false), Storage, storage_type);
+    if (storage_type == NOT_RECORD || !point_deleted || root->point_downsample_deleted || (state.active && state.tree_downsample_deleted))
+        return;
+    if (storage_type == DELETE_POINTS_REC)
+        Points_deleted.push_back(root->point);
+    else if (storage_type == MULTI_THREAD_REC)
+        Rebuild_Points_deleted.push_back(root->point);
+    return;
+}
+
 template <typename PointType>
 void KD_TREE<PointType>::delete_tree_nodes(KD_TREE_NODE **root)
 {
     if (*root == nullptr)
         return;
-    Push_Down(*root);
+    Release_Leaf_Bucket(*root);
     delete_tree_nodes(&(*root)->left_son_ptr);
     delete_tree_nodes(&(*root)->right_son_ptr);
 
-    pthread_mutex_destroy(&(*root)->push_down_mutex_lock);
-    delete *root;
+    Node_Pool.release(*root);
     *root = nullptr;
 
     return;
 }
 
-template <typename PointType>
-bool KD_TREE<PointType>::same_point(PointType a, PointType b)
-{
-    return (fabs(a.x - b.x) < EPSS && fabs(a.y - b.y) < EPSS && fabs(a.z - b.z) < EPSS);
-}
-
-template <typename PointType>
-float KD_TREE<PointType>::calc_dist(PointType a, PointType b)
-{
-    float dist = 0.0f;
-    dist = (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z);
-    return dist;
-}
-
 template <typename PointType>
 float KD_TREE<PointType>::calc_box_dist(KD_TREE_NODE *node, PointType point)
 {
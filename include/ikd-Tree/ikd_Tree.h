@@ -1,6 +1,7 @@
 #pragma once
 #include <stdio.h>
 #include <queue>
+#include <atomic>
 #include <pthread.h>
 #include <chrono>
 #include <time.h>
@@ -8,14 +9,29 @@
 #include <math.h>
 #include <algorithm>
 #include <memory.h>
+#include <new>
+#include <stdint.h>
+#include <memory>
+#include <string>
 #include <pcl/point_types.h>
 
 #define EPSS 1e-6
 #define Minimal_Unbalanced_Tree_Size 10
 #define Multi_Thread_Rebuild_Point_Num 1500
+#define Parallel_Build_Point_Num 20000
 #define DOWNSAMPLE_SWITCH true
 #define ForceRebuildPercentage 0.2
+#define Max_Rebuild_Debt_Percentage 0.1
 #define Q_LEN 1000000
+#define Q_Chunk_Len 1024
+#define Batch_Nearest_K 5
+#define Search_Stack_Len 64
+#define Node_Slab_Len 4096
+#define Node_Slab_Min_Len 64
+#define Leaf_Bucket_Max 64
+#define Snapshot_Version 1
+#define Stats_Depth_Bins 64
+#define Stats_Depth_Samples 256
 
 using namespace std;
 
@@ -56,29 +72,173 @@ public:
     using PointVector = std::vector<PointType, Eigen::aligned_allocator<PointType>>;
     using Ptr = std::shared_ptr<KD_TREE<PointType>>;
     
+    // Node payload. Map points keep xyz and intensity only, other PointType fields are not stored.
+    struct Node_Point
+    {
+        float x, y, z, intensity;
+        Node_Point() = default;
+        Node_Point(const PointType &p)
+            : x(p.x), y(p.y), z(p.z), intensity(get_intensity(p, 0))
+        {
+        }
+        operator PointType() const
+        {
+            PointType p;
+            p.x = x;
+            p.y = y;
+            p.z = z;
+            set_intensity(p, intensity, 0);
+            return p;
+        }
+
+    private:
+        template <typename T>
+        static auto get_intensity(const T &p, int) -> decltype(float(p.intensity))
+        {
+            return p.intensity;
+        }
+        template <typename T>
+        static float get_intensity(const T &p, long)
+        {
+            return 0.0f;
+        }
+        template <typename T>
+        static auto set_intensity(T &p, float value, int) -> decltype(void(p.intensity = value))
+        {
+            p.intensity = value;
+        }
+        template <typename T>
+        static void set_intensity(T &p, float value, long)
+        {
+        }
+    };
+
+    struct LEAF_BUCKET;
+
+    // Allocated from NODE_POOL and fully initialized by InitTreeNode.
     struct KD_TREE_NODE
     {
-        PointType point;
-        int division_axis;
-        int TreeSize = 1;
-        int invalid_point_num = 0;
-        int down_del_num = 0;
-        bool point_deleted = false;
-        bool tree_deleted = false;
-        bool point_downsample_deleted = false;
-        bool tree_downsample_deleted = false;
-        bool need_push_down_to_left = false;
-        bool need_push_down_to_right = false;
-        bool working_flag = false;
-        pthread_mutex_t push_down_mutex_lock;
+        Node_Point point;
         float node_range_x[2], node_range_y[2], node_range_z[2];
         float radius_sq;
-        KD_TREE_NODE *left_son_ptr = nullptr;
-        KD_TREE_NODE *right_son_ptr = nullptr;
-        KD_TREE_NODE *father_ptr = nullptr;
-        // For paper data record
-        float alpha_del;
-        float alpha_bal;
+        int TreeSize;
+        int invalid_point_num;
+        int down_del_num;
+        unsigned int division_axis : 2;
+        unsigned int point_deleted : 1;
+        unsigned int tree_deleted : 1;
+        unsigned int point_downsample_deleted : 1;
+        unsigned int tree_downsample_deleted : 1;
+        unsigned int need_push_down_to_left : 1;
+        unsigned int need_push_down_to_right : 1;
+        // Set on a small subtree whose rebuild was deferred to Run_Pending_Rebuilds.
+        unsigned int rebuild_pending : 1;
+        // Kept out of the bit fields: the rebuild thread polls it while the main thread sets it.
+        bool working_flag;
+        // Points in pending subtrees of this subtree, a pending subtree counts whole and covers its sons.
+        int rebuild_debt;
+        KD_TREE_NODE *left_son_ptr;
+        KD_TREE_NODE *right_son_ptr;
+        KD_TREE_NODE *father_ptr;
+        LEAF_BUCKET *bucket;
+    };
+
+    // Valid points of a small subtree in structure-of-arrays form, so Search scores the whole subtree
+    // in one SIMD pass instead of visiting its nodes. Writers refill it whenever they touch the subtree.
+    struct LEAF_BUCKET
+    {
+        int size;
+        int capacity;
+        float *x, *y, *z;
+        KD_TREE_NODE **nodes;
+    };
+
+    // Slab allocator for tree nodes, shared by the main and rebuild threads. Released nodes are
+    // recycled through a free list linked by left_son_ptr; slabs go back to the system with the tree
+    // or when a Relayout swaps the whole pool out. Slabs grow with the pool up to Node_Slab_Len nodes, so
+    // a small tree does not hold a mostly empty slab.
+    class NODE_POOL
+    {
+    public:
+        NODE_POOL()
+        {
+            pthread_mutex_init(&pool_mutex_lock, NULL);
+        }
+        ~NODE_POOL()
+        {
+            for (size_t i = 0; i < slabs.size(); i++)
+                ::operator delete(slabs[i]);
+            pthread_mutex_destroy(&pool_mutex_lock);
+        }
+        KD_TREE_NODE *allocate()
+        {
+            KD_TREE_NODE *node;
+            pthread_mutex_lock(&pool_mutex_lock);
+            if (free_list != nullptr)
+            {
+                node = free_list;
+                free_list = free_list->left_son_ptr;
+            }
+            else
+            {
+                if (slab_used == slab_len)
+                {
+                    slab_len = int(min(size_t(Node_Slab_Len), max(size_t(Node_Slab_Min_Len), slab_node_num)));
+                    slabs.push_back(static_cast<KD_TREE_NODE *>(::operator new(sizeof(KD_TREE_NODE) * slab_len)));
+                    slab_node_num += slab_len;
+                    slab_used = 0;
+                }
+                node = slabs.back() + slab_used;
+                slab_used++;
+            }
+            pthread_mutex_unlock(&pool_mutex_lock);
+            return new (node) KD_TREE_NODE;
+        }
+        void release(KD_TREE_NODE *node)
+        {
+            pthread_mutex_lock(&pool_mutex_lock);
+            node->left_son_ptr = free_list;
+            free_list = node;
+            pthread_mutex_unlock(&pool_mutex_lock);
+        }
+        // num consecutive, unconstructed nodes in a slab of their own. The slab is kept ahead of the
+        // one allocate() is filling.
+        KD_TREE_NODE *allocate_run(size_t num)
+        {
+            KD_TREE_NODE *run = static_cast<KD_TREE_NODE *>(::operator new(sizeof(KD_TREE_NODE) * num));
+            pthread_mutex_lock(&pool_mutex_lock);
+            slabs.insert(slabs.begin(), run);
+            slab_node_num += num;
+            pthread_mutex_unlock(&pool_mutex_lock);
+            return run;
+        }
+        void swap(NODE_POOL &other)
+        {
+            pthread_mutex_lock(&pool_mutex_lock);
+            pthread_mutex_lock(&other.pool_mutex_lock);
+            slabs.swap(other.slabs);
+            std::swap(slab_node_num, other.slab_node_num);
+            std::swap(slab_used, other.slab_used);
+            std::swap(slab_len, other.slab_len);
+            std::swap(free_list, other.free_list);
+            pthread_mutex_unlock(&other.pool_mutex_lock);
+            pthread_mutex_unlock(&pool_mutex_lock);
+        }
+        size_t capacity_bytes()
+        {
+            pthread_mutex_lock(&pool_mutex_lock);
+            size_t bytes = slab_node_num * sizeof(KD_TREE_NODE);
+            pthread_mutex_unlock(&pool_mutex_lock);
+            return bytes;
+        }
+
+    private:
+        pthread_mutex_t pool_mutex_lock;
+        vector<KD_TREE_NODE *> slabs;
+        size_t slab_node_num = 0;
+        int slab_len = 0;
+        int slab_used = 0;
+        KD_TREE_NODE *free_list = nullptr;
     };
 
     struct Operation_Logger_Type
@@ -200,72 +360,520 @@ public:
         int cap = 0;
     };
 
+    // Fixed-capacity max-heap of Batch_Nearest_K candidates, keyed by squared distance.
+    // Holds node pointers so that heap moves do not copy whole points.
+    class KNN_HEAP
+    {
+    public:
+        struct Candidate
+        {
+            float dist;
+            KD_TREE_NODE *node;
+        };
+        void clear()
+        {
+            heap_size = 0;
+        }
+        int size() const
+        {
+            return heap_size;
+        }
+        bool full() const
+        {
+            return heap_size == Batch_Nearest_K;
+        }
+        float top_dist() const
+        {
+            return heap[0].dist;
+        }
+        const Candidate &top() const
+        {
+            return heap[0];
+        }
+        // Inserts the candidate, replacing the current farthest one when the heap is full.
+        void push(float dist, KD_TREE_NODE *node)
+        {
+            int heap_index;
+            if (heap_size < Batch_Nearest_K)
+            {
+                heap_index = heap_size++;
+                while (heap_index > 0 && heap[(heap_index - 1) / 2].dist < dist)
+                {
+                    heap[heap_index] = heap[(heap_index - 1) / 2];
+                    heap_index = (heap_index - 1) / 2;
+                }
+            }
+            else
+            {
+                heap_index = 0;
+                MoveDown(heap_index, dist);
+            }
+            heap[heap_index].dist = dist;
+            heap[heap_index].node = node;
+        }
+        void pop()
+        {
+            if (heap_size == 0)
+                return;
+            Candidate last = heap[--heap_size];
+            int heap_index = 0;
+            MoveDown(heap_index, last.dist);
+            heap[heap_index] = last;
+        }
+
+    private:
+        Candidate heap[Batch_Nearest_K];
+        int heap_size = 0;
+        // Opens a hole at heap_index and sinks it until dist fits there.
+        void MoveDown(int &heap_index, float dist)
+        {
+            int l = heap_index * 2 + 1;
+            while (l < heap_size)
+            {
+                if (l + 1 < heap_size && heap[l].dist < heap[l + 1].dist)
+                    l++;
+                if (dist < heap[l].dist)
+                {
+                    heap[heap_index] = heap[l];
+                    heap_index = l;
+                    l = heap_index * 2 + 1;
+                }
+                else
+                    break;
+            }
+        }
+    };
+
+    // Caller-owned scratch reused across Nearest_Search_Batch calls, so batched queries do not touch the allocator.
+    struct Batch_Search_Context
+    {
+        KNN_HEAP q;
+    };
+
+    // Filled by Get_Statistics. Counters are totals since the tree was constructed, the rest describes the
+    // tree at the time of the call.
+    struct Tree_Statistics
+    {
+        int node_num;
+        // Lazily deleted nodes, dropped by the next rebuild of their subtree.
+        int deleted_num;
+        float alpha_bal, alpha_del;
+        // Estimated nodes per depth from Stats_Depth_Samples uniformly drawn nodes, the last bin holds all
+        // deeper nodes.
+        int depth_histogram[Stats_Depth_Bins];
+        // Foreground rebuilds run in place on the writer thread, background ones on the rebuild thread.
+        long foreground_rebuild_num, background_rebuild_num;
+        double foreground_rebuild_time, background_rebuild_time;
+        long push_down_num;
+        long box_delete_num;
+        int rebuild_debt;
+        int rebuild_abort_num;
+        int log_high_water;
+        size_t node_bytes, voxel_map_bytes, rebuild_log_bytes;
+    };
+
+    // Immutable copy of the valid map points handed out by Get_Snapshot. The points form an implicit
+    // balanced k-d tree, each range holding its median in the middle, so any number of threads can
+    // search it while the tree itself keeps changing.
+    class SNAPSHOT
+    {
+    public:
+        SNAPSHOT(vector<Node_Point> &&snapshot_points, uint64_t snapshot_version);
+        uint64_t version() const
+        {
+            return snapshot_version;
+        }
+        int size() const
+        {
+            return points.size();
+        }
+        void Nearest_Search(const PointType &point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist = INFINITY) const;
+        void Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage) const;
+        void Radius_Search(const PointType &point, const float radius, PointVector &Storage) const;
+
+    private:
+        friend class KD_TREE;
+        vector<Node_Point> points;
+        vector<uint8_t> division_axis;
+        uint64_t snapshot_version;
+        template <typename T>
+        static float axis_value(const T &p, int axis)
+        {
+            return axis == 0 ? p.x : (axis == 1 ? p.y : p.z);
+        }
+        void Build_Range(int l, int r);
+        void Search_Range(int l, int r, const PointType &point, int k_nearest, MANUAL_HEAP &q, float max_dist_sqr) const;
+        void Box_Search_Range(int l, int r, const BoxPointType &boxpoint, PointVector &Storage) const;
+        void Radius_Search_Range(int l, int r, const PointType &point, float radius_sqr, PointVector &Storage) const;
+    };
+
+    // Lazy deletion state that pending Push_Down calls would hand to a subtree. Read-only traversals
+    // carry it down instead of calling Push_Down, so they never write to the nodes they visit.
+    struct Push_Down_State
+    {
+        bool active = false;
+        bool tree_deleted = false;
+        bool tree_downsample_deleted = false;
+    };
+
+    // Save/Load file layout: a header followed by the nodes in preorder, in host byte order. Each node
+    // records which sons follow it, so Load rebuilds the tree without sorting a single point.
+    struct Snapshot_Header
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t node_size;
+        uint32_t reserved;
+        uint64_t node_num;
+    };
+
+    enum Snapshot_Flag
+    {
+        Snapshot_Point_Deleted = 1,
+        Snapshot_Downsample_Deleted = 2,
+        Snapshot_Left_Son = 4,
+        Snapshot_Right_Son = 8
+    };
+
+    struct Snapshot_Node
+    {
+        float x, y, z, intensity;
+        uint8_t division_axis;
+        uint8_t flags;
+        uint8_t reserved[2];
+    };
+
+    struct Search_Stack_Entry
+    {
+        KD_TREE_NODE *node;
+        float box_dist;
+        Push_Down_State state;
+    };
+
+    // Explicit traversal stack for Search. Holds at most one pending sibling per tree level,
+    // so the inline buffer covers any reasonably balanced tree and deeper ones spill to the heap.
+    class SEARCH_STACK
+    {
+    public:
+        bool empty() const
+        {
+            return stack_size == 0;
+        }
+        int size() const
+        {
+            return stack_size;
+        }
+        void push(KD_TREE_NODE *node, float box_dist, const Push_Down_State &state)
+        {
+            if (stack_size < Search_Stack_Len)
+            {
+                entries[stack_size].node = node;
+                entries[stack_size].box_dist = box_dist;
+                entries[stack_size].state = state;
+            }
+            else
+            {
+                spill.push_back({node, box_dist, state});
+            }
+            stack_size++;
+        }
+        Search_Stack_Entry pop()
+        {
+            stack_size--;
+            if (stack_size < Search_Stack_Len)
+                return entries[stack_size];
+            Search_Stack_Entry entry = spill.back();
+            spill.pop_back();
+            return entry;
+        }
+
+    private:
+        Search_Stack_Entry entries[Search_Stack_Len];
+        vector<Search_Stack_Entry> spill;
+        int stack_size = 0;
+    };
+
+    // Open-addressing table from voxel key to the squared distance between the voxel centre and the only
+    // point the tree keeps in that voxel. A missing key means the voxel holds no point, a dirty entry
+    // means the voxel may hold several points and has to be resolved with a box search. A non-negative
+    // state is the index of the representative in the pending bulk insertion batch.
+    class VOXEL_MAP
+    {
+    public:
+        static constexpr int In_Tree = -1;
+        static constexpr int Dirty = -2;
+        struct Voxel_Entry
+        {
+            int64_t key;
+            float dist;
+            int state;
+        };
+        Voxel_Entry *find(int64_t key)
+        {
+            if (slots.empty())
+                return nullptr;
+            size_t index = slot_of(key);
+            while (slots[index].key != Empty_Key)
+            {
+                if (slots[index].key == key)
+                    return &slots[index];
+                index = (index + 1) & (slots.size() - 1);
+            }
+            return nullptr;
+        }
+        Voxel_Entry *insert(int64_t key, bool &inserted)
+        {
+            inserted = false;
+            if ((entry_num + 1) * 5 > slots.size() * 3)
+                resize(max(slots.size() * 2, size_t(1024)));
+            size_t index = slot_of(key);
+            while (slots[index].key != Empty_Key)
+            {
+                if (slots[index].key == key)
+                    return &slots[index];
+                index = (index + 1) & (slots.size() - 1);
+            }
+            slots[index].key = key;
+            slots[index].dist = 0.0f;
+            slots[index].state = In_Tree;
+            entry_num++;
+            inserted = true;
+            return &slots[index];
+        }
+        // Removes an entry returned by find or insert, shifting the entries of its probe run back into the
+        // gap so that no tombstone is left behind.
+        void erase(Voxel_Entry *entry)
+        {
+            size_t mask = slots.size() - 1;
+            size_t gap = entry - slots.data();
+            for (size_t index = (gap + 1) & mask; slots[index].key != Empty_Key; index = (index + 1) & mask)
+            {
+                // An entry may move back into the gap only if its home slot is not between the gap and it
+                size_t home = slot_of(slots[index].key);
+                if (((index - home) & mask) >= ((index - gap) & mask))
+                {
+                    slots[gap] = slots[index];
+                    gap = index;
+                }
+            }
+            slots[gap].key = Empty_Key;
+            entry_num--;
+        }
+        void clear()
+        {
+            vector<Voxel_Entry>().swap(slots);
+            entry_num = 0;
+        }
+        size_t memory()
+        {
+            return slots.size() * sizeof(Voxel_Entry);
+        }
+
+    private:
+        static constexpr int64_t Empty_Key = -1;
+        vector<Voxel_Entry> slots;
+        size_t entry_num = 0;
+        size_t slot_of(int64_t key)
+        {
+            uint64_t h = uint64_t(key) * 0x9E3779B97F4A7C15ull;
+            return size_t(h >> 32) & (slots.size() - 1);
+        }
+        void resize(size_t capacity)
+        {
+            vector<Voxel_Entry> old;
+            old.swap(slots);
+            slots.assign(capacity, Voxel_Entry{Empty_Key, 0.0f, In_Tree});
+            entry_num = 0;
+            bool inserted;
+            for (size_t i = 0; i < old.size(); i++)
+                if (old[i].key != Empty_Key)
+                    *insert(old[i].key, inserted) = old[i];
+        }
+    };
+
+    // Operation log replayed by the rebuild thread, a FIFO of Q_Chunk_Len chunks allocated on demand
+    // and released once drained. A push beyond the length cap drops the whole log and marks it
+    // overflowed, further pushes are ignored until clear().
     class MANUAL_Q
     {
     private:
+        struct Q_Chunk
+        {
+            Operation_Logger_Type q[Q_Chunk_Len];
+            Q_Chunk *next = nullptr;
+        };
+        Q_Chunk *head_chunk = nullptr, *tail_chunk = nullptr, *spare_chunk = nullptr;
         int head = 0, tail = 0, counter = 0;
-        Operation_Logger_Type q[Q_LEN];
-        bool is_empty;
+        int max_len = Q_LEN, high_water = 0, chunk_num = 0;
+        bool is_overflow = false;
+
+        Q_Chunk *new_chunk()
+        {
+            Q_Chunk *chunk = spare_chunk;
+            if (chunk != nullptr)
+                spare_chunk = nullptr;
+            else
+            {
+                chunk = new Q_Chunk;
+                chunk_num++;
+            }
+            chunk->next = nullptr;
+            return chunk;
+        }
+        void release_chunk(Q_Chunk *chunk)
+        {
+            // Keep one drained chunk around so a log hovering at a chunk boundary does not thrash the allocator
+            if (spare_chunk == nullptr)
+            {
+                spare_chunk = chunk;
+                return;
+            }
+            delete chunk;
+            chunk_num--;
+        }
 
     public:
+        MANUAL_Q() = default;
+        MANUAL_Q(const MANUAL_Q &) = delete;
+        MANUAL_Q &operator=(const MANUAL_Q &) = delete;
+        ~MANUAL_Q()
+        {
+            clear();
+            delete spare_chunk;
+        }
         void pop()
         {
             if (counter == 0)
                 return;
             head++;
-            head %= Q_LEN;
             counter--;
-            if (counter == 0)
-                is_empty = true;
+            if (head == Q_Chunk_Len || counter == 0)
+            {
+                Q_Chunk *drained = head_chunk;
+                head_chunk = head_chunk->next;
+                head = 0;
+                if (head_chunk == nullptr)
+                {
+                    tail_chunk = nullptr;
+                    tail = 0;
+                }
+                release_chunk(drained);
+            }
             return;
         }
         Operation_Logger_Type front()
         {
-            return q[head];
-        }
-        Operation_Logger_Type back()
-        {
-            return q[tail];
+            return head_chunk->q[head];
         }
         void clear()
         {
+            while (head_chunk != nullptr)
+            {
+                Q_Chunk *next = head_chunk->next;
+                release_chunk(head_chunk);
+                head_chunk = next;
+            }
+            tail_chunk = nullptr;
             head = 0;
             tail = 0;
             counter = 0;
-            is_empty = true;
+            is_overflow = false;
             return;
         }
-        void push(Operation_Logger_Type op)
+        bool push(const Operation_Logger_Type &op)
         {
-            q[tail] = op;
+            if (is_overflow)
+                return false;
+            if (counter >= max_len)
+            {
+                clear();
+                is_overflow = true;
+                return false;
+            }
+            if (tail_chunk == nullptr)
+            {
+                head_chunk = tail_chunk = new_chunk();
+                head = tail = 0;
+            }
+            else if (tail == Q_Chunk_Len)
+            {
+                tail_chunk->next = new_chunk();
+                tail_chunk = tail_chunk->next;
+                tail = 0;
+            }
+            tail_chunk->q[tail++] = op;
             counter++;
-            if (is_empty)
-                is_empty = false;
-            tail++;
-            tail %= Q_LEN;
+            high_water = max(high_water, counter);
+            return true;
         }
         bool empty()
         {
-            return is_empty;
+            return counter == 0;
         }
         int size()
         {
             return counter;
         }
+        bool overflow()
+        {
+            return is_overflow;
+        }
+        void set_max_len(int len)
+        {
+            max_len = max(len, 1);
+        }
+        int max_size()
+        {
+            return high_water;
+        }
+        size_t memory()
+        {
+            return size_t(chunk_num) * sizeof(Q_Chunk);
+        }
     };
 
 private:
     // Multi-thread Tree Rebuild
     bool termination_flag = false;
     bool rebuild_flag = false;
+    bool background_rebuild = true;
+    bool rebuild_thread_started = false;
     pthread_t rebuild_thread;
-    pthread_mutex_t termination_flag_mutex_lock, rebuild_ptr_mutex_lock, working_flag_mutex, search_flag_mutex;
+    pthread_mutex_t termination_flag_mutex_lock, rebuild_ptr_mutex_lock, working_flag_mutex;
     pthread_mutex_t rebuild_logger_mutex_lock, points_deleted_rebuild_mutex_lock;
     // queue<Operation_Logger_Type> Rebuild_Logger;
     MANUAL_Q Rebuild_Logger;
+    std::atomic<int> rebuild_abort_counter;
+    // Statistics counters, the atomic ones are also bumped by the rebuild thread
+    std::atomic<long> background_rebuild_counter, background_rebuild_nanoseconds, push_down_counter;
+    long foreground_rebuild_counter = 0, box_delete_counter = 0;
+    double foreground_rebuild_seconds = 0.0;
+    uint64_t stats_random_state = 0x9E3779B97F4A7C15ULL;
     PointVector Rebuild_PCL_Storage;
+    PointVector Rebuild_Points_deleted;
     KD_TREE_NODE **Rebuild_Ptr = nullptr;
-    int search_mutex_counter = 0;
+    // Epoch-based reclamation: searches register in the reader slot of the current epoch, and the
+    // rebuild thread frees a replaced subtree only after the slot of the epoch it retired drains.
+    std::atomic<unsigned int> search_epoch;
+    std::atomic<int> search_epoch_readers[2];
+    // Read views for other threads. The writer copies the valid points into Snapshot_Storage when a
+    // reader has asked for a fresh view, and the next reader turns them into the published Snapshot.
+    // Both sides only ever try the lock, so neither waits for the other, except readers waiting on
+    // snapshot_ready_cond for the very first copy. The snapshot replaced by the latest one is kept, and
+    // its points are reused for the next copy once no reader holds it anymore.
+    pthread_mutex_t snapshot_mutex_lock;
+    pthread_cond_t snapshot_ready_cond;
+    std::shared_ptr<const SNAPSHOT> Snapshot;
+    std::shared_ptr<SNAPSHOT> Current_Snapshot, Retired_Snapshot;
+    vector<Node_Point> Snapshot_Storage;
+    double snapshot_interval = 0.0;
+    chrono::steady_clock::time_point last_snapshot_time;
+    bool snapshot_storage_ready = false;
+    uint64_t snapshot_version = 0;
+    std::atomic<bool> snapshot_requested;
+    int Search_Epoch_Enter();
+    void Search_Epoch_Exit(int epoch_index);
+    void Wait_For_Search_Readers();
     static void *multi_thread_ptr(void *arg);
     void multi_thread_rebuild();
     void start_thread();
@@ -274,39 +882,93 @@ private:
     // KD Tree Functions and augmented variables
     int Treesize_tmp = 0, Validnum_tmp = 0;
     float alpha_bal_tmp = 0.5, alpha_del_tmp = 0.0;
+    // For paper data record, kept for the root only
+    float root_alpha_bal = 0.5, root_alpha_del = 0.0;
+    NODE_POOL Node_Pool;
     float delete_criterion_param = 0.5f;
     float balance_criterion_param = 0.7f;
     float downsample_size = 0.2f;
+    int leaf_bucket_size = 0;
+    int build_thread_num = 1;
+    float rebuild_budget_ms = 0.0f;
+    std::atomic<long> leaf_bucket_bytes;
     bool Delete_Storage_Disabled = false;
     KD_TREE_NODE *STATIC_ROOT_NODE = nullptr;
     PointVector Points_deleted;
-    PointVector Downsample_Storage;
+    PointVector Bulk_Storage;
+    bool bulk_insert_enabled = true;
+    // Voxel occupancy for downsampled insertion, rebuilt from the tree on demand after it is invalidated
+    VOXEL_MAP Voxel_Map;
+    bool voxel_map_enabled = true;
+    bool voxel_map_valid = false;
     PointVector Multithread_Points_deleted;
     void InitTreeNode(KD_TREE_NODE *root);
     void Test_Lock_States(KD_TREE_NODE *root);
     void BuildTree(KD_TREE_NODE **root, int l, int r, PointVector &Storage);
+    void Build_Subtree(KD_TREE_NODE **root, int l, int r, PointVector &Storage, bool spawn_tasks);
     void Rebuild(KD_TREE_NODE **root);
+    void Rebuild_In_Place(KD_TREE_NODE **root);
+    bool Rebuild_Pending(KD_TREE_NODE **root, chrono::steady_clock::time_point deadline, int &drain_num, int &rebuild_num);
     int Delete_by_range(KD_TREE_NODE **root, BoxPointType boxpoint, bool allow_rebuild, bool is_downsample);
     void Delete_by_point(KD_TREE_NODE **root, PointType point, bool allow_rebuild);
+    int Replace_by_range(KD_TREE_NODE *root, const BoxPointType &boxpoint, const PointType &point, BoxPointType region);
     void Add_by_point(KD_TREE_NODE **root, PointType point, bool allow_rebuild, int father_axis);
     void Add_by_range(KD_TREE_NODE **root, BoxPointType boxpoint, bool allow_rebuild);
-    void Search(KD_TREE_NODE *root, int k_nearest, PointType point, MANUAL_HEAP &q, float max_dist); //priority_queue<PointType_CMP>
-    void Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector &Storage);
-    void Search_by_radius(KD_TREE_NODE *root, PointType point, float radius, PointVector &Storage);
+    void Add_Batch(PointVector &Storage);
+    void Add_by_batch(KD_TREE_NODE **root, PointVector &Storage, int l, int r, bool allow_rebuild);
+    void Log_Batch(PointVector &Storage, int l, int r);
+    template <typename Heap_Type>
+    void Search(int k_nearest, const PointType &point, Heap_Type &q, float max_dist_sqr, float epsilon = 0.0f, int max_visit = 0);
+    static bool heap_full(MANUAL_HEAP &q, int k_nearest);
+    static bool heap_full(KNN_HEAP &q, int k_nearest);
+    static void heap_insert(MANUAL_HEAP &q, int k_nearest, float dist, KD_TREE_NODE *node);
+    static void heap_insert(KNN_HEAP &q, int k_nearest, float dist, KD_TREE_NODE *node);
+    template <typename Heap_Type>
+    void Search_Leaf_Bucket(const LEAF_BUCKET *bucket, const PointType &point, int k_nearest, Heap_Type &q, float max_dist_sqr);
+    static void bucket_dist(const LEAF_BUCKET *bucket, const PointType &point, float *dist);
+    KD_TREE_NODE *Relayout_Subtree(KD_TREE_NODE *root, KD_TREE_NODE *father, KD_TREE_NODE *&next_node);
+    void Build_Leaf_Bucket(KD_TREE_NODE *root);
+    void Refresh_Leaf_Bucket(KD_TREE_NODE *root);
+    void Release_Leaf_Bucket(KD_TREE_NODE *root);
+    void Fill_Leaf_Bucket(KD_TREE_NODE *root, Push_Down_State state, LEAF_BUCKET *bucket);
+    template <typename Visitor>
+    bool Visit_by_range(KD_TREE_NODE *root, const BoxPointType &boxpoint, Visitor &visitor, Push_Down_State state);
+    template <typename Visitor>
+    bool Visit_by_radius(KD_TREE_NODE *root, const PointType &point, float radius, Visitor &visitor, Push_Down_State state);
+    template <typename Visitor>
+    bool Visit_Subtree(KD_TREE_NODE *root, Visitor &visitor, Push_Down_State state);
+    template <typename Storage_Type>
+    void flatten(KD_TREE_NODE *root, Push_Down_State state, Storage_Type &Storage, delete_point_storage_set storage_type);
+    bool Save_Subtree(KD_TREE_NODE *root, Push_Down_State state, FILE *fp, uint64_t &node_num);
+    KD_TREE_NODE *Load_Subtree(const Snapshot_Node *nodes, uint64_t node_num, uint64_t &index, bool &valid);
+    static bool Tree_Deleted(KD_TREE_NODE *root, const Push_Down_State &state);
+    static bool Point_Deleted(KD_TREE_NODE *root, const Push_Down_State &state);
+    static Push_Down_State Son_State(KD_TREE_NODE *root, const Push_Down_State &state, bool left_son);
+    static KD_TREE_NODE *Load_Ptr(KD_TREE_NODE *const *ptr);
+    static void Publish_Ptr(KD_TREE_NODE **ptr, KD_TREE_NODE *value);
     bool Criterion_Check(KD_TREE_NODE *root);
     void Push_Down(KD_TREE_NODE *root);
     void Update(KD_TREE_NODE *root);
     void delete_tree_nodes(KD_TREE_NODE **root);
     void downsample(KD_TREE_NODE **root);
-    bool same_point(PointType a, PointType b);
-    float calc_dist(PointType a, PointType b);
+    template <typename Point_A, typename Point_B>
+    static bool same_point(const Point_A &a, const Point_B &b);
+    template <typename Point_A, typename Point_B>
+    static float calc_dist(const Point_A &a, const Point_B &b);
     float calc_box_dist(KD_TREE_NODE *node, PointType point);
+    int64_t voxel_key(const PointType &point);
+    void Voxel_Map_Reset();
+    void Voxel_Map_Add(const PointType &point);
+    void Voxel_Map_Delete_Point(const PointType &point);
+    void Voxel_Map_Delete_Boxes(const vector<BoxPointType> &BoxPoints);
     static bool point_cmp_x(PointType a, PointType b);
     static bool point_cmp_y(PointType a, PointType b);
     static bool point_cmp_z(PointType a, PointType b);
 
 public:
-    KD_TREE(float delete_param = 0.5, float balance_param = 0.6, float box_length = 0.2);
+    // background_rebuild false runs every rebuild in the calling thread and starts no rebuild thread, for
+    // maps made of many small trees.
+    KD_TREE(float delete_param = 0.5, float balance_param = 0.6, float box_length = 0.2, bool background_rebuild = true);
     ~KD_TREE();
     void Set_delete_criterion_param(float delete_param)
     {
@@ -319,15 +981,109 @@ public:
     void set_downsample_param(float downsample_param)
     {
         downsample_size = downsample_param;
+        voxel_map_valid = false;
+    }
+    // Downsampled Add_Points looks voxels up in a hash map instead of box-searching the tree, at about
+    // 16 bytes per hash slot. Disabling it frees the map.
+    void Set_voxel_map_enabled(bool enabled)
+    {
+        voxel_map_enabled = enabled;
+        voxel_map_valid = false;
+        Voxel_Map.clear();
+    }
+    // Subtrees of at most bucket_size points (capped at Leaf_Bucket_Max) get a leaf bucket when they are
+    // next built or rebuilt. 0 disables leaf buckets.
+    void Set_leaf_bucket_size(int bucket_size)
+    {
+        leaf_bucket_size = min(max(bucket_size, 0), Leaf_Bucket_Max);
+    }
+    // Caps the operation log kept while a subtree is rebuilt in the background. When the log overflows
+    // the rebuild is abandoned and the original subtree, which already holds every update, stays in place.
+    void Set_rebuild_log_cap(int cap);
+    // Add_Points collects the points that go to empty voxels (all points without downsampling) and
+    // partitions them down the tree in one pass, checking the rebuild criterion once per visited node.
+    void Set_bulk_insert(bool enabled)
+    {
+        bulk_insert_enabled = enabled;
+    }
+    // Build and background rebuilds of at least Parallel_Build_Point_Num points build the two halves of
+    // large ranges as OpenMP tasks on up to thread_num threads. Without OpenMP the setting has no effect.
+    void Set_build_thread_num(int thread_num)
+    {
+        build_thread_num = max(thread_num, 1);
+    }
+    // budget_ms > 0 defers rebuilds of subtrees below Multi_Thread_Rebuild_Point_Num, which otherwise run
+    // inside the insertion or deletion that unbalanced them, to Run_Pending_Rebuilds. 0 rebuilds at once.
+    // Subtrees are only deferred while the debt stays within Max_Rebuild_Debt_Percentage of the tree.
+    void Set_rebuild_budget(float budget_ms)
+    {
+        rebuild_budget_ms = max(budget_ms, 0.0f);
     }
     void InitializeKDTree(float delete_param = 0.5, float balance_param = 0.7, float box_length = 0.2);
     int size();
     int validnum();
     void root_alpha(float &alpha_bal, float &alpha_del);
-    void Build(PointVector point_cloud);
-    void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist = INFINITY);
+    // Bytes currently reserved for tree nodes, including free slab space, and leaf buckets.
+    size_t node_memory();
+    // Bytes currently held by the voxel map of downsampled insertion.
+    size_t voxel_map_memory();
+    // Bytes currently held by the rebuild operation log.
+    size_t rebuild_log_memory();
+    // Background rebuilds abandoned because their operation log overflowed.
+    int rebuild_abort_num();
+    // Points in subtrees still waiting for a deferred rebuild, not counting those inside the subtree the
+    // rebuild thread is replacing.
+    int rebuild_debt();
+    // Rebuilds deferred subtrees until the rebuild budget is spent, descending into the son with more debt
+    // first, and returns how many were rebuilt. At least one is rebuilt per call, so the debt drains even on a tiny
+    // budget, and once the debt exceeds Max_Rebuild_Debt_Percentage of the tree the call runs past the budget
+    // until it is back under half of that. Subtrees that have grown past Multi_Thread_Rebuild_Point_Num go to
+    // the rebuild thread instead.
+    int Run_Pending_Rebuilds();
+    // Writer thread: counters and memory are read directly and the depth histogram walks Stats_Depth_Samples
+    // root-to-node paths, so it is cheap enough to call every scan.
+    void Get_Statistics(Tree_Statistics &stats);
+    void Build(const PointVector &point_cloud);
+    // Builds in place in the moved-in cloud, so callers that are done with it avoid a copy.
+    void Build(PointVector &&point_cloud);
+    // Writes the current tree, deleted subtrees left out, to a versioned binary snapshot.
+    bool Save(const string &path);
+    // Replaces the tree with a snapshot written by Save. The file is mapped and its nodes linked up
+    // directly, so loading costs one pass over the points.
+    bool Load(const string &path);
+    // Moves every node into one fresh slab in depth-first order and frees the old slabs, so searches
+    // walk memory forward again and nodes freed by deletions and rebuilds go back to the system.
+    // Skipped, returning false, while a background rebuild is pending or running.
+    bool Relayout();
+    // epsilon > 0 makes the search (1 + epsilon)-approximate: a branch is only visited if it may hold a point
+    // 1 + epsilon times closer than the current k-th neighbour. max_visit > 0 stops the search once that many
+    // points have been scored and k neighbours are found. The defaults give the exact k nearest neighbours.
+    void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist = INFINITY, float epsilon = 0.0f, int max_visit = 0);
+    // Batched k-NN with k = Batch_Nearest_K. Query i writes its neighbours, nearest first, to
+    // Nearest_Points[i * Batch_Nearest_K ...] and Point_Distance[i * Batch_Nearest_K ...] and the count to Found_Num[i].
+    void Nearest_Search_Batch(const PointType *Points, int Point_Num, Batch_Search_Context &Context, PointType *Nearest_Points, float *Point_Distance, int *Found_Num, float max_dist = INFINITY, float epsilon = 0.0f, int max_visit = 0);
     void Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage);
     void Radius_Search(PointType point, const float radius, PointVector &Storage);
+    // Visitor forms: visitor(const Node_Point &) runs on every point found and returns false to stop the
+    // search, so callers can count, accumulate or export points without a PointVector in between.
+    // Returns false if the visitor stopped the search.
+    template <typename Visitor>
+    bool Box_Search(const BoxPointType &Box_of_Point, Visitor &&visitor);
+    template <typename Visitor>
+    bool Radius_Search(const PointType &point, const float radius, Visitor &&visitor);
+    // Writer thread: publishes a fresh snapshot if a reader asked for one since the last call and the last
+    // copy is at least the snapshot interval old, and returns true if it did. A copy flattens the whole
+    // tree on the writer thread, linear in the map size: about a quarter of a second for a million points,
+    // so keep the snapshot interval long on large maps. Calls without a copy cost nothing.
+    bool Publish_Snapshot();
+    // Minimum seconds between two snapshot copies, 0 for no limit.
+    void Set_snapshot_interval(double interval)
+    {
+        snapshot_interval = max(interval, 0.0);
+    }
+    // Any thread but the writer: returns the latest snapshot and asks the writer for a fresher one. The
+    // first call blocks until the writer has published a snapshot, so the result is never nullptr.
+    std::shared_ptr<const SNAPSHOT> Get_Snapshot();
     int Add_Points(PointVector &PointToAdd, bool downsample_on);
     void Add_Point_Boxes(vector<BoxPointType> &BoxPoints);
     void Delete_Points(PointVector &PointToDel);
@@ -337,8 +1093,107 @@ public:
     BoxPointType tree_range();
     PointVector PCL_Storage;
     KD_TREE_NODE *Root_Node = nullptr;
+    // High-water mark of the rebuild operation log.
     int max_queue_size = 0;
 };
 
+template <typename PointType>
+template <typename Visitor>
+bool KD_TREE<PointType>::Box_Search(const BoxPointType &Box_of_Point, Visitor &&visitor)
+{
+    int epoch_index = Search_Epoch_Enter();
+    bool completed = Visit_by_range(Load_Ptr(&Root_Node), Box_of_Point, visitor, Push_Down_State());
+    Search_Epoch_Exit(epoch_index);
+    return completed;
+}
+
+template <typename PointType>
+template <typename Visitor>
+bool KD_TREE<PointType>::Radius_Search(const PointType &point, const float radius, Visitor &&visitor)
+{
+    int epoch_index = Search_Epoch_Enter();
+    bool completed = Visit_by_radius(Load_Ptr(&Root_Node), point, radius, visitor, Push_Down_State());
+    Search_Epoch_Exit(epoch_index);
+    return completed;
+}
+
+template <typename PointType>
+template <typename Point_A, typename Point_B>
+bool KD_TREE<PointType>::same_point(const Point_A &a, const Point_B &b)
+{
+    return (fabs(a.x - b.x) < EPSS && fabs(a.y - b.y) < EPSS && fabs(a.z - b.z) < EPSS);
+}
+
+template <typename PointType>
+template <typename Point_A, typename Point_B>
+float KD_TREE<PointType>::calc_dist(const Point_A &a, const Point_B &b)
+{
+    float dist = 0.0f;
+    dist = (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z);
+    return dist;
+}
+
+template <typename PointType>
+template <typename Visitor>
+bool KD_TREE<PointType>::Visit_by_range(KD_TREE_NODE *root, const BoxPointType &boxpoint, Visitor &visitor, Push_Down_State state)
+{
+    if (root == nullptr)
+        return true;
+    if (boxpoint.vertex_max[0] <= root->node_range_x[0] || boxpoint.vertex_min[0] > root->node_range_x[1])
+        return true;
+    if (boxpoint.vertex_max[1] <= root->node_range_y[0] || boxpoint.vertex_min[1] > root->node_range_y[1])
+        return true;
+    if (boxpoint.vertex_max[2] <= root->node_range_z[0] || boxpoint.vertex_min[2] > root->node_range_z[1])
+        return true;
+    if (boxpoint.vertex_min[0] <= root->node_range_x[0] && boxpoint.vertex_max[0] > root->node_range_x[1] && boxpoint.vertex_min[1] <= root->node_range_y[0] && boxpoint.vertex_max[1] > root->node_range_y[1] && boxpoint.vertex_min[2] <= root->node_range_z[0] && boxpoint.vertex_max[2] > root->node_range_z[1])
+        return Visit_Subtree(root, visitor, state);
+    if (boxpoint.vertex_min[0] <= root->point.x && boxpoint.vertex_max[0] > root->point.x && boxpoint.vertex_min[1] <= root->point.y && boxpoint.vertex_max[1] > root->point.y && boxpoint.vertex_min[2] <= root->point.z && boxpoint.vertex_max[2] > root->point.z)
+    {
+        if (!Point_Deleted(root, state) && !visitor(static_cast<const Node_Point &>(root->point)))
+            return false;
+    }
+    if (!Visit_by_range(Load_Ptr(&root->left_son_ptr), boxpoint, visitor, Son_State(root, state, true)))
+        return false;
+    return Visit_by_range(Load_Ptr(&root->right_son_ptr), boxpoint, visitor, Son_State(root, state, false));
+}
+
+template <typename PointType>
+template <typename Visitor>
+bool KD_TREE<PointType>::Visit_by_radius(KD_TREE_NODE *root, const PointType &point, float radius, Visitor &visitor, Push_Down_State state)
+{
+    if (root == nullptr)
+        return true;
+    PointType range_center;
+    range_center.x = (root->node_range_x[0] + root->node_range_x[1]) * 0.5;
+    range_center.y = (root->node_range_y[0] + root->node_range_y[1]) * 0.5;
+    range_center.z = (root->node_range_z[0] + root->node_range_z[1]) * 0.5;
+    float dist = sqrt(calc_dist(range_center, point));
+    if (dist > radius + sqrt(root->radius_sq))
+        return true;
+    if (dist <= radius - sqrt(root->radius_sq))
+        return Visit_Subtree(root, visitor, state);
+    if (!Point_Deleted(root, state) && calc_dist(root->point, point) <= radius * radius)
+    {
+        if (!visitor(static_cast<const Node_Point &>(root->point)))
+            return false;
+    }
+    if (!Visit_by_radius(Load_Ptr(&root->left_son_ptr), point, radius, visitor, Son_State(root, state, true)))
+        return false;
+    return Visit_by_radius(Load_Ptr(&root->right_son_ptr), point, radius, visitor, Son_State(root, state, false));
+}
+
+template <typename PointType>
+template <typename Visitor>
+bool KD_TREE<PointType>::Visit_Subtree(KD_TREE_NODE *root, Visitor &visitor, Push_Down_State state)
+{
+    if (root == nullptr || Tree_Deleted(root, state))
+        return true;
+    if (!Point_Deleted(root, state) && !visitor(static_cast<const Node_Point &>(root->point)))
+        return false;
+    if (!Visit_Subtree(Load_Ptr(&root->left_son_ptr), visitor, Son_State(root, state, true)))
+        return false;
+    return Visit_Subtree(Load_Ptr(&root->right_son_ptr), visitor, Son_State(root, state, false));
+}
+
 // template <typename PointType>
 // PointType KD_TREE<PointType>::zeroP = PointType(0,0,0);
@@ -0,0 +1,401 @@
+#include "ivox.h"
+
+/*
+Description: Incremental voxel map, an alternative to the ikd-Tree for the map matching of the mapping node.
+The map is a hash of cubic voxels with a bounded point array each, in the spirit of iVox (Faster-LIO).
+*/
+
+template <typename PointType>
+IVOX<PointType>::IVOX(float resolution, int nearby_type, int capacity, int voxel_point_cap)
+{
+    InitializeIVox(resolution, nearby_type, capacity, voxel_point_cap);
+}
+
+template <typename PointType>
+void IVOX<PointType>::InitializeIVox(float resolution, int nearby_type, int capacity, int voxel_point_cap)
+{
+    this->resolution = resolution;
+    inv_resolution = 1.0f / resolution;
+    this->capacity = max(capacity, 1);
+    this->voxel_point_cap = max(voxel_point_cap, 1);
+    nearby_offsets.clear();
+    nearby_offsets.push_back({0, 0, 0});
+    for (int dx = -1; dx <= 1; dx++)
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dz = -1; dz <= 1; dz++)
+            {
+                // Faces differ from the center voxel in one coordinate, edges in two and corners in three.
+                int changed = abs(dx) + abs(dy) + abs(dz);
+                if (changed == 0)
+                    continue;
+                if ((changed == 1 && nearby_type >= NEARBY_FACES) || (changed == 2 && nearby_type >= NEARBY_EDGES) || (changed == 3 && nearby_type >= NEARBY_CORNERS))
+                    nearby_offsets.push_back({dx, dy, dz});
+            }
+    // Nearer voxels first, they hold the likely neighbours.
+    stable_sort(nearby_offsets.begin() + 1, nearby_offsets.end(), [](const Voxel_Key &a, const Voxel_Key &b)
+                { return abs(a.x) + abs(a.y) + abs(a.z) < abs(b.x) + abs(b.y) + abs(b.z); });
+    vector<Voxel>().swap(voxel_pool);
+    vector<int>().swap(free_voxels);
+    lru_head = lru_tail = -1;
+    voxel_count = 0;
+    // Resize_Grid carries the old slots over, their voxels are gone
+    vector<Grid_Slot>().swap(grid);
+    Resize_Grid(IVox_Min_Grid_Slots);
+    point_num = 0;
+    evicted_voxel_counter = 0;
+    rejected_point_counter = 0;
+}
+
+template <typename PointType>
+void IVOX<PointType>::set_downsample_param(float downsample_param)
+{
+    downsample_size = downsample_param;
+}
+
+template <typename PointType>
+int IVOX<PointType>::size()
+{
+    return point_num;
+}
+
+template <typename PointType>
+int IVOX<PointType>::voxel_num()
+{
+    return voxel_count;
+}
+
+template <typename PointType>
+long IVOX<PointType>::evicted_voxel_num()
+{
+    return evicted_voxel_counter;
+}
+
+template <typename PointType>
+long IVOX<PointType>::rejected_point_num()
+{
+    return rejected_point_counter;
+}
+
+template <typename PointType>
+size_t IVOX<PointType>::memory()
+{
+    size_t bytes = grid.capacity() * sizeof(Grid_Slot) + voxel_pool.capacity() * sizeof(Voxel) + free_voxels.capacity() * sizeof(int);
+    for (const Voxel &voxel : voxel_pool)
+        bytes += voxel.points.capacity() * sizeof(PointType);
+    return bytes;
+}
+
+template <typename PointType>
+float IVOX<PointType>::calc_dist(const PointType &a, const PointType &b)
+{
+    return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z);
+}
+
+template <typename PointType>
+typename IVOX<PointType>::Voxel_Key IVOX<PointType>::Pos_To_Key(float x, float y, float z) const
+{
+    return {int(floor(x * inv_resolution)), int(floor(y * inv_resolution)), int(floor(z * inv_resolution))};
+}
+
+template <typename PointType>
+size_t IVOX<PointType>::Home_Slot(const Voxel_Key &key) const
+{
+    uint64_t hash = (uint64_t(uint32_t(key.x)) * IVox_Hash_P1) ^ (uint64_t(uint32_t(key.y)) * IVox_Hash_P2) ^ (uint64_t(uint32_t(key.z)) * IVox_Hash_P3);
+    // Fibonacci hashing spreads the product over the top bits, which index the table.
+    return size_t((hash * 0x9E3779B97F4A7C15ull) >> grid_shift);
+}
+
+template <typename PointType>
+size_t IVOX<PointType>::Find_Slot(const Voxel_Key &key) const
+{
+    size_t mask = grid.size() - 1;
+    size_t slot = Home_Slot(key);
+    while (grid[slot].voxel >= 0 && !(grid[slot].key == key))
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+template <typename PointType>
+void IVOX<PointType>::Erase_Slot(size_t slot)
+{
+    // Backward shift deletion: later entries of the probe run move into the hole unless that would put
+    // them before their home slot, so lookups never need tombstones.
+    size_t mask = grid.size() - 1;
+    size_t hole = slot;
+    for (size_t next = (hole + 1) & mask; grid[next].voxel >= 0; next = (next + 1) & mask)
+    {
+        size_t home = Home_Slot(grid[next].key);
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            grid[hole] = grid[next];
+            hole = next;
+        }
+    }
+    grid[hole].voxel = -1;
+}
+
+template <typename PointType>
+void IVOX<PointType>::Resize_Grid(size_t slot_num)
+{
+    vector<Grid_Slot> old_grid(slot_num);
+    old_grid.swap(grid);
+    for (Grid_Slot &slot : grid)
+        slot.voxel = -1;
+    grid_shift = 64;
+    while (slot_num > 1)
+    {
+        slot_num >>= 1;
+        grid_shift--;
+    }
+    for (const Grid_Slot &slot : old_grid)
+        if (slot.voxel >= 0)
+            grid[Find_Slot(slot.key)] = slot;
+}
+
+template <typename PointType>
+void IVOX<PointType>::Unlink_Voxel(int voxel)
+{
+    Voxel &v = voxel_pool[voxel];
+    if (v.prev >= 0)
+        voxel_pool[v.prev].next = v.next;
+    else
+        lru_head = v.next;
+    if (v.next >= 0)
+        voxel_pool[v.next].prev = v.prev;
+    else
+        lru_tail = v.prev;
+}
+
+template <typename PointType>
+void IVOX<PointType>::Push_Front_Voxel(int voxel)
+{
+    Voxel &v = voxel_pool[voxel];
+    v.prev = -1;
+    v.next = lru_head;
+    if (lru_head >= 0)
+        voxel_pool[lru_head].prev = voxel;
+    else
+        lru_tail = voxel;
+    lru_head = voxel;
+}
+
+template <typename PointType>
+void IVOX<PointType>::Release_Voxel(int voxel)
+{
+    Voxel &v = voxel_pool[voxel];
+    point_num -= v.points.size();
+    Erase_Slot(Find_Slot(v.key));
+    Unlink_Voxel(voxel);
+    PointVector().swap(v.points);
+    free_voxels.push_back(voxel);
+    voxel_count--;
+}
+
+template <typename PointType>
+bool IVOX<PointType>::Insert_Point(Voxel &voxel, const PointType &point, bool downsample_on)
+{
+    if (downsample_on && downsample_size > 0.0f)
+    {
+        float cell_x = floor(point.x / downsample_size), cell_y = floor(point.y / downsample_size), cell_z = floor(point.z / downsample_size);
+        PointType mid_point;
+        mid_point.x = (cell_x + 0.5f) * downsample_size;
+        mid_point.y = (cell_y + 0.5f) * downsample_size;
+        mid_point.z = (cell_z + 0.5f) * downsample_size;
+        for (PointType &stored : voxel.points)
+        {
+            if (floor(stored.x / downsample_size) != cell_x || floor(stored.y / downsample_size) != cell_y || floor(stored.z / downsample_size) != cell_z)
+                continue;
+            // The cube is taken, keep whichever point is nearer to its center.
+            if (calc_dist(point, mid_point) < calc_dist(stored, mid_point))
+                stored = point;
+            return false;
+        }
+    }
+    if (int(voxel.points.size()) >= voxel_point_cap)
+    {
+        rejected_point_counter++;
+        return false;
+    }
+    voxel.points.push_back(point);
+    point_num++;
+    return true;
+}
+
+template <typename PointType>
+void IVOX<PointType>::Evict_Voxels()
+{
+    while (voxel_count > capacity)
+    {
+        Release_Voxel(lru_tail);
+        evicted_voxel_counter++;
+    }
+}
+
+template <typename PointType>
+int IVOX<PointType>::Add_Points(const PointVector &PointToAdd, bool downsample_on)
+{
+    int add_num = 0;
+    for (const PointType &point : PointToAdd)
+    {
+        Voxel_Key key = Pos_To_Key(point.x, point.y, point.z);
+        size_t slot = Find_Slot(key);
+        if (grid[slot].voxel < 0)
+        {
+            if (size_t(voxel_count + 1) * 2 > grid.size())
+            {
+                Resize_Grid(grid.size() * 2);
+                slot = Find_Slot(key);
+            }
+            int voxel = voxel_pool.size();
+            if (!free_voxels.empty())
+            {
+                voxel = free_voxels.back();
+                free_voxels.pop_back();
+            }
+            else
+            {
+                voxel_pool.emplace_back();
+            }
+            voxel_pool[voxel].key = key;
+            voxel_pool[voxel].points.reserve(min(voxel_point_cap, 4));
+            Push_Front_Voxel(voxel);
+            voxel_count++;
+            grid[slot].key = key;
+            grid[slot].voxel = voxel;
+        }
+        else if (grid[slot].voxel != lru_head)
+        {
+            Unlink_Voxel(grid[slot].voxel);
+            Push_Front_Voxel(grid[slot].voxel);
+        }
+        Voxel &voxel = voxel_pool[grid[slot].voxel];
+        if (Insert_Point(voxel, point, downsample_on))
+            add_num++;
+        grid[slot].points = voxel.points.data();
+        grid[slot].point_num = voxel.points.size();
+        // Evicting moves slots, so only once this point's slot is no longer needed.
+        Evict_Voxels();
+    }
+    return add_num;
+}
+
+template <typename PointType>
+int IVOX<PointType>::Delete_Point_Boxes(const vector<BoxPointType> &BoxPoints, PointVector *Removed_Points)
+{
+    int delete_num = 0;
+    auto in_box = [](const BoxPointType &box, float x, float y, float z)
+    {
+        return box.vertex_min[0] <= x && x < box.vertex_max[0] && box.vertex_min[1] <= y && y < box.vertex_max[1] && box.vertex_min[2] <= z && z < box.vertex_max[2];
+    };
+    for (int voxel = lru_head; voxel >= 0;)
+    {
+        Voxel &v = voxel_pool[voxel];
+        int next = v.next;
+        float voxel_min[3] = {v.key.x * resolution, v.key.y * resolution, v.key.z * resolution};
+        bool touched = false, covered = false;
+        for (const BoxPointType &box : BoxPoints)
+        {
+            bool overlap = true, inside = true;
+            for (int i = 0; i < 3; i++)
+            {
+                overlap = overlap && box.vertex_min[i] < voxel_min[i] + resolution && voxel_min[i] <= box.vertex_max[i];
+                inside = inside && box.vertex_min[i] <= voxel_min[i] && voxel_min[i] + resolution <= box.vertex_max[i];
+            }
+            touched = touched || overlap;
+            covered = covered || inside;
+        }
+        if (touched && !covered)
+        {
+            PointVector &points = v.points;
+            size_t kept = 0;
+            for (size_t i = 0; i < points.size(); i++)
+            {
+                bool deleted = false;
+                for (const BoxPointType &box : BoxPoints)
+                    deleted = deleted || in_box(box, points[i].x, points[i].y, points[i].z);
+                if (!deleted)
+                    points[kept++] = points[i];
+                else if (Removed_Points != nullptr)
+                    Removed_Points->push_back(points[i]);
+            }
+            delete_num += points.size() - kept;
+            point_num -= points.size() - kept;
+            points.resize(kept);
+            covered = points.empty();
+            if (!covered)
+                grid[Find_Slot(v.key)].point_num = kept;
+        }
+        if (covered)
+        {
+            if (Removed_Points != nullptr)
+                Removed_Points->insert(Removed_Points->end(), v.points.begin(), v.points.end());
+            delete_num += v.points.size();
+            Release_Voxel(voxel);
+        }
+        voxel = next;
+    }
+    return delete_num;
+}
+
+template <typename PointType>
+int IVOX<PointType>::Search_Nearby(const PointType &point, int k_nearest, PointType *Nearest_Points, float *Point_Distance, float max_dist)
+{
+    float max_dist_sqr = max_dist * max_dist;
+    int found_num = 0;
+    Voxel_Key center = Pos_To_Key(point.x, point.y, point.z);
+    for (const Voxel_Key &offset : nearby_offsets)
+    {
+        const Grid_Slot &slot = grid[Find_Slot({center.x + offset.x, center.y + offset.y, center.z + offset.z})];
+        if (slot.voxel < 0)
+            continue;
+        for (int i = 0; i < slot.point_num; i++)
+        {
+            const PointType &candidate = slot.points[i];
+            float dist = calc_dist(point, candidate);
+            if (dist > max_dist_sqr || (found_num == k_nearest && dist >= Point_Distance[found_num - 1]))
+                continue;
+            // Insertion into the short sorted result list, dropping its farthest point when full.
+            int pos = found_num < k_nearest ? found_num++ : k_nearest - 1;
+            while (pos > 0 && Point_Distance[pos - 1] > dist)
+            {
+                Point_Distance[pos] = Point_Distance[pos - 1];
+                Nearest_Points[pos] = Nearest_Points[pos - 1];
+                pos--;
+            }
+            Point_Distance[pos] = dist;
+            Nearest_Points[pos] = candidate;
+        }
+    }
+    return found_num;
+}
+
+template <typename PointType>
+void IVOX<PointType>::Nearest_Search(const PointType &point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist)
+{
+    Nearest_Points.resize(k_nearest);
+    Point_Distance.resize(k_nearest);
+    int found_num = Search_Nearby(point, k_nearest, Nearest_Points.data(), Point_Distance.data(), max_dist);
+    Nearest_Points.resize(found_num);
+    Point_Distance.resize(found_num);
+}
+
+template <typename PointType>
+void IVOX<PointType>::Nearest_Search_Batch(const PointType *Points, int Point_Num, PointType *Nearest_Points, float *Point_Distance, int *Found_Num, float max_dist)
+{
+    for (int i = 0; i < Point_Num; i++)
+        Found_Num[i] = Search_Nearby(Points[i], Batch_Nearest_K, Nearest_Points + i * Batch_Nearest_K, Point_Distance + i * Batch_Nearest_K, max_dist);
+}
+
+template <typename PointType>
+void IVOX<PointType>::Get_Points(PointVector &Storage)
+{
+    Storage.clear();
+    Storage.reserve(point_num);
+    for (int voxel = lru_head; voxel >= 0; voxel = voxel_pool[voxel].next)
+        Storage.insert(Storage.end(), voxel_pool[voxel].points.begin(), voxel_pool[voxel].points.end());
+}
+
+// Manual Instatiations
+template class IVOX<pcl::PointXYZ>;
+template class IVOX<pcl::PointXYZI>;
+template class IVOX<pcl::PointXYZINormal>;
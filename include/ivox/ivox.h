@@ -0,0 +1,129 @@
+#pragma once
+#include <stdio.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+#include <pcl/point_types.h>
+#include "ikd-Tree/ikd_Tree.h"
+
+#define IVox_Default_Resolution 0.5f
+#define IVox_Default_Capacity 1000000
+#define IVox_Default_Voxel_Points 20
+#define IVox_Hash_P1 73856093
+#define IVox_Hash_P2 19349669
+#define IVox_Hash_P3 83492791
+#define IVox_Min_Grid_Slots 1024
+
+// Incremental voxel map. Points are stored in a hash of cubic voxels, each holding a bounded linear
+// array of points, and a k-NN query only scans the voxels around the query point. The search is
+// therefore approximate: a neighbour outside the scanned neighbourhood is never found. Voxels are
+// ordered by their last insertion and the least recently updated ones are evicted once the map holds
+// more than its capacity. Single threaded, all calls must come from the same thread.
+template <typename PointType>
+class IVOX
+{
+public:
+    using PointVector = std::vector<PointType, Eigen::aligned_allocator<PointType>>;
+
+    // Voxels scanned around the voxel of a query point.
+    enum Nearby_Type
+    {
+        NEARBY_CENTER = 0,
+        NEARBY_FACES = 6,
+        NEARBY_EDGES = 18,
+        NEARBY_CORNERS = 26
+    };
+
+private:
+    struct Voxel_Key
+    {
+        int x, y, z;
+        bool operator==(const Voxel_Key &other) const
+        {
+            return x == other.x && y == other.y && z == other.z;
+        }
+    };
+
+    struct Voxel
+    {
+        Voxel_Key key;
+        // Neighbours in the eviction order, -1 at its ends.
+        int prev, next;
+        PointVector points;
+    };
+
+    // Open-addressed hash slot. The point array of the voxel is mirrored here, so a search reads the slot
+    // and the points without touching the voxel.
+    struct Grid_Slot
+    {
+        Voxel_Key key;
+        // Index into voxel_pool, -1 for an empty slot.
+        int voxel;
+        int point_num;
+        const PointType *points;
+    };
+
+    float resolution = IVox_Default_Resolution;
+    float inv_resolution = 1.0f / IVox_Default_Resolution;
+    float downsample_size = 0.0f;
+    int capacity = IVox_Default_Capacity;
+    int voxel_point_cap = IVox_Default_Voxel_Points;
+    std::vector<Voxel_Key> nearby_offsets;
+    std::vector<Voxel> voxel_pool;
+    std::vector<int> free_voxels;
+    // Most recently inserted voxel at the head, eviction takes from the tail.
+    int lru_head = -1, lru_tail = -1;
+    int voxel_count = 0;
+    // Linear probing table of a power of two slots, kept at most half full.
+    std::vector<Grid_Slot> grid;
+    int grid_shift = 64;
+    int point_num = 0;
+    long evicted_voxel_counter = 0;
+    long rejected_point_counter = 0;
+
+    static float calc_dist(const PointType &a, const PointType &b);
+    Voxel_Key Pos_To_Key(float x, float y, float z) const;
+    size_t Home_Slot(const Voxel_Key &key) const;
+    // Slot holding key, or the empty slot where it would go.
+    size_t Find_Slot(const Voxel_Key &key) const;
+    void Erase_Slot(size_t slot);
+    void Resize_Grid(size_t slot_num);
+    void Unlink_Voxel(int voxel);
+    void Push_Front_Voxel(int voxel);
+    void Release_Voxel(int voxel);
+    bool Insert_Point(Voxel &voxel, const PointType &point, bool downsample_on);
+    void Evict_Voxels();
+    // Up to k_nearest neighbours within max_dist, nearest first, written to Nearest_Points and
+    // Point_Distance. Returns how many were found.
+    int Search_Nearby(const PointType &point, int k_nearest, PointType *Nearest_Points, float *Point_Distance, float max_dist);
+
+public:
+    IVOX(float resolution = IVox_Default_Resolution, int nearby_type = NEARBY_EDGES, int capacity = IVox_Default_Capacity, int voxel_point_cap = IVox_Default_Voxel_Points);
+    ~IVOX() = default;
+    // Clears the map. capacity is in voxels, voxel_point_cap bounds the points per voxel.
+    void InitializeIVox(float resolution, int nearby_type, int capacity, int voxel_point_cap);
+    // Downsampled insertion keeps one point per cube of this size, the one nearest to its center. Use a
+    // resolution that is a multiple of it, so no cube straddles two voxels.
+    void set_downsample_param(float downsample_param);
+    int size();
+    int voxel_num();
+    // Voxels dropped to stay within the capacity since the map was initialized.
+    long evicted_voxel_num();
+    // Points not inserted because their voxel was full.
+    long rejected_point_num();
+    // Bytes held by points, voxels and the hash table.
+    size_t memory();
+    // Inserts points, moving their voxels to the front of the eviction order, and returns how many were
+    // stored. A full voxel takes no more points.
+    int Add_Points(const PointVector &PointToAdd, bool downsample_on);
+    // Removes points with vertex_min <= p < vertex_max in any box and returns how many were removed. The
+    // removed points are appended to Removed_Points if it is given.
+    int Delete_Point_Boxes(const vector<BoxPointType> &BoxPoints, PointVector *Removed_Points = nullptr);
+    void Nearest_Search(const PointType &point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist = INFINITY);
+    // Same layout as KD_TREE::Nearest_Search_Batch: query i writes up to Batch_Nearest_K neighbours, nearest
+    // first, to Nearest_Points[i * Batch_Nearest_K ...] and Point_Distance[i * Batch_Nearest_K ...] and the
+    // count to Found_Num[i].
+    void Nearest_Search_Batch(const PointType *Points, int Point_Num, PointType *Nearest_Points, float *Point_Distance, int *Found_Num, float max_dist = INFINITY);
+    void Get_Points(PointVector &Storage);
+};
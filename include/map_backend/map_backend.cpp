@@ -0,0 +1,640 @@
+#include "map_backend.h"
+
+/*
+Description: the map backends behind MAP_BACKEND, the ikd-Tree, the ikd-Tree forest and the incremental voxel map.
+*/
+
+// Appends the points of the tree in any box to Storage, a point in several boxes is taken from the first one.
+template <typename PointType>
+static void Search_Box_Points(KD_TREE<PointType> &tree, const vector<BoxPointType> &BoxPoints, typename MAP_BACKEND<PointType>::PointVector &Storage)
+{
+    for (size_t i = 0; i < BoxPoints.size(); i++)
+        tree.Box_Search(BoxPoints[i], [&](const typename KD_TREE<PointType>::Node_Point &point)
+                        {
+            for (size_t j = 0; j < i; j++)
+                if (BoxPoints[j].vertex_min[0] <= point.x && point.x < BoxPoints[j].vertex_max[0] && BoxPoints[j].vertex_min[1] <= point.y && point.y < BoxPoints[j].vertex_max[1] && BoxPoints[j].vertex_min[2] <= point.z && point.z < BoxPoints[j].vertex_max[2])
+                    return true;
+            Storage.push_back(point);
+            return true; });
+}
+
+template <typename PointType>
+IKD_TREE_BACKEND<PointType>::IKD_TREE_BACKEND(const Map_Backend_Config &config) : config(config)
+{
+    ikdtree.set_downsample_param(config.downsample_size);
+    ikdtree.Set_leaf_bucket_size(config.leaf_bucket_size);
+    ikdtree.Set_build_thread_num(config.build_thread_num);
+    ikdtree.Set_rebuild_budget(config.rebuild_budget_ms);
+    ikdtree.Set_snapshot_interval(config.snapshot_interval);
+}
+
+template <typename PointType>
+bool IKD_TREE_BACKEND<PointType>::initialized()
+{
+    return ikdtree.Root_Node != nullptr;
+}
+
+template <typename PointType>
+int IKD_TREE_BACKEND<PointType>::size()
+{
+    return ikdtree.validnum();
+}
+
+template <typename PointType>
+size_t IKD_TREE_BACKEND<PointType>::memory()
+{
+    return ikdtree.node_memory() + ikdtree.voxel_map_memory() + ikdtree.rebuild_log_memory();
+}
+
+template <typename PointType>
+void IKD_TREE_BACKEND<PointType>::Build(PointVector &&points)
+{
+    ikdtree.Build(std::move(points));
+}
+
+template <typename PointType>
+bool IKD_TREE_BACKEND<PointType>::Load(const string &path)
+{
+    return ikdtree.Load(path);
+}
+
+template <typename PointType>
+void IKD_TREE_BACKEND<PointType>::Nearest_Search(const PointType &point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist)
+{
+    ikdtree.Nearest_Search(point, k_nearest, Nearest_Points, Point_Distance, max_dist, config.knn_epsilon, config.knn_max_visit);
+}
+
+template <typename PointType>
+void IKD_TREE_BACKEND<PointType>::Nearest_Search_Batch(const PointType *Points, int Point_Num, PointType *Nearest_Points, float *Point_Distance, int *Found_Num, float max_dist)
+{
+    ikdtree.Nearest_Search_Batch(Points, Point_Num, batch_context, Nearest_Points, Point_Distance, Found_Num, max_dist, config.knn_epsilon, config.knn_max_visit);
+}
+
+template <typename PointType>
+int IKD_TREE_BACKEND<PointType>::Add_Points(PointVector &PointToAdd, bool downsample_on)
+{
+    return ikdtree.Add_Points(PointToAdd, downsample_on);
+}
+
+template <typename PointType>
+void IKD_TREE_BACKEND<PointType>::Set_Downsample_Size(float downsample_size)
+{
+    config.downsample_size = downsample_size;
+    ikdtree.set_downsample_param(downsample_size);
+}
+
+template <typename PointType>
+int IKD_TREE_BACKEND<PointType>::Delete_Point_Boxes(vector<BoxPointType> &BoxPoints, PointVector *Removed_Points)
+{
+    // The tree keeps the points removed by deletions until they are collected, drain them so they do not pile up
+    removed_points.clear();
+    ikdtree.acquire_removed_points(removed_points);
+    // Those are only reported once a rebuild drops them, so the removed points are searched up front.
+    if (Removed_Points != nullptr)
+        Search_Box_Points(ikdtree, BoxPoints, *Removed_Points);
+    return ikdtree.Delete_Point_Boxes(BoxPoints);
+}
+
+template <typename PointType>
+void IKD_TREE_BACKEND<PointType>::Get_Points(PointVector &Storage)
+{
+    Storage.clear();
+    ikdtree.flatten(ikdtree.Root_Node, Storage, NOT_RECORD);
+}
+
+template <typename PointType>
+void IKD_TREE_BACKEND<PointType>::Get_Statistics(Map_Statistics &stats)
+{
+    typename KD_TREE<PointType>::Tree_Statistics tree_stats;
+    ikdtree.Get_Statistics(tree_stats);
+    stats.fields = {{"node_num", to_string(tree_stats.node_num)},
+                    {"deleted_num", to_string(tree_stats.deleted_num)},
+                    {"alpha_bal", to_string(tree_stats.alpha_bal)},
+                    {"alpha_del", to_string(tree_stats.alpha_del)},
+                    {"foreground_rebuild_num", to_string(tree_stats.foreground_rebuild_num)},
+                    {"foreground_rebuild_time", to_string(tree_stats.foreground_rebuild_time)},
+                    {"background_rebuild_num", to_string(tree_stats.background_rebuild_num)},
+                    {"background_rebuild_time", to_string(tree_stats.background_rebuild_time)},
+                    {"push_down_num", to_string(tree_stats.push_down_num)},
+                    {"box_delete_num", to_string(tree_stats.box_delete_num)},
+                    {"rebuild_debt", to_string(tree_stats.rebuild_debt)},
+                    {"rebuild_abort_num", to_string(tree_stats.rebuild_abort_num)},
+                    {"log_high_water", to_string(tree_stats.log_high_water)},
+                    {"node_bytes", to_string(tree_stats.node_bytes)},
+                    {"voxel_map_bytes", to_string(tree_stats.voxel_map_bytes)},
+                    {"rebuild_log_bytes", to_string(tree_stats.rebuild_log_bytes)}};
+    stats.depth_histogram.assign(tree_stats.depth_histogram, tree_stats.depth_histogram + Stats_Depth_Bins);
+}
+
+template <typename PointType>
+void IKD_TREE_BACKEND<PointType>::Map_Updated()
+{
+    if (config.relayout_interval > 0 && ++update_num >= config.relayout_interval && ikdtree.Relayout())
+        update_num = 0;
+}
+
+template <typename PointType>
+void IKD_TREE_BACKEND<PointType>::Scan_Done()
+{
+    ikdtree.Run_Pending_Rebuilds();
+    ikdtree.Publish_Snapshot(); // only copies the map when another thread asked for a fresh read view
+}
+
+template <typename PointType>
+IKD_FOREST_BACKEND<PointType>::IKD_FOREST_BACKEND(const Map_Backend_Config &config) : config(config)
+{
+    inv_chunk_size = 1.0f / config.forest_chunk_size;
+    fov_checker.Set_BoxLength(config.forest_chunk_size);
+}
+
+template <typename PointType>
+bool IKD_FOREST_BACKEND<PointType>::initialized()
+{
+    return built;
+}
+
+template <typename PointType>
+int IKD_FOREST_BACKEND<PointType>::size()
+{
+    int point_num = 0;
+    for (auto &chunk : chunks)
+        point_num += chunk.second.tree->validnum();
+    for (auto &chunk : parked_chunks)
+        point_num += chunk.second.tree->validnum();
+    return point_num;
+}
+
+template <typename PointType>
+size_t IKD_FOREST_BACKEND<PointType>::memory()
+{
+    size_t bytes = 0;
+    for (Chunk_Map *chunk_map : {&chunks, &parked_chunks})
+    {
+        bytes += chunk_map->bucket_count() * sizeof(void *) + chunk_map->size() * sizeof(typename Chunk_Map::value_type);
+        for (auto &chunk : *chunk_map)
+            bytes += chunk.second.tree->node_memory() + chunk.second.tree->voxel_map_memory() + chunk.second.tree->rebuild_log_memory();
+    }
+    return bytes;
+}
+
+template <typename PointType>
+typename IKD_FOREST_BACKEND<PointType>::Chunk_Key IKD_FOREST_BACKEND<PointType>::Pos_To_Key(float x, float y) const
+{
+    return {int(floor(x * inv_chunk_size)), int(floor(y * inv_chunk_size))};
+}
+
+template <typename PointType>
+typename IKD_FOREST_BACKEND<PointType>::Chunk &IKD_FOREST_BACKEND<PointType>::Active_Chunk(const Chunk_Key &key)
+{
+    auto iter = chunks.find(key);
+    if (iter != chunks.end())
+        return iter->second;
+    auto parked = parked_chunks.find(key);
+    if (parked != parked_chunks.end())
+    {
+        Chunk &chunk = chunks.emplace(key, std::move(parked->second)).first->second;
+        parked_chunks.erase(parked);
+        restored_chunk_counter++;
+        return chunk;
+    }
+    Chunk &chunk = chunks[key];
+    chunk.tree.reset(new KD_TREE<PointType>(0.5, 0.6, config.downsample_size, false));
+    chunk.tree->Set_leaf_bucket_size(config.leaf_bucket_size);
+    chunk.min_z = INFINITY;
+    chunk.max_z = -INFINITY;
+    return chunk;
+}
+
+template <typename PointType>
+int IKD_FOREST_BACKEND<PointType>::Insert_Points(const PointVector &points, bool downsample_on)
+{
+    touched_chunks.clear();
+    for (size_t i = 0; i < points.size(); i++)
+    {
+        Chunk &chunk = Active_Chunk(Pos_To_Key(points[i].x, points[i].y));
+        if (chunk.pending.empty())
+            touched_chunks.push_back(&chunk);
+        chunk.pending.push_back(points[i]);
+        chunk.min_z = min(chunk.min_z, points[i].z);
+        chunk.max_z = max(chunk.max_z, points[i].z);
+    }
+    int added_num = 0;
+#pragma omp parallel for num_threads(max(config.build_thread_num, 1)) schedule(dynamic) reduction(+ : added_num)
+    for (int i = 0; i < int(touched_chunks.size()); i++)
+    {
+        Chunk &chunk = *touched_chunks[i];
+        if (chunk.tree->Root_Node == nullptr && !downsample_on)
+        {
+            added_num += chunk.pending.size();
+            chunk.tree->Build(std::move(chunk.pending));
+        }
+        else
+        {
+            // A new column is seeded with one point so the rest goes through the downsampled insertion
+            if (chunk.tree->Root_Node == nullptr)
+            {
+                chunk.tree->Build(PointVector(1, chunk.pending.back()));
+                chunk.pending.pop_back();
+                added_num++;
+            }
+            added_num += chunk.tree->Add_Points(chunk.pending, downsample_on);
+        }
+        chunk.pending.clear();
+    }
+    return added_num;
+}
+
+template <typename PointType>
+void IKD_FOREST_BACKEND<PointType>::Build(PointVector &&points)
+{
+    chunks.clear();
+    parked_chunks.clear();
+    dropped_trees.clear();
+    Insert_Points(points, false);
+    PointVector().swap(points);
+    built = true;
+}
+
+template <typename PointType>
+void IKD_FOREST_BACKEND<PointType>::Search_Neighbour_Chunks(const PointType &point, const Chunk_Key &home, int k_nearest, PointType *Nearest_Points, float *Point_Distance, int &found, float max_dist)
+{
+    float chunk_size = config.forest_chunk_size;
+    float bound = found == k_nearest ? Point_Distance[k_nearest - 1] : max_dist * max_dist;
+    float wall_x = min(point.x - home.x * chunk_size, (home.x + 1) * chunk_size - point.x);
+    float wall_y = min(point.y - home.y * chunk_size, (home.y + 1) * chunk_size - point.y);
+    float wall = min(wall_x, wall_y);
+    if (wall * wall > bound)
+        return;
+    auto search_chunk = [&](const Chunk_Key &key, Chunk &chunk)
+    {
+        float dx = max(max(key.x * chunk_size - point.x, point.x - (key.x + 1) * chunk_size), 0.0f);
+        float dy = max(max(key.y * chunk_size - point.y, point.y - (key.y + 1) * chunk_size), 0.0f);
+        if (dx * dx + dy * dy > bound)
+            return;
+        chunk.tree->Nearest_Search(point, k_nearest, search_points, search_distance, sqrt(bound), config.knn_epsilon, config.knn_max_visit);
+        for (size_t i = 0; i < search_points.size(); i++)
+        {
+            if (found == k_nearest && search_distance[i] >= Point_Distance[found - 1])
+                break;
+            int j = found < k_nearest ? found++ : found - 1;
+            for (; j > 0 && Point_Distance[j - 1] > search_distance[i]; j--)
+            {
+                Nearest_Points[j] = Nearest_Points[j - 1];
+                Point_Distance[j] = Point_Distance[j - 1];
+            }
+            Nearest_Points[j] = search_points[i];
+            Point_Distance[j] = search_distance[i];
+        }
+        if (found == k_nearest)
+            bound = min(bound, Point_Distance[k_nearest - 1]);
+    };
+    // Any neighbour closer than a chunk size lies in the 8 columns around home, the rest of the map is only
+    // searched while fewer than k neighbours are known that close.
+    for (int dx = -1; dx <= 1; dx++)
+        for (int dy = -1; dy <= 1; dy++)
+        {
+            if (dx == 0 && dy == 0)
+                continue;
+            Chunk_Key key = {home.x + dx, home.y + dy};
+            auto iter = chunks.find(key);
+            if (iter != chunks.end())
+                search_chunk(key, iter->second);
+        }
+    if (bound <= chunk_size * chunk_size)
+        return;
+    for (auto &chunk : chunks)
+        if (abs(chunk.first.x - home.x) > 1 || abs(chunk.first.y - home.y) > 1)
+            search_chunk(chunk.first, chunk.second);
+}
+
+template <typename PointType>
+void IKD_FOREST_BACKEND<PointType>::Nearest_Search(const PointType &point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist)
+{
+    Chunk_Key home = Pos_To_Key(point.x, point.y);
+    auto iter = chunks.find(home);
+    if (iter != chunks.end())
+        iter->second.tree->Nearest_Search(point, k_nearest, Nearest_Points, Point_Distance, max_dist, config.knn_epsilon, config.knn_max_visit);
+    else
+    {
+        Nearest_Points.clear();
+        Point_Distance.clear();
+    }
+    int found = Nearest_Points.size();
+    Nearest_Points.resize(k_nearest);
+    Point_Distance.resize(k_nearest);
+    Search_Neighbour_Chunks(point, home, k_nearest, Nearest_Points.data(), Point_Distance.data(), found, max_dist);
+    Nearest_Points.resize(found);
+    Point_Distance.resize(found);
+}
+
+template <typename PointType>
+void IKD_FOREST_BACKEND<PointType>::Nearest_Search_Batch(const PointType *Points, int Point_Num, PointType *Nearest_Points, float *Point_Distance, int *Found_Num, float max_dist)
+{
+    // Queries of a column are searched together in its tree, only those near its walls go on to the
+    // neighbouring columns.
+    query_groups.clear();
+    for (int i = 0; i < Point_Num; i++)
+        query_groups[Pos_To_Key(Points[i].x, Points[i].y)].push_back(i);
+    for (auto &group : query_groups)
+    {
+        const vector<int> &queries = group.second;
+        auto iter = chunks.find(group.first);
+        if (iter == chunks.end())
+        {
+            for (size_t i = 0; i < queries.size(); i++)
+                Found_Num[queries[i]] = 0;
+            continue;
+        }
+        int query_num = queries.size();
+        group_points.resize(query_num);
+        group_nearest.resize(query_num * Batch_Nearest_K);
+        group_distance.resize(query_num * Batch_Nearest_K);
+        group_found.resize(query_num);
+        for (int i = 0; i < query_num; i++)
+            group_points[i] = Points[queries[i]];
+        iter->second.tree->Nearest_Search_Batch(group_points.data(), query_num, batch_context, group_nearest.data(), group_distance.data(), group_found.data(), max_dist, config.knn_epsilon, config.knn_max_visit);
+        for (int i = 0; i < query_num; i++)
+        {
+            int index = queries[i];
+            Found_Num[index] = group_found[i];
+            for (int j = 0; j < group_found[i]; j++)
+            {
+                Nearest_Points[index * Batch_Nearest_K + j] = group_nearest[i * Batch_Nearest_K + j];
+                Point_Distance[index * Batch_Nearest_K + j] = group_distance[i * Batch_Nearest_K + j];
+            }
+        }
+    }
+    for (auto &group : query_groups)
+        for (size_t i = 0; i < group.second.size(); i++)
+        {
+            int index = group.second[i];
+            Search_Neighbour_Chunks(Points[index], group.first, Batch_Nearest_K, Nearest_Points + index * Batch_Nearest_K, Point_Distance + index * Batch_Nearest_K, Found_Num[index], max_dist);
+        }
+}
+
+template <typename PointType>
+int IKD_FOREST_BACKEND<PointType>::Add_Points(PointVector &PointToAdd, bool downsample_on)
+{
+    return Insert_Points(PointToAdd, downsample_on);
+}
+
+template <typename PointType>
+void IKD_FOREST_BACKEND<PointType>::Set_Downsample_Size(float downsample_size)
+{
+    // New columns take it from the config
+    config.downsample_size = downsample_size;
+    for (Chunk_Map *chunk_map : {&chunks, &parked_chunks})
+        for (auto &chunk : *chunk_map)
+            chunk.second.tree->set_downsample_param(downsample_size);
+}
+
+template <typename PointType>
+int IKD_FOREST_BACKEND<PointType>::Delete_Chunk_Boxes(Chunk_Map &chunk_map, const vector<BoxPointType> &BoxPoints, PointVector *Removed_Points)
+{
+    float chunk_size = config.forest_chunk_size;
+    vector<BoxPointType> chunk_boxes;
+    int deleted_num = 0;
+    for (auto iter = chunk_map.begin(); iter != chunk_map.end();)
+    {
+        Chunk &chunk = iter->second;
+        float min_x = iter->first.x * chunk_size, max_x = min_x + chunk_size;
+        float min_y = iter->first.y * chunk_size, max_y = min_y + chunk_size;
+        bool covered = false;
+        chunk_boxes.clear();
+        for (size_t i = 0; i < BoxPoints.size(); i++)
+        {
+            const BoxPointType &box = BoxPoints[i];
+            if (box.vertex_max[0] <= min_x || box.vertex_min[0] >= max_x || box.vertex_max[1] <= min_y || box.vertex_min[1] >= max_y || box.vertex_max[2] <= chunk.min_z || box.vertex_min[2] > chunk.max_z)
+                continue;
+            if (box.vertex_min[0] <= min_x && max_x <= box.vertex_max[0] && box.vertex_min[1] <= min_y && max_y <= box.vertex_max[1] && box.vertex_min[2] <= chunk.min_z && chunk.max_z < box.vertex_max[2])
+            {
+                covered = true;
+                break;
+            }
+            chunk_boxes.push_back(box);
+        }
+        if (!covered && !chunk_boxes.empty())
+        {
+            if (Removed_Points != nullptr)
+                Search_Box_Points(*chunk.tree, chunk_boxes, *Removed_Points);
+            deleted_num += chunk.tree->Delete_Point_Boxes(chunk_boxes);
+            // Deleted points are only collected by rebuilds, drain them so they do not pile up
+            search_points.clear();
+            chunk.tree->acquire_removed_points(search_points);
+            covered = chunk.tree->validnum() == 0;
+        }
+        if (!covered)
+        {
+            ++iter;
+            continue;
+        }
+        // The whole column is gone: the tree is unhooked here and freed in Scan_Done
+        if (Removed_Points != nullptr)
+            chunk.tree->flatten(chunk.tree->Root_Node, *Removed_Points, NOT_RECORD);
+        deleted_num += chunk.tree->validnum();
+        dropped_trees.push_back(std::move(chunk.tree));
+        dropped_chunk_counter++;
+        iter = chunk_map.erase(iter);
+    }
+    return deleted_num;
+}
+
+template <typename PointType>
+int IKD_FOREST_BACKEND<PointType>::Delete_Point_Boxes(vector<BoxPointType> &BoxPoints, PointVector *Removed_Points)
+{
+    return Delete_Chunk_Boxes(chunks, BoxPoints, Removed_Points) + Delete_Chunk_Boxes(parked_chunks, BoxPoints, Removed_Points);
+}
+
+template <typename PointType>
+void IKD_FOREST_BACKEND<PointType>::Get_Points(PointVector &Storage)
+{
+    Storage.clear();
+    for (auto &chunk : chunks)
+        chunk.second.tree->flatten(chunk.second.tree->Root_Node, Storage, NOT_RECORD);
+    for (auto &chunk : parked_chunks)
+        chunk.second.tree->flatten(chunk.second.tree->Root_Node, Storage, NOT_RECORD);
+}
+
+template <typename PointType>
+void IKD_FOREST_BACKEND<PointType>::Get_Statistics(Map_Statistics &stats)
+{
+    typename KD_TREE<PointType>::Tree_Statistics tree_stats;
+    long node_num = 0, deleted_num = 0, rebuild_num = 0;
+    double rebuild_time = 0.0;
+    int largest_chunk = 0, searched_point_num = 0;
+    for (auto &chunk : chunks)
+        searched_point_num += chunk.second.tree->validnum();
+    stats.depth_histogram.assign(Stats_Depth_Bins, 0);
+    for (auto &chunk : chunks)
+    {
+        chunk.second.tree->Get_Statistics(tree_stats);
+        node_num += tree_stats.node_num;
+        deleted_num += tree_stats.deleted_num;
+        rebuild_num += tree_stats.foreground_rebuild_num;
+        rebuild_time += tree_stats.foreground_rebuild_time;
+        largest_chunk = max(largest_chunk, tree_stats.node_num);
+        for (int i = 0; i < Stats_Depth_Bins; i++)
+            stats.depth_histogram[i] += tree_stats.depth_histogram[i];
+    }
+    stats.fields = {{"chunk_num", to_string(chunks.size())},
+                    {"point_num", to_string(size())},
+                    {"node_num", to_string(node_num)},
+                    {"deleted_num", to_string(deleted_num)},
+                    {"largest_chunk_node_num", to_string(largest_chunk)},
+                    {"rebuild_num", to_string(rebuild_num)},
+                    {"rebuild_time", to_string(rebuild_time)},
+                    {"dropped_chunk_num", to_string(dropped_chunk_counter)},
+                    {"parked_chunk_num", to_string(parked_chunks.size())},
+                    {"searched_point_num", to_string(searched_point_num)},
+                    {"park_num", to_string(parked_chunk_counter)},
+                    {"restore_num", to_string(restored_chunk_counter)},
+                    {"map_bytes", to_string(memory())}};
+}
+
+template <typename PointType>
+void IKD_FOREST_BACKEND<PointType>::Scan_Done()
+{
+    dropped_trees.clear();
+}
+
+template <typename PointType>
+void IKD_FOREST_BACKEND<PointType>::Set_View(const Eigen::Vector3d &position, const Eigen::Vector3d &axis, double half_angle, double depth)
+{
+    float chunk_size = config.forest_chunk_size;
+    auto in_view = [&](const Chunk_Key &key, const Chunk &chunk)
+    {
+        BoxPointType box;
+        box.vertex_min[0] = key.x * chunk_size - Forest_View_Pad;
+        box.vertex_max[0] = (key.x + 1) * chunk_size + Forest_View_Pad;
+        box.vertex_min[1] = key.y * chunk_size - Forest_View_Pad;
+        box.vertex_max[1] = (key.y + 1) * chunk_size + Forest_View_Pad;
+        box.vertex_min[2] = chunk.min_z - Forest_View_Pad;
+        box.vertex_max[2] = chunk.max_z + Forest_View_Pad;
+        return fov_checker.check_box(position, axis, half_angle, depth, box);
+    };
+    moved_keys.clear();
+    for (auto &chunk : chunks)
+        if (!in_view(chunk.first, chunk.second))
+            moved_keys.push_back(chunk.first);
+    for (size_t i = 0; i < moved_keys.size(); i++)
+    {
+        auto iter = chunks.find(moved_keys[i]);
+        parked_chunks.emplace(moved_keys[i], std::move(iter->second));
+        chunks.erase(iter);
+    }
+    parked_chunk_counter += moved_keys.size();
+    moved_keys.clear();
+    for (auto &chunk : parked_chunks)
+        if (in_view(chunk.first, chunk.second))
+            moved_keys.push_back(chunk.first);
+    for (size_t i = 0; i < moved_keys.size(); i++)
+        Active_Chunk(moved_keys[i]);
+}
+
+template <typename PointType>
+IVOX_BACKEND<PointType>::IVOX_BACKEND(const Map_Backend_Config &config)
+    : config(config), ivox(config.ivox_resolution, config.ivox_nearby_type, config.ivox_capacity, config.ivox_voxel_points)
+{
+    ivox.set_downsample_param(config.downsample_size);
+}
+
+template <typename PointType>
+bool IVOX_BACKEND<PointType>::initialized()
+{
+    return built;
+}
+
+template <typename PointType>
+int IVOX_BACKEND<PointType>::size()
+{
+    return ivox.size();
+}
+
+template <typename PointType>
+size_t IVOX_BACKEND<PointType>::memory()
+{
+    return ivox.memory();
+}
+
+template <typename PointType>
+void IVOX_BACKEND<PointType>::Build(PointVector &&points)
+{
+    ivox.InitializeIVox(config.ivox_resolution, config.ivox_nearby_type, config.ivox_capacity, config.ivox_voxel_points);
+    ivox.Add_Points(points, false);
+    PointVector().swap(points);
+    built = true;
+}
+
+template <typename PointType>
+void IVOX_BACKEND<PointType>::Nearest_Search(const PointType &point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist)
+{
+    ivox.Nearest_Search(point, k_nearest, Nearest_Points, Point_Distance, max_dist);
+}
+
+template <typename PointType>
+void IVOX_BACKEND<PointType>::Nearest_Search_Batch(const PointType *Points, int Point_Num, PointType *Nearest_Points, float *Point_Distance, int *Found_Num, float max_dist)
+{
+    ivox.Nearest_Search_Batch(Points, Point_Num, Nearest_Points, Point_Distance, Found_Num, max_dist);
+}
+
+template <typename PointType>
+int IVOX_BACKEND<PointType>::Add_Points(PointVector &PointToAdd, bool downsample_on)
+{
+    return ivox.Add_Points(PointToAdd, downsample_on);
+}
+
+template <typename PointType>
+void IVOX_BACKEND<PointType>::Set_Downsample_Size(float downsample_size)
+{
+    config.downsample_size = downsample_size;
+    ivox.set_downsample_param(downsample_size);
+}
+
+template <typename PointType>
+int IVOX_BACKEND<PointType>::Delete_Point_Boxes(vector<BoxPointType> &BoxPoints, PointVector *Removed_Points)
+{
+    return ivox.Delete_Point_Boxes(BoxPoints, Removed_Points);
+}
+
+template <typename PointType>
+void IVOX_BACKEND<PointType>::Get_Points(PointVector &Storage)
+{
+    ivox.Get_Points(Storage);
+}
+
+template <typename PointType>
+void IVOX_BACKEND<PointType>::Get_Statistics(Map_Statistics &stats)
+{
+    stats.fields = {{"point_num", to_string(ivox.size())},
+                    {"voxel_num", to_string(ivox.voxel_num())},
+                    {"evicted_voxel_num", to_string(ivox.evicted_voxel_num())},
+                    {"rejected_point_num", to_string(ivox.rejected_point_num())},
+                    {"map_bytes", to_string(ivox.memory())}};
+    stats.depth_histogram.clear();
+}
+
+template <typename PointType>
+typename MAP_BACKEND<PointType>::Ptr Create_Map_Backend(const string &type, const Map_Backend_Config &config)
+{
+    if (type == "ikdtree")
+        return std::make_shared<IKD_TREE_BACKEND<PointType>>(config);
+    if (type == "ikdforest")
+        return std::make_shared<IKD_FOREST_BACKEND<PointType>>(config);
+    if (type == "ivox")
+        return std::make_shared<IVOX_BACKEND<PointType>>(config);
+    return nullptr;
+}
+
+// Manual Instatiations
+template class IKD_TREE_BACKEND<pcl::PointXYZ>;
+template class IKD_TREE_BACKEND<pcl::PointXYZI>;
+template class IKD_TREE_BACKEND<pcl::PointXYZINormal>;
+template class IKD_FOREST_BACKEND<pcl::PointXYZ>;
+template class IKD_FOREST_BACKEND<pcl::PointXYZI>;
+template class IKD_FOREST_BACKEND<pcl::PointXYZINormal>;
+template class IVOX_BACKEND<pcl::PointXYZ>;
+template class IVOX_BACKEND<pcl::PointXYZI>;
+template class IVOX_BACKEND<pcl::PointXYZINormal>;
+template MAP_BACKEND<pcl::PointXYZ>::Ptr Create_Map_Backend<pcl::PointXYZ>(const string &, const Map_Backend_Config &);
+template MAP_BACKEND<pcl::PointXYZI>::Ptr Create_Map_Backend<pcl::PointXYZI>(const string &, const Map_Backend_Config &);
+template MAP_BACKEND<pcl::PointXYZINormal>::Ptr Create_Map_Backend<pcl::PointXYZINormal>(const string &, const Map_Backend_Config &);
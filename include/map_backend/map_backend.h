@@ -0,0 +1,265 @@
+#pragma once
+#include <memory>
+#include <unordered_map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ikd-Tree/ikd_Tree.h"
+#include "ivox/ivox.h"
+#include "FOV_Checker/FOV_Checker.h"
+
+#define Forest_Default_Chunk_Size 20.0f
+// Padding of a column tested against the view cone, at least the largest k-NN distance of map matching.
+#define Forest_View_Pad 2.5f
+
+// Settings of every backend, each one reads the fields it uses.
+struct Map_Backend_Config
+{
+    // Downsampled insertion keeps one point per cube of this size.
+    float downsample_size = 0.5f;
+    // ikd-Tree, see KD_TREE::Set_leaf_bucket_size, Set_build_thread_num and Set_rebuild_budget.
+    int leaf_bucket_size = 0;
+    int build_thread_num = 1;
+    float rebuild_budget_ms = 0.0f;
+    // > 0 to Relayout the tree every this many map updates.
+    int relayout_interval = 0;
+    // Minimum seconds between two read view copies for other threads, see KD_TREE::Set_snapshot_interval.
+    float snapshot_interval = 1.0f;
+    // Approximation of the ikd-Tree k-NN, see KD_TREE::Nearest_Search.
+    float knn_epsilon = 0.0f;
+    int knn_max_visit = 0;
+    // Voxel map, see IVOX::InitializeIVox.
+    float ivox_resolution = IVox_Default_Resolution;
+    int ivox_nearby_type = IVOX<pcl::PointXYZ>::NEARBY_EDGES;
+    int ivox_capacity = IVox_Default_Capacity;
+    int ivox_voxel_points = IVox_Default_Voxel_Points;
+    // Side in meters of the square columns the ikd-Tree forest splits the map into.
+    float forest_chunk_size = Forest_Default_Chunk_Size;
+};
+
+// The map scans are matched against and inserted into. The estimator and the mapping node only use this
+// interface, so map structures can be swapped and benchmarked without touching them. Single writer: all
+// calls come from the mapping thread.
+template <typename PointType>
+class MAP_BACKEND
+{
+public:
+    using PointVector = std::vector<PointType, Eigen::aligned_allocator<PointType>>;
+    using Ptr = std::shared_ptr<MAP_BACKEND<PointType>>;
+
+    // Filled by Get_Statistics. depth_histogram is left empty by backends without a tree depth.
+    struct Map_Statistics
+    {
+        vector<pair<string, string>> fields;
+        vector<int> depth_histogram;
+    };
+
+    virtual ~MAP_BACKEND() = default;
+    virtual const char *name() const = 0;
+    // False until Build or Load filled the map.
+    virtual bool initialized() = 0;
+    virtual int size() = 0;
+    // Bytes held by the map.
+    virtual size_t memory() = 0;
+    // Builds the map from the moved-in cloud, replacing any previous content.
+    virtual void Build(PointVector &&points) = 0;
+    // Replaces the map with a snapshot file. False if it cannot be read or the backend has no snapshots.
+    virtual bool Load(const string &path)
+    {
+        return false;
+    }
+    virtual void Nearest_Search(const PointType &point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist = INFINITY) = 0;
+    // Batched k-NN with k = Batch_Nearest_K, laid out as in KD_TREE::Nearest_Search_Batch.
+    virtual void Nearest_Search_Batch(const PointType *Points, int Point_Num, PointType *Nearest_Points, float *Point_Distance, int *Found_Num, float max_dist = INFINITY) = 0;
+    // downsample_on keeps one point per downsample cube, the one nearest to its center. Returns the
+    // number of points stored.
+    virtual int Add_Points(PointVector &PointToAdd, bool downsample_on) = 0;
+    // Changes the downsample cube of later insertions, the points already in the map stay as they are.
+    virtual void Set_Downsample_Size(float downsample_size) = 0;
+    // Removes the points with vertex_min <= p < vertex_max in any box, appending them to Removed_Points if it
+    // is given.
+    virtual int Delete_Point_Boxes(vector<BoxPointType> &BoxPoints, PointVector *Removed_Points = nullptr) = 0;
+    // Copies every map point out.
+    virtual void Get_Points(PointVector &Storage) = 0;
+    virtual void Get_Statistics(Map_Statistics &stats) = 0;
+    // Called once the points of a scan are in the map.
+    virtual void Map_Updated() {}
+    // Called in the gap after a scan is published, for maintenance that should not delay the odometry.
+    virtual void Scan_Done() {}
+    // The sensor view for the next scans: the cone of half_angle radians around the unit vector axis from
+    // position, depth meters long. Backends that cull the map to the view search only the part of it near
+    // the cone, the others ignore it.
+    virtual void Set_View(const Eigen::Vector3d &position, const Eigen::Vector3d &axis, double half_angle, double depth) {}
+};
+
+template <typename PointType>
+class IKD_TREE_BACKEND : public MAP_BACKEND<PointType>
+{
+public:
+    using typename MAP_BACKEND<PointType>::PointVector;
+    using typename MAP_BACKEND<PointType>::Map_Statistics;
+
+    explicit IKD_TREE_BACKEND(const Map_Backend_Config &config);
+    const char *name() const override
+    {
+        return "ikd_tree";
+    }
+    bool initialized() override;
+    int size() override;
+    size_t memory() override;
+    void Build(PointVector &&points) override;
+    bool Load(const string &path) override;
+    void Nearest_Search(const PointType &point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist = INFINITY) override;
+    void Nearest_Search_Batch(const PointType *Points, int Point_Num, PointType *Nearest_Points, float *Point_Distance, int *Found_Num, float max_dist = INFINITY) override;
+    int Add_Points(PointVector &PointToAdd, bool downsample_on) override;
+    void Set_Downsample_Size(float downsample_size) override;
+    int Delete_Point_Boxes(vector<BoxPointType> &BoxPoints, PointVector *Removed_Points = nullptr) override;
+    void Get_Points(PointVector &Storage) override;
+    void Get_Statistics(Map_Statistics &stats) override;
+    // Relayout every relayout_interval updates, retried while a rebuild runs.
+    void Map_Updated() override;
+    // Spends the rebuild budget on deferred rebuilds and publishes a requested snapshot, at most once per
+    // snapshot interval.
+    void Scan_Done() override;
+    // The tree itself, for the ikd-Tree specific calls such as Get_Snapshot.
+    KD_TREE<PointType> &tree()
+    {
+        return ikdtree;
+    }
+
+private:
+    Map_Backend_Config config;
+    KD_TREE<PointType> ikdtree;
+    typename KD_TREE<PointType>::Batch_Search_Context batch_context;
+    PointVector removed_points;
+    int update_num = 0;
+};
+
+template <typename PointType>
+class IVOX_BACKEND : public MAP_BACKEND<PointType>
+{
+public:
+    using typename MAP_BACKEND<PointType>::PointVector;
+    using typename MAP_BACKEND<PointType>::Map_Statistics;
+
+    explicit IVOX_BACKEND(const Map_Backend_Config &config);
+    const char *name() const override
+    {
+        return "ivox";
+    }
+    bool initialized() override;
+    int size() override;
+    size_t memory() override;
+    void Build(PointVector &&points) override;
+    void Nearest_Search(const PointType &point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist = INFINITY) override;
+    void Nearest_Search_Batch(const PointType *Points, int Point_Num, PointType *Nearest_Points, float *Point_Distance, int *Found_Num, float max_dist = INFINITY) override;
+    int Add_Points(PointVector &PointToAdd, bool downsample_on) override;
+    void Set_Downsample_Size(float downsample_size) override;
+    int Delete_Point_Boxes(vector<BoxPointType> &BoxPoints, PointVector *Removed_Points = nullptr) override;
+    void Get_Points(PointVector &Storage) override;
+    void Get_Statistics(Map_Statistics &stats) override;
+
+private:
+    Map_Backend_Config config;
+    IVOX<PointType> ivox;
+    bool built = false;
+};
+
+// ikd-Tree forest: one KD_TREE per vertical column of forest_chunk_size square meters. Points are routed to
+// the tree of their column, so a scan only touches the few trees around the sensor and those are built in
+// parallel, and a column leaving the local map is dropped as a whole instead of being box-deleted node by
+// node and rebuilt. A k-NN query searches the column of the query point first and then only the neighbouring
+// columns closer than the k-th neighbour found, so it stays exact. Each tree rebuilds in the calling thread,
+// small trees rebuild fast and a background thread per column would not pay for itself. Once Set_View is
+// called, the columns away from the view cone are parked as they are and left out of the k-NN search until
+// the cone or an insertion reaches them again.
+template <typename PointType>
+class IKD_FOREST_BACKEND : public MAP_BACKEND<PointType>
+{
+public:
+    using typename MAP_BACKEND<PointType>::PointVector;
+    using typename MAP_BACKEND<PointType>::Map_Statistics;
+
+    explicit IKD_FOREST_BACKEND(const Map_Backend_Config &config);
+    const char *name() const override
+    {
+        return "ikd_forest";
+    }
+    bool initialized() override;
+    int size() override;
+    size_t memory() override;
+    void Build(PointVector &&points) override;
+    void Nearest_Search(const PointType &point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist = INFINITY) override;
+    void Nearest_Search_Batch(const PointType *Points, int Point_Num, PointType *Nearest_Points, float *Point_Distance, int *Found_Num, float max_dist = INFINITY) override;
+    int Add_Points(PointVector &PointToAdd, bool downsample_on) override;
+    void Set_Downsample_Size(float downsample_size) override;
+    int Delete_Point_Boxes(vector<BoxPointType> &BoxPoints, PointVector *Removed_Points = nullptr) override;
+    void Get_Points(PointVector &Storage) override;
+    void Get_Statistics(Map_Statistics &stats) override;
+    // Frees the trees of the columns dropped by the last deletions, kept out of Delete_Point_Boxes as
+    // releasing a tree walks all of its nodes.
+    void Scan_Done() override;
+    // Parks the columns whose box, padded by Forest_View_Pad, misses the cone and brings back those it meets.
+    void Set_View(const Eigen::Vector3d &position, const Eigen::Vector3d &axis, double half_angle, double depth) override;
+
+private:
+    struct Chunk_Key
+    {
+        int x, y;
+        bool operator==(const Chunk_Key &other) const
+        {
+            return x == other.x && y == other.y;
+        }
+    };
+
+    struct Chunk_Key_Hash
+    {
+        size_t operator()(const Chunk_Key &key) const
+        {
+            return (size_t(uint32_t(key.x)) * IVox_Hash_P1) ^ (size_t(uint32_t(key.y)) * IVox_Hash_P2);
+        }
+    };
+
+    struct Chunk
+    {
+        std::unique_ptr<KD_TREE<PointType>> tree;
+        // Height range of the points inserted so far, a column is only dropped by a box covering all of it.
+        float min_z, max_z;
+        // Points routed to the column by the current Build or Add_Points.
+        PointVector pending;
+    };
+
+    using Chunk_Map = std::unordered_map<Chunk_Key, Chunk, Chunk_Key_Hash>;
+
+    Map_Backend_Config config;
+    float inv_chunk_size;
+    // Columns searched by k-NN, and those parked away from the view.
+    Chunk_Map chunks, parked_chunks;
+    FOV_Checker fov_checker;
+    std::vector<Chunk_Key> moved_keys;
+    std::vector<Chunk *> touched_chunks;
+    std::vector<std::unique_ptr<KD_TREE<PointType>>> dropped_trees;
+    typename KD_TREE<PointType>::Batch_Search_Context batch_context;
+    // Batch queries grouped by the column they fall in, and their results before being scattered back.
+    std::unordered_map<Chunk_Key, std::vector<int>, Chunk_Key_Hash> query_groups;
+    PointVector group_points, group_nearest, search_points;
+    std::vector<float> group_distance, search_distance;
+    std::vector<int> group_found;
+    bool built = false;
+    long dropped_chunk_counter = 0;
+    long parked_chunk_counter = 0, restored_chunk_counter = 0;
+
+    Chunk_Key Pos_To_Key(float x, float y) const;
+    // The searched column of key, restored or created if needed.
+    Chunk &Active_Chunk(const Chunk_Key &key);
+    int Delete_Chunk_Boxes(Chunk_Map &chunk_map, const vector<BoxPointType> &BoxPoints, PointVector *Removed_Points);
+    // Routes the points to their columns, creating missing ones, and inserts them, one column per thread.
+    int Insert_Points(const PointVector &points, bool downsample_on);
+    // Merges the up to k_nearest neighbours of point in the columns other than home that are closer than
+    // the current k-th neighbour into the sorted Nearest_Points and Point_Distance, found long.
+    void Search_Neighbour_Chunks(const PointType &point, const Chunk_Key &home, int k_nearest, PointType *Nearest_Points, float *Point_Distance, int &found, float max_dist);
+};
+
+// "ikdtree", "ikdforest" or "ivox", nullptr for any other name.
+template <typename PointType>
+typename MAP_BACKEND<PointType>::Ptr Create_Map_Backend(const string &type, const Map_Backend_Config &config);
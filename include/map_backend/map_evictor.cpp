@@ -0,0 +1,245 @@
+#include "map_evictor.h"
+#include <algorithm>
+
+/*
+Description: Per-cell insertion and match times of the map, and the eviction of the cells unused the longest.
+*/
+
+template <typename PointType>
+void MAP_EVICTOR<PointType>::InitializeMapEvictor(float resolution_, int point_budget_, double min_age_)
+{
+    resolution = resolution_;
+    inv_resolution = 1.0f / resolution_;
+    point_budget = point_budget_;
+    min_age = min_age_;
+    Clear();
+    stats = Map_Evictor_Statistics();
+    enable = point_budget > 0;
+}
+
+template <typename PointType>
+void MAP_EVICTOR<PointType>::Clear()
+{
+    cells.clear();
+    cell_index.clear();
+    candidates.clear();
+    next_candidate = 0;
+    next_pass_time = -INFINITY;
+}
+
+template <typename PointType>
+typename MAP_EVICTOR<PointType>::Cell_Key MAP_EVICTOR<PointType>::Pos_To_Key(float x, float y, float z) const
+{
+    return {int(floor(x * inv_resolution)), int(floor(y * inv_resolution)), int(floor(z * inv_resolution))};
+}
+
+template <typename PointType>
+void MAP_EVICTOR<PointType>::Points_Added(const PointVector &PointAdded)
+{
+    if (!enable)
+        return;
+    for (const PointType &point : PointAdded)
+    {
+        Cell_Key key = Pos_To_Key(point.x, point.y, point.z);
+        auto result = cell_index.insert({key, int(cells.size())});
+        if (result.second)
+            cells.push_back({key, Cell_Usage{now, -INFINITY}});
+        else
+            cells[result.first->second].usage.last_insert = now;
+    }
+}
+
+template <typename PointType>
+void MAP_EVICTOR<PointType>::Points_Matched(const PointVector &Nearest_Points)
+{
+    if (!enable)
+        return;
+    // The neighbours of a point mostly share a cell, only look each cell up once
+    Cell_Key last_key = {0, 0, 0};
+    for (size_t i = 0; i < Nearest_Points.size(); i++)
+    {
+        Cell_Key key = Pos_To_Key(Nearest_Points[i].x, Nearest_Points[i].y, Nearest_Points[i].z);
+        if (i > 0 && key == last_key)
+            continue;
+        last_key = key;
+        auto iter = cell_index.find(key);
+        if (iter != cell_index.end())
+            cells[iter->second].usage.last_match = now;
+    }
+}
+
+template <typename PointType>
+void MAP_EVICTOR<PointType>::Boxes_Deleted(const vector<BoxPointType> &BoxPoints)
+{
+    if (!enable || BoxPoints.empty())
+        return;
+    // Box deletions are rare and cover large regions, a scan of the cells is cheaper than walking the boxes.
+    for (size_t index = 0; index < cells.size();)
+    {
+        const Cell_Key &key = cells[index].key;
+        float min_x = key.x * resolution, min_y = key.y * resolution, min_z = key.z * resolution;
+        bool inside = false;
+        for (size_t i = 0; i < BoxPoints.size() && !inside; i++)
+            inside = BoxPoints[i].vertex_min[0] <= min_x && min_x + resolution <= BoxPoints[i].vertex_max[0] &&
+                     BoxPoints[i].vertex_min[1] <= min_y && min_y + resolution <= BoxPoints[i].vertex_max[1] &&
+                     BoxPoints[i].vertex_min[2] <= min_z && min_z + resolution <= BoxPoints[i].vertex_max[2];
+        if (inside)
+            Erase_Cell(index);
+        else
+            index++;
+    }
+}
+
+template <typename PointType>
+void MAP_EVICTOR<PointType>::Erase_Cell(int index)
+{
+    cell_index.erase(cells[index].key);
+    if (index + 1 < int(cells.size()))
+    {
+        cells[index] = cells.back();
+        cell_index[cells[index].key] = index;
+    }
+    cells.pop_back();
+}
+
+template <typename PointType>
+void MAP_EVICTOR<PointType>::Find_Candidates()
+{
+    candidates.clear();
+    next_candidate = 0;
+    first_fresh_use = INFINITY;
+    for (auto &cell : cells)
+    {
+        double last_use = max(cell.usage.last_insert, cell.usage.last_match);
+        if (now - last_use >= min_age)
+            candidates.push_back({last_use, cell.key});
+        else
+            first_fresh_use = min(first_fresh_use, last_use);
+    }
+    // Cells used by the same scan tie, taking them in key order keeps the ones of a pass next to each other
+    auto older = [](const std::pair<double, Cell_Key> &a, const std::pair<double, Cell_Key> &b)
+    {
+        if (a.first != b.first)
+            return a.first < b.first;
+        return a.second.z != b.second.z ? a.second.z < b.second.z : a.second.y != b.second.y ? a.second.y < b.second.y : a.second.x < b.second.x;
+    };
+    size_t keep_num = Map_Evictor_Max_Boxes * Map_Evictor_Candidate_Passes;
+    candidates_complete = candidates.size() <= keep_num;
+    if (!candidates_complete)
+    {
+        nth_element(candidates.begin(), candidates.begin() + keep_num, candidates.end(), older);
+        candidates.resize(keep_num);
+    }
+    sort(candidates.begin(), candidates.end(), older);
+}
+
+template <typename PointType>
+void MAP_EVICTOR<PointType>::Merge_Boxes(vector<BoxPointType> &BoxPoints, int axis) const
+{
+    // Joins boxes that touch along axis and match on the other two. The corners are whole cells, so equal
+    // faces compare exactly.
+    int a = (axis + 1) % 3, b = (axis + 2) % 3;
+    sort(BoxPoints.begin(), BoxPoints.end(), [&](const BoxPointType &p, const BoxPointType &q)
+         {
+             if (p.vertex_min[a] != q.vertex_min[a])
+                 return p.vertex_min[a] < q.vertex_min[a];
+             if (p.vertex_max[a] != q.vertex_max[a])
+                 return p.vertex_max[a] < q.vertex_max[a];
+             if (p.vertex_min[b] != q.vertex_min[b])
+                 return p.vertex_min[b] < q.vertex_min[b];
+             if (p.vertex_max[b] != q.vertex_max[b])
+                 return p.vertex_max[b] < q.vertex_max[b];
+             return p.vertex_min[axis] < q.vertex_min[axis];
+         });
+    size_t box_num = 0;
+    for (size_t i = 0; i < BoxPoints.size(); i++)
+    {
+        if (box_num > 0)
+        {
+            BoxPointType &last = BoxPoints[box_num - 1];
+            const BoxPointType &box = BoxPoints[i];
+            if (last.vertex_min[a] == box.vertex_min[a] && last.vertex_max[a] == box.vertex_max[a] && last.vertex_min[b] == box.vertex_min[b] &&
+                last.vertex_max[b] == box.vertex_max[b] && last.vertex_max[axis] == box.vertex_min[axis])
+            {
+                last.vertex_max[axis] = box.vertex_max[axis];
+                continue;
+            }
+        }
+        BoxPoints[box_num++] = BoxPoints[i];
+    }
+    BoxPoints.resize(box_num);
+}
+
+template <typename PointType>
+void MAP_EVICTOR<PointType>::Select_Stale(int map_size, vector<BoxPointType> &BoxPoints)
+{
+    BoxPoints.clear();
+    if (!enable || map_size <= point_budget || cells.empty() || now < next_pass_time)
+        return;
+    stats.pass_num++;
+    // Cells do not count their points, the excess is converted to cells at the average cell occupancy
+    double excess = map_size - point_budget * Map_Evictor_Low_Water;
+    size_t cell_target = min(int(ceil(excess * cells.size() / map_size)), Map_Evictor_Max_Boxes);
+    // Uses only move forward: the cells left out of the candidates were used later than the ones kept and
+    // stay so. A candidate used again since the scan is skipped, a later scan finds it if it goes stale.
+    selected.clear();
+    bool scanned = false;
+    while (selected.size() < cell_target)
+    {
+        if (next_candidate == candidates.size())
+        {
+            if (scanned)
+                break;
+            Find_Candidates();
+            scanned = true;
+            continue;
+        }
+        const std::pair<double, Cell_Key> &candidate = candidates[next_candidate++];
+        auto iter = cell_index.find(candidate.second);
+        if (iter == cell_index.end())
+            continue;
+        const Cell_Usage &usage = cells[iter->second].usage;
+        if (max(usage.last_insert, usage.last_match) != candidate.first)
+            continue;
+        Erase_Cell(iter->second);
+        selected.push_back(candidate.second);
+    }
+    // Once the old cells run out the next pass waits for the oldest fresh one
+    if (next_candidate == candidates.size() && candidates_complete)
+        next_pass_time = first_fresh_use + min_age;
+    if (selected.empty())
+    {
+        stats.starved_pass_num++;
+        return;
+    }
+    BoxPoints.resize(selected.size());
+    for (size_t i = 0; i < selected.size(); i++)
+    {
+        const Cell_Key &key = selected[i];
+        BoxPoints[i].vertex_min[0] = key.x * resolution;
+        BoxPoints[i].vertex_min[1] = key.y * resolution;
+        BoxPoints[i].vertex_min[2] = key.z * resolution;
+        BoxPoints[i].vertex_max[0] = (key.x + 1) * resolution;
+        BoxPoints[i].vertex_max[1] = (key.y + 1) * resolution;
+        BoxPoints[i].vertex_max[2] = (key.z + 1) * resolution;
+    }
+    // Fewer boxes make a cheaper deletion
+    for (int axis = 0; axis < 3; axis++)
+        Merge_Boxes(BoxPoints, axis);
+    stats.evicted_cell_num += selected.size();
+}
+
+template <typename PointType>
+void MAP_EVICTOR<PointType>::Get_Statistics(Map_Evictor_Statistics &stats_out) const
+{
+    stats_out = stats;
+    stats_out.cell_num = cells.size();
+    stats_out.memory = cell_index.bucket_count() * sizeof(void *) + cell_index.size() * (sizeof(typename decltype(cell_index)::value_type) + sizeof(void *)) +
+                       cells.capacity() * sizeof(Cell) +
+                       candidates.capacity() * sizeof(std::pair<double, Cell_Key>) + selected.capacity() * sizeof(Cell_Key);
+}
+
+// Manual Instatiations
+template class MAP_EVICTOR<pcl::PointXYZ>;
+template class MAP_EVICTOR<pcl::PointXYZI>;
+template class MAP_EVICTOR<pcl::PointXYZINormal>;
@@ -0,0 +1,135 @@
+#pragma once
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+#include "ivox/ivox.h"
+
+#define Map_Evictor_Default_Resolution 0.5f
+#define Map_Evictor_Default_Min_Age 60.0
+// Cells removed per eviction pass at most, so a pass stays short and a large excess is worked off over scans.
+#define Map_Evictor_Max_Boxes 256
+// A scan of the cells keeps the oldest ones for this many passes, so the passes in between skip the scan.
+#define Map_Evictor_Candidate_Passes 16
+// A pass brings the map down to this fraction of the budget, so eviction does not run on every scan.
+#define Map_Evictor_Low_Water 0.9
+
+// Usage of the map per cubic cell: the time points were last inserted into a cell and the time one of its
+// points was last a neighbour of a matched scan point. Once the map holds more points than its budget, the
+// cells unused for the longest time, and for at least the minimum age, are handed out for deletion, so the
+// map size stays flat on long runs in one area instead of filling up with points never matched again. The
+// cells only track usage, the points stay in the map backend. Single threaded, all calls must come from the
+// mapping thread.
+template <typename PointType>
+class MAP_EVICTOR
+{
+public:
+    using PointVector = std::vector<PointType, Eigen::aligned_allocator<PointType>>;
+
+    struct Map_Evictor_Statistics
+    {
+        int cell_num = 0;
+        long pass_num = 0;
+        long evicted_cell_num = 0;
+        long evicted_point_num = 0;
+        // Passes over the budget that found no cell old enough to evict.
+        long starved_pass_num = 0;
+        size_t memory = 0;
+    };
+
+private:
+    struct Cell_Key
+    {
+        int x, y, z;
+        bool operator==(const Cell_Key &other) const
+        {
+            return x == other.x && y == other.y && z == other.z;
+        }
+    };
+
+    struct Cell_Key_Hash
+    {
+        size_t operator()(const Cell_Key &key) const
+        {
+            return (size_t(uint32_t(key.x)) * IVox_Hash_P1) ^ (size_t(uint32_t(key.y)) * IVox_Hash_P2) ^ (size_t(uint32_t(key.z)) * IVox_Hash_P3);
+        }
+    };
+
+    struct Cell_Usage
+    {
+        double last_insert;
+        // -INFINITY until a point of the cell is matched.
+        double last_match;
+    };
+
+    bool enable = false;
+    float resolution = Map_Evictor_Default_Resolution;
+    float inv_resolution = 1.0f / Map_Evictor_Default_Resolution;
+    int point_budget = 0;
+    double min_age = Map_Evictor_Default_Min_Age;
+    double now = 0.0;
+    // No cell can be old enough to evict before this time.
+    double next_pass_time = -INFINITY;
+    struct Cell
+    {
+        Cell_Key key;
+        Cell_Usage usage;
+    };
+
+    // Cells in one array so the scan for stale ones reads memory in order, found by key through the index.
+    std::vector<Cell> cells;
+    std::unordered_map<Cell_Key, int, Cell_Key_Hash> cell_index;
+    // Oldest stale cells at the last scan by last use, the ones before next_candidate are taken. Complete
+    // if it holds every cell that was stale, then first_fresh_use is the oldest use of the others.
+    std::vector<std::pair<double, Cell_Key>> candidates;
+    size_t next_candidate = 0;
+    bool candidates_complete = false;
+    double first_fresh_use = INFINITY;
+    std::vector<Cell_Key> selected;
+    Map_Evictor_Statistics stats;
+
+    Cell_Key Pos_To_Key(float x, float y, float z) const;
+    // Moves the last cell into the slot.
+    void Erase_Cell(int index);
+    void Find_Candidates();
+    void Merge_Boxes(vector<BoxPointType> &BoxPoints, int axis) const;
+
+public:
+    MAP_EVICTOR() = default;
+    ~MAP_EVICTOR() = default;
+    // Enables tracking with cells of resolution meters and evicts beyond point_budget map points the cells
+    // unused for at least min_age seconds. Use the map downsample size as resolution: a coarser cell that
+    // also holds matched static structure keeps the stale points beside it alive.
+    void InitializeMapEvictor(float resolution, int point_budget, double min_age);
+    // Changes the budget of an initialized evictor, keeping the cell usage gathered so far.
+    void Set_Point_Budget(int point_budget_)
+    {
+        point_budget = point_budget_;
+        enable = point_budget > 0;
+        next_pass_time = -INFINITY;
+    }
+    bool enabled() const
+    {
+        return enable;
+    }
+    // Forgets every cell, for a map that was rebuilt or reloaded.
+    void Clear();
+    // Time of the scan being processed, stamped on the insertions and matches that follow.
+    void Set_Time(double stamp)
+    {
+        now = stamp;
+    }
+    void Points_Added(const PointVector &PointAdded);
+    // The map neighbours a scan point was matched against.
+    void Points_Matched(const PointVector &Nearest_Points);
+    // Forgets the cells inside any box, vertex_min <= p < vertex_max.
+    void Boxes_Deleted(const vector<BoxPointType> &BoxPoints);
+    // Fills BoxPoints with the cells to delete from a map of map_size points, empty while it is within its
+    // budget. Neighbouring cells are merged into larger boxes. The cells are forgotten, report the points
+    // the deletion removed with Points_Evicted.
+    void Select_Stale(int map_size, vector<BoxPointType> &BoxPoints);
+    void Points_Evicted(int point_num)
+    {
+        stats.evicted_point_num += point_num;
+    }
+    void Get_Statistics(Map_Evictor_Statistics &stats_out) const;
+};
@@ -0,0 +1,195 @@
+#include "plane_cache.h"
+#include <algorithm>
+
+/*
+Description: Per-cell cache of the planes the mapping node fits to the map neighbours of scan points.
+*/
+
+template <typename PointType>
+void PLANE_CACHE<PointType>::InitializePlaneCache(float resolution_, int size)
+{
+    resolution = resolution_;
+    inv_resolution = 1.0f / resolution_;
+    size_t slot_num = 1;
+    slot_shift = 64;
+    while (slot_num < size_t(max(size, 1)))
+    {
+        slot_num <<= 1;
+        slot_shift--;
+    }
+    entries.assign(slot_num, Plane_Entry());
+    versions.assign(slot_num, 1);
+    Clear();
+    stats = Plane_Cache_Statistics();
+    enable = true;
+}
+
+template <typename PointType>
+void PLANE_CACHE<PointType>::Clear()
+{
+    for (Plane_Entry &entry : entries)
+        entry.version = 0;
+}
+
+template <typename PointType>
+size_t PLANE_CACHE<PointType>::Slot(int x, int y, int z) const
+{
+    uint64_t hash = (uint64_t(uint32_t(x)) * IVox_Hash_P1) ^ (uint64_t(uint32_t(y)) * IVox_Hash_P2) ^ (uint64_t(uint32_t(z)) * IVox_Hash_P3);
+    return size_t((hash * 0x9E3779B97F4A7C15ull) >> slot_shift);
+}
+
+template <typename PointType>
+void PLANE_CACHE<PointType>::Bump_Version(size_t slot)
+{
+    // 0 marks empty entries, so a wrapped counter skips it
+    if (++versions[slot] == 0)
+        versions[slot] = 1;
+    stats.invalidate_num += entries[slot].version != 0;
+    entries[slot].version = 0;
+}
+
+template <typename PointType>
+const typename PLANE_CACHE<PointType>::Plane_Entry *PLANE_CACHE<PointType>::Find(const PointType &point, float max_dist)
+{
+    int x = int(floor(point.x * inv_resolution)), y = int(floor(point.y * inv_resolution)), z = int(floor(point.z * inv_resolution));
+    size_t slot = Slot(x, y, z);
+    const Plane_Entry &entry = entries[slot];
+    if (entry.version != 0 && entry.version == versions[slot] && entry.x == x && entry.y == y && entry.z == z &&
+        fabsf(entry.plane[0] * point.x + entry.plane[1] * point.y + entry.plane[2] * point.z + entry.plane[3]) <= max_dist)
+    {
+        stats.hit_num++;
+        scan_hit_num++;
+        return &entry;
+    }
+    stats.miss_num++;
+    scan_miss_num++;
+    return nullptr;
+}
+
+template <typename PointType>
+void PLANE_CACHE<PointType>::Store(const PointType &point, const float *plane, const PointVector &Nearest_Points)
+{
+    int x = int(floor(point.x * inv_resolution)), y = int(floor(point.y * inv_resolution)), z = int(floor(point.z * inv_resolution));
+    size_t slot = Slot(x, y, z);
+    Plane_Entry &entry = entries[slot];
+    entry.x = x;
+    entry.y = y;
+    entry.z = z;
+    entry.version = versions[slot];
+    for (int i = 0; i < 4; i++)
+        entry.plane[i] = plane[i];
+    entry.point_num = min(int(Nearest_Points.size()), Batch_Nearest_K);
+    entry.residual = 0.0f;
+    for (int i = 0; i < entry.point_num; i++)
+    {
+        const PointType &p = Nearest_Points[i];
+        entry.points[i][0] = p.x;
+        entry.points[i][1] = p.y;
+        entry.points[i][2] = p.z;
+        entry.residual = max(entry.residual, fabsf(plane[0] * p.x + plane[1] * p.y + plane[2] * p.z + plane[3]));
+    }
+    stats.store_num++;
+}
+
+template <typename PointType>
+void PLANE_CACHE<PointType>::Get_Points(const Plane_Entry &entry, PointVector &Storage) const
+{
+    Storage.resize(entry.point_num);
+    for (int i = 0; i < entry.point_num; i++)
+    {
+        Storage[i] = PointType();
+        Storage[i].x = entry.points[i][0];
+        Storage[i].y = entry.points[i][1];
+        Storage[i].z = entry.points[i][2];
+    }
+}
+
+template <typename PointType>
+void PLANE_CACHE<PointType>::Points_Added(const PointVector &PointAdded)
+{
+    if (!enable)
+        return;
+    for (const PointType &point : PointAdded)
+        Bump_Version(Slot(int(floor(point.x * inv_resolution)), int(floor(point.y * inv_resolution)), int(floor(point.z * inv_resolution))));
+}
+
+template <typename PointType>
+void PLANE_CACHE<PointType>::Boxes_Deleted(const vector<BoxPointType> &BoxPoints)
+{
+    if (!enable || BoxPoints.empty())
+        return;
+    // The fit points of a plane may lie outside its cell, so the table is scanned rather than the cells of the
+    // boxes. Evictions hand in hundreds of small boxes at once: they are sorted into slabs along x at least as
+    // wide as any box, so a fit point inside their bounding box is only tested against the boxes starting in
+    // its slab or the one before.
+    sorted_boxes.assign(BoxPoints.begin(), BoxPoints.end());
+    sort(sorted_boxes.begin(), sorted_boxes.end(), [](const BoxPointType &a, const BoxPointType &b)
+         { return a.vertex_min[0] < b.vertex_min[0]; });
+    BoxPointType bound = sorted_boxes[0];
+    float max_width = 0.0f;
+    for (const BoxPointType &box : sorted_boxes)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            bound.vertex_min[k] = min(bound.vertex_min[k], box.vertex_min[k]);
+            bound.vertex_max[k] = max(bound.vertex_max[k], box.vertex_max[k]);
+        }
+        max_width = max(max_width, box.vertex_max[0] - box.vertex_min[0]);
+    }
+    float slab_width = max(max_width, (bound.vertex_max[0] - bound.vertex_min[0]) / Plane_Cache_Max_Slabs);
+    int slab_num = int((bound.vertex_max[0] - bound.vertex_min[0]) / slab_width) + 1;
+    // slab_starts[s] is the first box starting in slab s or after it
+    slab_starts.assign(slab_num + 1, int(sorted_boxes.size()));
+    for (int i = int(sorted_boxes.size()) - 1; i >= 0; i--)
+        slab_starts[min(int((sorted_boxes[i].vertex_min[0] - bound.vertex_min[0]) / slab_width), slab_num - 1)] = i;
+    for (int s = slab_num - 1; s >= 0; s--)
+        slab_starts[s] = min(slab_starts[s], slab_starts[s + 1]);
+    for (size_t slot = 0; slot < entries.size(); slot++)
+    {
+        const Plane_Entry &entry = entries[slot];
+        if (entry.version == 0 || entry.version != versions[slot])
+            continue;
+        bool deleted = false;
+        for (int i = 0; !deleted && i < entry.point_num; i++)
+        {
+            const float *p = entry.points[i];
+            if (p[0] < bound.vertex_min[0] || p[0] >= bound.vertex_max[0] || p[1] < bound.vertex_min[1] || p[1] >= bound.vertex_max[1] || p[2] < bound.vertex_min[2] || p[2] >= bound.vertex_max[2])
+                continue;
+            int slab = min(int((p[0] - bound.vertex_min[0]) / slab_width), slab_num - 1);
+            for (int j = slab_starts[max(slab - 1, 0)]; !deleted && j < slab_starts[slab + 1]; j++)
+            {
+                const BoxPointType &box = sorted_boxes[j];
+                deleted = (p[0] >= box.vertex_min[0]) & (p[0] < box.vertex_max[0]) & (p[1] >= box.vertex_min[1]) & (p[1] < box.vertex_max[1]) &
+                          (p[2] >= box.vertex_min[2]) & (p[2] < box.vertex_max[2]);
+            }
+        }
+        if (deleted)
+            Bump_Version(slot);
+    }
+}
+
+template <typename PointType>
+void PLANE_CACHE<PointType>::End_Scan()
+{
+    total_miss_time += scan_miss_time;
+    stats.scan_hit_num = scan_hit_num;
+    stats.scan_miss_num = scan_miss_num;
+    stats.scan_miss_time = scan_miss_time;
+    // The misses of the whole run give a steadier cost estimate than those of one scan
+    stats.scan_saved_time = stats.miss_num > 0 ? scan_hit_num * total_miss_time / stats.miss_num : 0.0;
+    scan_hit_num = scan_miss_num = 0;
+    scan_miss_time = 0.0;
+}
+
+template <typename PointType>
+void PLANE_CACHE<PointType>::Get_Statistics(Plane_Cache_Statistics &stats_out) const
+{
+    stats_out = stats;
+    stats_out.memory = entries.capacity() * sizeof(Plane_Entry) + versions.capacity() * sizeof(uint32_t) + sorted_boxes.capacity() * sizeof(BoxPointType) +
+                       slab_starts.capacity() * sizeof(int);
+}
+
+// Manual Instatiations
+template class PLANE_CACHE<pcl::PointXYZ>;
+template class PLANE_CACHE<pcl::PointXYZI>;
+template class PLANE_CACHE<pcl::PointXYZINormal>;
@@ -0,0 +1,99 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "ivox/ivox.h"
+
+#define Plane_Cache_Default_Resolution 0.5f
+#define Plane_Cache_Default_Size 32768
+// Slabs along x the boxes of a deletion are sorted into at most.
+#define Plane_Cache_Max_Slabs 4096
+
+// Planes fitted to the map neighbours of a point, cached per cubic cell of the map. A point falling in a cell
+// with a valid plane close enough to it reuses the plane and skips both the k-NN search and the plane fit. Each table slot carries a
+// version counter that is bumped when a point is inserted into one of its cells or when one of the fit points
+// of its plane is deleted, which invalidates the plane. The table is direct mapped and never grows: a new
+// plane simply replaces the one in its slot. Single threaded, all calls must come from the mapping thread.
+template <typename PointType>
+class PLANE_CACHE
+{
+public:
+    using PointVector = std::vector<PointType, Eigen::aligned_allocator<PointType>>;
+
+    struct Plane_Entry
+    {
+        int x, y, z;
+        // Version of the slot when the plane was fitted, 0 for an empty entry.
+        uint32_t version;
+        // Unit normal and offset, normal . p + d = 0 on the plane.
+        float plane[4];
+        // Largest distance of a fit point to the plane.
+        float residual;
+        int point_num;
+        float points[Batch_Nearest_K][3];
+    };
+
+    struct Plane_Cache_Statistics
+    {
+        long hit_num = 0;
+        long miss_num = 0;
+        long store_num = 0;
+        long invalidate_num = 0;
+        // Counters of the last finished scan, see End_Scan.
+        int scan_hit_num = 0;
+        int scan_miss_num = 0;
+        // k-NN and plane fit time of the misses of the last scan, and the time its hits are estimated to have
+        // saved from the average cost of a miss.
+        double scan_miss_time = 0.0;
+        double scan_saved_time = 0.0;
+        size_t memory = 0;
+    };
+
+private:
+    bool enable = false;
+    float resolution = Plane_Cache_Default_Resolution;
+    float inv_resolution = 1.0f / Plane_Cache_Default_Resolution;
+    int slot_shift = 64;
+    std::vector<Plane_Entry> entries;
+    std::vector<uint32_t> versions;
+    std::vector<BoxPointType> sorted_boxes;
+    std::vector<int> slab_starts;
+    Plane_Cache_Statistics stats;
+    int scan_hit_num = 0, scan_miss_num = 0;
+    double scan_miss_time = 0.0, total_miss_time = 0.0;
+
+    size_t Slot(int x, int y, int z) const;
+    void Bump_Version(size_t slot);
+
+public:
+    PLANE_CACHE() = default;
+    ~PLANE_CACHE() = default;
+    // Enables the cache with cells of resolution and size slots, rounded up to a power of two. Use a
+    // resolution that is a multiple of the map downsample size, so a downsampled insertion only touches the
+    // cell of the inserted point.
+    void InitializePlaneCache(float resolution, int size);
+    bool enabled() const
+    {
+        return enable;
+    }
+    // Drops every plane, for a map that was rebuilt or reloaded.
+    void Clear();
+    // The valid plane of the cell of point, nullptr if there is none or point is farther than max_dist from
+    // it. Counts a hit or a miss. The entry is overwritten by the next Store into its slot.
+    const Plane_Entry *Find(const PointType &point, float max_dist = INFINITY);
+    // Caches the plane fitted to Nearest_Points for the cell of point.
+    void Store(const PointType &point, const float *plane, const PointVector &Nearest_Points);
+    // The fit points of an entry, in place of the neighbours of a point that hit it.
+    void Get_Points(const Plane_Entry &entry, PointVector &Storage) const;
+    // Invalidates the cells the points were inserted into.
+    void Points_Added(const PointVector &PointAdded);
+    // Invalidates the planes with a fit point in any box, vertex_min <= p < vertex_max.
+    void Boxes_Deleted(const vector<BoxPointType> &BoxPoints);
+    // Time spent on the k-NN search and plane fit of misses.
+    void Add_Miss_Time(double seconds)
+    {
+        scan_miss_time += seconds;
+    }
+    // Closes the per-scan counters reported by Get_Statistics.
+    void End_Scan();
+    void Get_Statistics(Plane_Cache_Statistics &stats_out) const;
+};
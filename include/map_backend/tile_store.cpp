@@ -0,0 +1,309 @@
+#include "tile_store.h"
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+Description: Disk-backed tiles holding the map points outside the local map of the mapping node.
+*/
+
+template <typename PointType>
+TILE_STORE<PointType>::~TILE_STORE()
+{
+    if (!worker.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        terminate = true;
+    }
+    job_cond.notify_one();
+    worker.join();
+}
+
+template <typename PointType>
+bool TILE_STORE<PointType>::InitializeTileStore(const std::string &directory_, float tile_size_)
+{
+    directory = directory_;
+    if (!directory.empty() && directory.back() != '/')
+        directory += '/';
+    tile_size = tile_size_;
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+        return false;
+    DIR *dir = opendir(directory.c_str());
+    if (dir == nullptr)
+        return false;
+    while (dirent *entry = readdir(dir))
+    {
+        string name = entry->d_name;
+        if (name.size() > 5 && name.compare(0, 5, "tile_") == 0 && name.compare(name.size() - 4, 4, ".bin") == 0)
+            unlink((directory + name).c_str());
+    }
+    closedir(dir);
+    if (!worker.joinable())
+        worker = std::thread(&TILE_STORE<PointType>::Run_Jobs, this);
+    enable = true;
+    return true;
+}
+
+template <typename PointType>
+typename TILE_STORE<PointType>::Tile_Key TILE_STORE<PointType>::Pos_To_Key(float x, float y, float z) const
+{
+    return {int(floor(x / tile_size)), int(floor(y / tile_size)), int(floor(z / tile_size))};
+}
+
+template <typename PointType>
+std::string TILE_STORE<PointType>::Tile_Path(const Tile_Key &key) const
+{
+    return directory + "tile_" + to_string(key.x) + "_" + to_string(key.y) + "_" + to_string(key.z) + ".bin";
+}
+
+template <typename PointType>
+void TILE_STORE<PointType>::Push_Job(Tile_Job &&job)
+{
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        jobs.push_back(std::move(job));
+    }
+    job_cond.notify_one();
+}
+
+template <typename PointType>
+void TILE_STORE<PointType>::Run_Jobs()
+{
+    PointVector loaded;
+    while (true)
+    {
+        Tile_Job job;
+        {
+            std::unique_lock<std::mutex> lock(job_mutex);
+            // Queued writes are finished before terminating, so no evicted point is lost on shutdown.
+            job_cond.wait(lock, [this]
+                          { return terminate || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        if (!job.load)
+        {
+            if (!Write_Tile(job.key, job.points, job.lost_point_num))
+            {
+                std::lock_guard<std::mutex> lock(job_mutex);
+                failed_writes.push_back(std::move(job));
+            }
+            continue;
+        }
+        loaded.clear();
+        Load_Tile(job.key, loaded);
+        std::lock_guard<std::mutex> lock(job_mutex);
+        ready_points.insert(ready_points.end(), loaded.begin(), loaded.end());
+    }
+}
+
+template <typename PointType>
+bool TILE_STORE<PointType>::Write_Tile(const Tile_Key &key, const PointVector &points, long &lost_point_num)
+{
+    lost_point_num = 0;
+    string path = Tile_Path(key);
+    FILE *file = fopen(path.c_str(), "ab");
+    if (file == nullptr)
+    {
+        printf("tile store: cannot open %s for writing\n", path.c_str());
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long old_size = ftell(file);
+    vector<float> records(points.size() * 4);
+    for (size_t i = 0; i < points.size(); i++)
+    {
+        records[i * 4] = points[i].x;
+        records[i * 4 + 1] = points[i].y;
+        records[i * 4 + 2] = points[i].z;
+        records[i * 4 + 3] = points[i].intensity;
+    }
+    bool written = fwrite(records.data(), sizeof(float), records.size(), file) == records.size();
+    written = fclose(file) == 0 && written;
+    if (!written)
+    {
+        // A partial record would shift every record after it, cut the file back to what it held
+        printf("tile store: failed to write %s\n", path.c_str());
+        if (old_size > 0 && truncate(path.c_str(), old_size) != 0)
+        {
+            // The partial record would corrupt every later read of the tile, its earlier points are lost
+            printf("tile store: cannot cut %s back (%s), dropping the tile\n", path.c_str(), strerror(errno));
+            lost_point_num = old_size / long(4 * sizeof(float));
+            old_size = 0;
+        }
+        if (old_size == 0 && unlink(path.c_str()) != 0 && errno != ENOENT)
+            printf("tile store: cannot remove %s (%s)\n", path.c_str(), strerror(errno));
+    }
+    return written;
+}
+
+template <typename PointType>
+void TILE_STORE<PointType>::Load_Tile(const Tile_Key &key, PointVector &loaded)
+{
+    string path = Tile_Path(key);
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr)
+        return;
+    float record[4];
+    while (fread(record, sizeof(float), 4, file) == 4)
+    {
+        PointType point;
+        point.x = record[0];
+        point.y = record[1];
+        point.z = record[2];
+        point.intensity = record[3];
+        loaded.push_back(point);
+    }
+    fclose(file);
+    unlink(path.c_str());
+}
+
+template <typename PointType>
+bool TILE_STORE<PointType>::Overlaps_Window(const Tile_Key &key) const
+{
+    if (!has_window)
+        return false;
+    float tile_min[3] = {key.x * tile_size, key.y * tile_size, key.z * tile_size};
+    for (int i = 0; i < 3; i++)
+        if (!(window.vertex_min[i] < tile_min[i] + tile_size && tile_min[i] < window.vertex_max[i]))
+            return false;
+    return true;
+}
+
+template <typename PointType>
+bool TILE_STORE<PointType>::In_Window(const PointType &point) const
+{
+    return window.vertex_min[0] <= point.x && point.x < window.vertex_max[0] && window.vertex_min[1] <= point.y && point.y < window.vertex_max[1] &&
+           window.vertex_min[2] <= point.z && point.z < window.vertex_max[2];
+}
+
+template <typename PointType>
+void TILE_STORE<PointType>::Write_Later(const Tile_Key &key, PointVector &&points)
+{
+    disk_tiles[key] += points.size();
+    written_point_counter += points.size();
+    Push_Job({false, key, std::move(points)});
+}
+
+template <typename PointType>
+void TILE_STORE<PointType>::Store(const PointVector &points)
+{
+    if (!enable || points.empty())
+        return;
+    std::unordered_map<Tile_Key, PointVector, Tile_Key_Hash> tiles;
+    for (const PointType &point : points)
+        tiles[Pos_To_Key(point.x, point.y, point.z)].push_back(point);
+    for (auto &tile : tiles)
+    {
+        // Written now, a tile overlapping the window would be read straight back
+        if (Overlaps_Window(tile.first))
+        {
+            PointVector &held = held_tiles[tile.first];
+            held.insert(held.end(), tile.second.begin(), tile.second.end());
+        }
+        else
+            Write_Later(tile.first, std::move(tile.second));
+    }
+}
+
+template <typename PointType>
+void TILE_STORE<PointType>::Move_Window(const BoxPointType &window_)
+{
+    if (!enable)
+        return;
+    window = window_;
+    has_window = true;
+    for (auto it = held_tiles.begin(); it != held_tiles.end();)
+    {
+        PointVector &held = it->second;
+        size_t kept = 0;
+        for (size_t i = 0; i < held.size(); i++)
+        {
+            if (In_Window(held[i]))
+                reached_points.push_back(held[i]);
+            else
+                held[kept++] = held[i];
+        }
+        held.resize(kept);
+        bool overlap = Overlaps_Window(it->first);
+        if (!overlap && !held.empty())
+            Write_Later(it->first, std::move(held));
+        if (overlap && !held.empty())
+            ++it;
+        else
+            it = held_tiles.erase(it);
+    }
+    // Tiles overlapping the window are never on disk, so these have just entered it
+    for (auto it = disk_tiles.begin(); it != disk_tiles.end();)
+    {
+        if (!Overlaps_Window(it->first))
+        {
+            ++it;
+            continue;
+        }
+        Push_Job({true, it->first, PointVector()});
+        it = disk_tiles.erase(it);
+    }
+}
+
+template <typename PointType>
+void TILE_STORE<PointType>::Collect(PointVector &Storage)
+{
+    Storage.clear();
+    if (!enable)
+        return;
+    Storage.swap(reached_points);
+    PointVector loaded;
+    std::vector<Tile_Job> failed;
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        loaded.swap(ready_points);
+        failed.swap(failed_writes);
+    }
+    for (Tile_Job &job : failed)
+    {
+        // Store counted the points as on disk, a load queued since then already dropped the tile
+        auto it = disk_tiles.find(job.key);
+        if (it != disk_tiles.end() && (it->second -= job.points.size() + job.lost_point_num) <= 0)
+            disk_tiles.erase(it);
+        written_point_counter -= job.points.size();
+        failed_write_counter++;
+        failed_point_counter += job.points.size();
+        lost_point_counter += job.lost_point_num;
+        Storage.insert(Storage.end(), job.points.begin(), job.points.end());
+    }
+    read_point_counter += loaded.size();
+    PointVector outside;
+    for (const PointType &point : loaded)
+        (In_Window(point) ? Storage : outside).push_back(point);
+    Store(outside);
+}
+
+template <typename PointType>
+void TILE_STORE<PointType>::Get_Statistics(Tile_Store_Statistics &stats)
+{
+    stats.tile_num = disk_tiles.size();
+    stats.disk_point_num = 0;
+    for (auto &tile : disk_tiles)
+        stats.disk_point_num += tile.second;
+    stats.written_point_num = written_point_counter;
+    stats.read_point_num = read_point_counter;
+    stats.failed_write_num = failed_write_counter;
+    stats.failed_point_num = failed_point_counter;
+    stats.lost_point_num = lost_point_counter;
+    stats.held_point_num = 0;
+    for (auto &tile : held_tiles)
+        stats.held_point_num += tile.second.size();
+    std::lock_guard<std::mutex> lock(job_mutex);
+    stats.pending_job_num = jobs.size();
+    stats.ready_point_num = ready_points.size();
+}
+
+// Manual Instatiations
+template class TILE_STORE<pcl::PointXYZI>;
+template class TILE_STORE<pcl::PointXYZINormal>;
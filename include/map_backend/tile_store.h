@@ -0,0 +1,137 @@
+#pragma once
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "ivox/ivox.h"
+
+#define Tile_Store_Default_Size 50.0f
+
+// Disk store for the map points that leave the local map. Points are kept in cubic tiles, one binary file of
+// (x, y, z, intensity) floats per tile, appended to as points are evicted. Evicted points are written and
+// tiles entering the local map are read back by a background thread, so the mapping thread never waits on
+// the disk. Only tiles clear of the local map are on disk: the points outside the local map of a tile that
+// overlaps it are held in memory until the local map reaches them or leaves the tile. So a tile is read once
+// when the local map moves onto it and written once when it moves off. A point is either in the map, held or
+// on disk: reading a tile removes its file. Points whose tile could not be written are handed back by
+// Collect to stay in the map. The directory is emptied of tiles on initialization, tiles of an earlier run
+// are in another world frame. Store, Move_Window and Collect must come from the same thread. PointType needs
+// an intensity field.
+template <typename PointType>
+class TILE_STORE
+{
+public:
+    using PointVector = std::vector<PointType, Eigen::aligned_allocator<PointType>>;
+
+    struct Tile_Store_Statistics
+    {
+        int tile_num = 0;
+        long disk_point_num = 0;
+        long written_point_num = 0;
+        long read_point_num = 0;
+        // Tile writes that failed, and the points they handed back to the map.
+        long failed_write_num = 0;
+        long failed_point_num = 0;
+        // Points dropped with a tile whose failed write could not be cut back off it.
+        long lost_point_num = 0;
+        // Points outside the local map held in memory because their tile overlaps it.
+        long held_point_num = 0;
+        // Jobs waiting for the background thread and points read but not collected yet.
+        int pending_job_num = 0;
+        int ready_point_num = 0;
+    };
+
+private:
+    struct Tile_Key
+    {
+        int x, y, z;
+        bool operator==(const Tile_Key &other) const
+        {
+            return x == other.x && y == other.y && z == other.z;
+        }
+    };
+
+    struct Tile_Key_Hash
+    {
+        size_t operator()(const Tile_Key &key) const
+        {
+            return (size_t(uint32_t(key.x)) * IVox_Hash_P1) ^ (size_t(uint32_t(key.y)) * IVox_Hash_P2) ^ (size_t(uint32_t(key.z)) * IVox_Hash_P3);
+        }
+    };
+
+    struct Tile_Job
+    {
+        bool load;
+        Tile_Key key;
+        // Points to append, empty for a load.
+        PointVector points;
+        // Points already in the tile that a failed write took with it.
+        long lost_point_num = 0;
+    };
+
+    bool enable = false;
+    std::string directory;
+    float tile_size = Tile_Store_Default_Size;
+    bool has_window = false;
+    BoxPointType window;
+    // Points of the tiles overlapping the window that are outside it, and those the window has since
+    // reached, waiting for Collect.
+    std::unordered_map<Tile_Key, PointVector, Tile_Key_Hash> held_tiles;
+    PointVector reached_points;
+    // Points per tile on disk, including queued writes and excluding queued loads. Only touched by the
+    // calling thread.
+    std::unordered_map<Tile_Key, long, Tile_Key_Hash> disk_tiles;
+    long written_point_counter = 0;
+    long read_point_counter = 0;
+    long failed_write_counter = 0;
+    long failed_point_counter = 0;
+    long lost_point_counter = 0;
+
+    std::thread worker;
+    std::mutex job_mutex;
+    std::condition_variable job_cond;
+    std::deque<Tile_Job> jobs;
+    bool terminate = false;
+    PointVector ready_points;
+    // Writes the worker could not complete, their points go back to the map.
+    std::vector<Tile_Job> failed_writes;
+
+    Tile_Key Pos_To_Key(float x, float y, float z) const;
+    bool Overlaps_Window(const Tile_Key &key) const;
+    bool In_Window(const PointType &point) const;
+    // Queues the points of one tile for writing.
+    void Write_Later(const Tile_Key &key, PointVector &&points);
+    std::string Tile_Path(const Tile_Key &key) const;
+    void Push_Job(Tile_Job &&job);
+    void Run_Jobs();
+    // False if the tile was not fully written, its file is then left as it was. If that fails too the file
+    // is removed and lost_point_num tells how many points it held.
+    bool Write_Tile(const Tile_Key &key, const PointVector &points, long &lost_point_num);
+    // Appends the points of the tile to loaded and removes its file.
+    void Load_Tile(const Tile_Key &key, PointVector &loaded);
+
+public:
+    TILE_STORE() = default;
+    ~TILE_STORE();
+    // Starts the background thread on directory, created if missing, with tiles of tile_size meters.
+    // False if the directory cannot be used, the store then stays disabled.
+    bool InitializeTileStore(const std::string &directory, float tile_size);
+    bool enabled() const
+    {
+        return enable;
+    }
+    // Queues the points for writing to their tiles, or holds them if their tile overlaps the window.
+    void Store(const PointVector &points);
+    // Moves the local map window: queues the tiles on disk overlapping it for reading, which are the tiles
+    // entering it, queues the held tiles it left for writing and hands the held points it reached to Collect.
+    void Move_Window(const BoxPointType &window);
+    // Moves the points read or reached so far that are inside the window into Storage for insertion into the
+    // map, the others are held or written again. The points of failed writes are moved into Storage wherever
+    // they are.
+    void Collect(PointVector &Storage);
+    void Get_Statistics(Tile_Store_Statistics &stats);
+};
@@ -1,14 +1,23 @@
 // #include <../include/IKFoM/IKFoM_toolkit/esekfom/esekfom.hpp>
 #include "Estimator.h"
+#include <omp.h>
 
-PointCloudXYZI::Ptr normvec(new PointCloudXYZI(100000, 1));
+PointCloudXYZI::Ptr normvec(new PointCloudXYZI());
 std::vector<int> time_seq;
 PointCloudXYZI::Ptr feats_down_body(new PointCloudXYZI());
 PointCloudXYZI::Ptr feats_down_world(new PointCloudXYZI());
 std::vector<V3D> pbody_list;
 std::vector<PointVector> Nearest_Points;
-KD_TREE<PointType> ikdtree;
+MAP_BACKEND<PointType>::Ptr map_backend;
+PLANE_CACHE<PointType> plane_cache;
+MAP_EVICTOR<PointType> map_evictor;
 std::vector<float> pointSearchSqDis(NUM_MATCH_POINTS);
+static_assert(Batch_Nearest_K == NUM_MATCH_POINTS, "map batch search must return NUM_MATCH_POINTS neighbours");
+PointVector nearest_batch_points;
+PointVector nearest_batch_queries;
+std::vector<const PLANE_CACHE<PointType>::Plane_Entry *> cached_planes;
+std::vector<float> nearest_batch_dist;
+std::vector<int> nearest_batch_num;
 bool point_selected_surf[100000] = {0};
 std::vector<M3D> crossmat_list;
 int effct_feat_num = 0;
@@ -178,6 +187,64 @@ vect3 SO3ToEuler(const SO3 &orient)
 	return euler_ang;
 }
 
+// Transforms the points of the current time slot to world frame and matches them against the map in one batch,
+// leaving the neighbours in the flat nearest_batch_* buffers. Points with a cached plane are left out of the
+// batch, the others keep their order in it.
+static void nearest_search_batch()
+{
+	int point_num = time_seq[k];
+	for (int j = 0; j < point_num; j++)
+	{
+		pointBodyToWorld(&feats_down_body->points[idx+j+1], &feats_down_world->points[idx+j+1]);
+	}
+	const PointType *queries = &feats_down_world->points[idx+1];
+	int query_num = point_num;
+	cached_planes.assign(point_num, nullptr);
+	if (plane_cache.enabled())
+	{
+		nearest_batch_queries.clear();
+		for (int j = 0; j < point_num; j++)
+		{
+			cached_planes[j] = plane_cache.Find(feats_down_world->points[idx+j+1], plane_thr);
+			if (cached_planes[j] == nullptr) nearest_batch_queries.push_back(feats_down_world->points[idx+j+1]);
+		}
+		queries = nearest_batch_queries.data();
+		query_num = nearest_batch_queries.size();
+	}
+	nearest_batch_points.resize(query_num * NUM_MATCH_POINTS);
+	nearest_batch_dist.resize(query_num * NUM_MATCH_POINTS);
+	nearest_batch_num.resize(query_num);
+	if (query_num == 0) return;
+	double t_search = omp_get_wtime();
+	map_backend->Nearest_Search_Batch(queries, query_num, nearest_batch_points.data(), nearest_batch_dist.data(), nearest_batch_num.data(), 2.236);
+	if (plane_cache.enabled()) plane_cache.Add_Miss_Time(omp_get_wtime() - t_search);
+}
+
+// The plane of point j of the time slot, from the plane cache or fitted to its neighbours at position
+// query_j of the batch, which is advanced past them. False if the point has no plane to match.
+static bool match_plane(int j, int &query_j, VF(4) &pabcd)
+{
+	auto &points_near = Nearest_Points[idx+j+1];
+	const PLANE_CACHE<PointType>::Plane_Entry *cached = cached_planes[j];
+	if (cached != nullptr)
+	{
+		plane_cache.Get_Points(*cached, points_near);
+		pabcd << cached->plane[0], cached->plane[1], cached->plane[2], cached->plane[3];
+		return true;
+	}
+	const PointType *found_points = &nearest_batch_points[query_j * NUM_MATCH_POINTS];
+	const float *found_dist = &nearest_batch_dist[query_j * NUM_MATCH_POINTS];
+	points_near.assign(found_points, found_points + nearest_batch_num[query_j]);
+	query_j++;
+	if ((points_near.size() < NUM_MATCH_POINTS) || found_dist[NUM_MATCH_POINTS - 1] > 5) return false;
+	if (!plane_cache.enabled()) return esti_plane(pabcd, points_near, plane_thr);
+	double t_fit = omp_get_wtime();
+	bool plane_valid = esti_plane(pabcd, points_near, plane_thr);
+	if (plane_valid) plane_cache.Store(feats_down_world->points[idx+j+1], pabcd.data(), points_near);
+	plane_cache.Add_Miss_Time(omp_get_wtime() - t_fit);
+	return plane_valid;
+}
+
 void h_model_input(state_input &s, esekfom::dyn_share_modified<double> &ekfom_data)
 {
 	bool match_in_map = false;
@@ -185,41 +252,27 @@ void h_model_input(state_input &s, esekfom::dyn_share_modified<double> &ekfom_da
 	pabcd.setZero();
 	normvec->resize(time_seq[k]);
 	int effect_num_k = 0;
+	nearest_search_batch();
+	int query_j = 0;
 	for (int j = 0; j < time_seq[k]; j++)
 	{
-		PointType &point_body_j  = feats_down_body->points[idx+j+1];
 		PointType &point_world_j = feats_down_world->points[idx+j+1];
-		pointBodyToWorld(&point_body_j, &point_world_j); 
 		V3D p_body = pbody_list[idx+j+1];
-		V3D p_world;
-		p_world << point_world_j.x, point_world_j.y, point_world_j.z;
 		
+		point_selected_surf[idx+j+1] = false;
+		if (match_plane(j, query_j, pabcd))
 		{
-			auto &points_near = Nearest_Points[idx+j+1];
-			
-			ikdtree.Nearest_Search(point_world_j, NUM_MATCH_POINTS, points_near, pointSearchSqDis, 2.236); //1.0); //, 3.0); // 2.236;
+			float pd2 = pabcd(0) * point_world_j.x + pabcd(1) * point_world_j.y + pabcd(2) * point_world_j.z + pabcd(3);
 			
-			if ((points_near.size() < NUM_MATCH_POINTS) || pointSearchSqDis[NUM_MATCH_POINTS - 1] > 5) // 5)
-			{
-				point_selected_surf[idx+j+1] = false;
-			}
-			else
+			if (p_body.norm() > match_s * pd2 * pd2)
 			{
-				point_selected_surf[idx+j+1] = false;
-				if (esti_plane(pabcd, points_near, plane_thr)) //(planeValid)
-				{
-					float pd2 = pabcd(0) * point_world_j.x + pabcd(1) * point_world_j.y + pabcd(2) * point_world_j.z + pabcd(3);
-					
-					if (p_body.norm() > match_s * pd2 * pd2)
-					{
-						point_selected_surf[idx+j+1] = true;
-						normvec->points[j].x = pabcd(0);
-						normvec->points[j].y = pabcd(1);
-						normvec->points[j].z = pabcd(2);
-						normvec->points[j].intensity = pabcd(3);
-						effect_num_k ++;
-					}
-				}  
+				point_selected_surf[idx+j+1] = true;
+				normvec->points[j].x = pabcd(0);
+				normvec->points[j].y = pabcd(1);
+				normvec->points[j].z = pabcd(2);
+				normvec->points[j].intensity = pabcd(3);
+				map_evictor.Points_Matched(Nearest_Points[idx+j+1]);
+				effect_num_k ++;
 			}
 		}
 	}
@@ -272,41 +325,27 @@ void h_model_output(state_output &s, esekfom::dyn_share_modified<double> &ekfom_
 	
 	normvec->resize(time_seq[k]);
 	int effect_num_k = 0;
+	nearest_search_batch();
+	int query_j = 0;
 	for (int j = 0; j < time_seq[k]; j++)
 	{
-		PointType &point_body_j  = feats_down_body->points[idx+j+1];
 		PointType &point_world_j = feats_down_world->points[idx+j+1];
-		pointBodyToWorld(&point_body_j, &point_world_j); 
 		V3D p_body = pbody_list[idx+j+1];
-		V3D p_world;
-		p_world << point_world_j.x, point_world_j.y, point_world_j.z;
+		
+		point_selected_surf[idx+j+1] = false;
+		if (match_plane(j, query_j, pabcd))
 		{
-			auto &points_near = Nearest_Points[idx+j+1];
-			
-			ikdtree.Nearest_Search(point_world_j, NUM_MATCH_POINTS, points_near, pointSearchSqDis, 2.236); 
+			float pd2 = pabcd(0) * point_world_j.x + pabcd(1) * point_world_j.y + pabcd(2) * point_world_j.z + pabcd(3);
 			
-			if ((points_near.size() < NUM_MATCH_POINTS) || pointSearchSqDis[NUM_MATCH_POINTS - 1] > 5)
-			{
-				point_selected_surf[idx+j+1] = false;
-			}
-			else
+			if (p_body.norm() > match_s * pd2 * pd2)
 			{
-				point_selected_surf[idx+j+1] = false;
-				if (esti_plane(pabcd, points_near, plane_thr)) //(planeValid)
-				{
-					float pd2 = pabcd(0) * point_world_j.x + pabcd(1) * point_world_j.y + pabcd(2) * point_world_j.z + pabcd(3);
-					
-					if (p_body.norm() > match_s * pd2 * pd2)
-					{
-						// point_selected_surf[i] = true;
-						point_selected_surf[idx+j+1] = true;
-						normvec->points[j].x = pabcd(0);
-						normvec->points[j].y = pabcd(1);
-						normvec->points[j].z = pabcd(2);
-						normvec->points[j].intensity = pabcd(3);
-						effect_num_k ++;
-					}
-				}  
+				point_selected_surf[idx+j+1] = true;
+				normvec->points[j].x = pabcd(0);
+				normvec->points[j].y = pabcd(1);
+				normvec->points[j].z = pabcd(2);
+				normvec->points[j].intensity = pabcd(3);
+				map_evictor.Points_Matched(Nearest_Points[idx+j+1]);
+				effect_num_k ++;
 			}
 		}
 	}
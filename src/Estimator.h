@@ -8,16 +8,20 @@
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
 #include <pcl/filters/voxel_grid.h>
-#include <ikd-Tree/ikd_Tree.h>
+#include <map_backend/map_backend.h>
+#include <map_backend/plane_cache.h>
+#include <map_backend/map_evictor.h>
 #include <pcl/io/pcd_io.h>
 
-extern PointCloudXYZI::Ptr normvec; //(new PointCloudXYZI(100000, 1));
+extern PointCloudXYZI::Ptr normvec; // resized to each scan
 extern std::vector<int> time_seq;
 extern PointCloudXYZI::Ptr feats_down_body; //(new PointCloudXYZI());
 extern PointCloudXYZI::Ptr feats_down_world; //(new PointCloudXYZI());
 extern std::vector<V3D> pbody_list;
 extern std::vector<PointVector> Nearest_Points;
-extern KD_TREE<PointType> ikdtree;
+extern MAP_BACKEND<PointType>::Ptr map_backend;
+extern PLANE_CACHE<PointType> plane_cache;
+extern MAP_EVICTOR<PointType> map_evictor;
 extern std::vector<float> pointSearchSqDis;
 extern bool point_selected_surf[100000]; // = {0};
 extern std::vector<M3D> crossmat_list;
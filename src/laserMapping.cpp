@@ -1,6 +1,7 @@
 #include <omp.h>
 #include <mutex>
 #include <cmath>
+#include <climits>
 #include <thread>
 #include <fstream>
 #include <csignal>
@@ -13,6 +14,7 @@
 #include <nav_msgs/msg/odometry.hpp>
 #include <nav_msgs/msg/path.hpp>
 #include <visualization_msgs/msg/marker.hpp>
+#include <diagnostic_msgs/msg/diagnostic_array.hpp>
 #include <pcl_conversions/pcl_conversions.h>
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
@@ -25,10 +27,19 @@
 
 #include "parameters.h"
 #include "Estimator.h"
+#include <map_backend/tile_store.h>
 
 
-#define MAXN                (720000)
 #define PUBFRAME_PERIOD     (20)
+// Scans between two checks of the memory budget, and seconds between two degradation steps so that the
+// last one shows its effect before the next is taken.
+#define MEMORY_CHECK_PERIOD (10)
+#define MEMORY_STEP_PERIOD  (10.0)
+// Map voxel growth of the first degradation step, and the share of the map points kept by the second.
+#define MEMORY_VOXEL_SCALE  (2.0)
+#define MEMORY_EVICT_RATIO  (0.75)
+// Path poses kept when the save buffers are dropped.
+#define MEMORY_PATH_KEEP    (1000)
 
 const float MOV_THRESHOLD = 1.5f;
 
@@ -46,13 +57,15 @@ shared_ptr<ImuProcess> p_imu(new ImuProcess());
 bool init_map = false, flg_first_scan = true;
 PointCloudXYZI::Ptr ptr_con(new PointCloudXYZI());
 
-// Time Log Variables
-double T1[MAXN], s_plot[MAXN], s_plot2[MAXN], s_plot3[MAXN], s_plot11[MAXN];
+// Time Log Variables, only filled with runtime_pos_log
+vector<double> T1, s_plot, s_plot2, s_plot3, s_plot11;
 double match_time = 0, solve_time = 0, propag_time = 0, update_time = 0;
 
 bool lidar_pushed = false, flg_reset = false, flg_exit = false;
 
-vector<BoxPointType> cub_needrm;
+vector<BoxPointType> cub_needrm, cub_evict;
+TILE_STORE<PointType> tile_store;
+PointVector tile_points;
 
 deque<PointCloudXYZI::Ptr> lidar_buffer;
 deque<double> time_buffer;
@@ -134,20 +147,11 @@ void pointBodyLidarToIMU(PointType const *const pi, PointType *const po) {
     po->intensity = pi->intensity;
 }
 
-int points_cache_size = 0;
-
-void points_cache_collect() // seems for debug
-{
-    PointVector points_history;
-    ikdtree.acquire_removed_points(points_history);
-    points_cache_size = points_history.size();
-}
-
 BoxPointType LocalMap_Points;
 bool Localmap_Initialized = false;
 
 void lasermap_fov_segment() {
-    cub_needrm.shrink_to_fit();
+    cub_needrm.clear();
 
     V3D pos_LiD;
     if (use_imu_as_input) {
@@ -193,8 +197,44 @@ void lasermap_fov_segment() {
     }
     LocalMap_Points = New_LocalMap_Points;
 
-    points_cache_collect();
-    if (cub_needrm.size() > 0) int kdtree_delete_counter = ikdtree.Delete_Point_Boxes(cub_needrm);
+    tile_points.clear();
+    if (cub_needrm.size() > 0) int kdtree_delete_counter = map_backend->Delete_Point_Boxes(cub_needrm, tile_store.enabled() ? &tile_points : nullptr);
+    plane_cache.Boxes_Deleted(cub_needrm);
+    map_evictor.Boxes_Deleted(cub_needrm);
+    /*** the tiles the local map moved onto are read back, the points leaving it go to disk ***/
+    tile_store.Move_Window(LocalMap_Points);
+    tile_store.Store(tile_points);
+}
+
+void cull_map_to_view() {
+    V3D pos_LiD, axis_LiD;
+    /*** the lidar looks along its x axis ***/
+    if (use_imu_as_input) {
+        pos_LiD = kf_input.x_.pos + kf_input.x_.rot.normalized() * Lidar_T_wrt_IMU;
+        axis_LiD = kf_input.x_.rot.normalized() * Lidar_R_wrt_IMU * V3D(1, 0, 0);
+    } else {
+        pos_LiD = kf_output.x_.pos + kf_output.x_.rot.normalized() * Lidar_T_wrt_IMU;
+        axis_LiD = kf_output.x_.rot.normalized() * Lidar_R_wrt_IMU * V3D(1, 0, 0);
+    }
+    double half_fov = min(fov_deg + fov_cull_margin, 359.9) * 0.5 * PI_M / 180.0;
+    map_backend->Set_View(pos_LiD, axis_LiD.normalized(), half_fov, DET_RANGE);
+}
+
+void collect_map_tiles() {
+    tile_store.Collect(tile_points);
+    if (tile_points.empty()) return;
+    /*** new scans may already have filled the area again, keep one point per map voxel ***/
+    map_backend->Add_Points(tile_points, true);
+    plane_cache.Points_Added(tile_points);
+    map_evictor.Points_Added(tile_points);
+}
+
+void evict_stale_points() {
+    if (!map_evictor.enabled()) return;
+    map_evictor.Select_Stale(map_backend->size(), cub_evict);
+    if (cub_evict.empty()) return;
+    map_evictor.Points_Evicted(map_backend->Delete_Point_Boxes(cub_evict));
+    plane_cache.Boxes_Deleted(cub_evict);
 }
 
 void standard_pcl_cbk(const sensor_msgs::msg::PointCloud2::SharedPtr msg) {
@@ -261,7 +301,7 @@ void standard_pcl_cbk(const sensor_msgs::msg::PointCloud2::SharedPtr msg) {
         lidar_buffer.emplace_back(ptr);
         time_buffer.emplace_back(get_time_sec(msg->header.stamp));
     }
-    s_plot11[scan_count] = omp_get_wtime() - preprocess_start_time;
+    if (runtime_pos_log) s_plot11.push_back(omp_get_wtime() - preprocess_start_time);
     mtx_buffer.unlock();
     sig_buffer.notify_all();
 }
@@ -330,7 +370,7 @@ void livox_pcl_cbk(const livox_ros_driver2::msg::CustomMsg::SharedPtr msg) {
         lidar_buffer.emplace_back(ptr);
         time_buffer.emplace_back(get_time_sec(msg->header.stamp));
     }
-    s_plot11[scan_count] = omp_get_wtime() - preprocess_start_time;
+    if (runtime_pos_log) s_plot11.push_back(omp_get_wtime() - preprocess_start_time);
     mtx_buffer.unlock();
     sig_buffer.notify_all();
 }
@@ -489,22 +529,24 @@ void map_incremental() {
             PointNoNeedDownsample.emplace_back(feats_down_world->points[i]);
         }
     }
-    int add_point_size = ikdtree.Add_Points(PointToAdd, true);
-    ikdtree.Add_Points(PointNoNeedDownsample, false);
+    int add_point_size = map_backend->Add_Points(PointToAdd, true);
+    map_backend->Add_Points(PointNoNeedDownsample, false);
+    plane_cache.Points_Added(PointToAdd);
+    plane_cache.Points_Added(PointNoNeedDownsample);
+    map_evictor.Points_Added(PointToAdd);
+    map_evictor.Points_Added(PointNoNeedDownsample);
 }
 
 void publish_init_kdtree(const rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr &pubLaserCloudFullRes) {
     
     if (odom_only) {return;}
 
-    int size_init_ikdtree = ikdtree.size();
-    PointCloudXYZI::Ptr laserCloudInit(new PointCloudXYZI(size_init_ikdtree, 1));
+    PointCloudXYZI::Ptr laserCloudInit(new PointCloudXYZI());
 
     sensor_msgs::msg::PointCloud2 laserCloudmsg;
-    PointVector().swap(ikdtree.PCL_Storage);
-    ikdtree.flatten(ikdtree.Root_Node, ikdtree.PCL_Storage, NOT_RECORD);
-
-    laserCloudInit->points = ikdtree.PCL_Storage;
+    map_backend->Get_Points(laserCloudInit->points);
+    laserCloudInit->width = laserCloudInit->points.size();
+    laserCloudInit->height = 1;
     pcl::toROSMsg(*laserCloudInit, laserCloudmsg);
 
     laserCloudmsg.header.stamp = get_ros_time(lidar_end_time);
@@ -514,9 +556,17 @@ void publish_init_kdtree(const rclcpp::Publisher<sensor_msgs::msg::PointCloud2>:
     }
 }
 
-PointCloudXYZI::Ptr pcl_wait_pub(new PointCloudXYZI(500000, 1));
 PointCloudXYZI::Ptr pcl_wait_save(new PointCloudXYZI());
 
+void save_pcd_part() {
+    pcd_index++;
+    string all_points_dir(string(string(ROOT_DIR) + "PCD/scans_") + to_string(pcd_index) + string(".pcd"));
+    pcl::PCDWriter pcd_writer;
+    cout << "current scan saved to /PCD/" << all_points_dir << endl;
+    pcd_writer.writeBinary(all_points_dir, *pcl_wait_save);
+    pcl_wait_save->clear();
+}
+
 void publish_frame_world(const rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr &pubLaserCloudFullRes) {
 
     if (odom_only) {return;}
@@ -564,12 +614,7 @@ void publish_frame_world(const rclcpp::Publisher<sensor_msgs::msg::PointCloud2>:
         static int scan_wait_num = 0;
         scan_wait_num++;
         if (pcl_wait_save->size() > 0 && pcd_save_interval > 0 && scan_wait_num >= pcd_save_interval) {
-            pcd_index++;
-            string all_points_dir(string(string(ROOT_DIR) + "PCD/scans_") + to_string(pcd_index) + string(".pcd"));
-            pcl::PCDWriter pcd_writer;
-            cout << "current scan saved to /PCD/" << all_points_dir << endl;
-            pcd_writer.writeBinary(all_points_dir, *pcl_wait_save);
-            pcl_wait_save->clear();
+            save_pcd_part();
             scan_wait_num = 0;
         }
     }
@@ -595,6 +640,202 @@ void publish_frame_body(const rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::
     publish_count -= PUBFRAME_PERIOD;
 }
 
+/*** memory accounting: bytes held by the map and by the buffers that grow with the run ***/
+vector<pair<string, size_t>> memory_usage;
+size_t memory_total = 0;
+// Degradation steps taken to stay within memory_budget_mb: 1 coarser map voxel, 2 eviction, 3 dropping the save buffers
+int memory_step = 0;
+double memory_step_time = -INFINITY;
+
+void collect_memory_usage() {
+    memory_usage.clear();
+    memory_usage.emplace_back("map", map_backend->memory());
+    /*** listed even when off, the rows of map_stats.csv keep their columns ***/
+    PLANE_CACHE<PointType>::Plane_Cache_Statistics cache_stats;
+    plane_cache.Get_Statistics(cache_stats);
+    memory_usage.emplace_back("plane_cache", cache_stats.memory);
+    MAP_EVICTOR<PointType>::Map_Evictor_Statistics evictor_stats;
+    map_evictor.Get_Statistics(evictor_stats);
+    memory_usage.emplace_back("eviction", evictor_stats.memory);
+    TILE_STORE<PointType>::Tile_Store_Statistics tile_stats;
+    tile_store.Get_Statistics(tile_stats);
+    memory_usage.emplace_back("tile_held", tile_stats.held_point_num * sizeof(PointType));
+    memory_usage.emplace_back("pcd_wait_save", pcl_wait_save->points.capacity() * sizeof(PointType));
+    memory_usage.emplace_back("path", path.poses.capacity() * sizeof(geometry_msgs::msg::PoseStamped));
+    memory_usage.emplace_back("time_log", (T1.capacity() + s_plot.capacity() + s_plot2.capacity() + s_plot3.capacity() +
+                                           s_plot11.capacity()) * sizeof(double));
+    size_t sensor_bytes = 0;
+    mtx_buffer.lock();
+    for (auto &cloud : lidar_buffer) sensor_bytes += cloud->points.capacity() * sizeof(PointType);
+    sensor_bytes += imu_deque.size() * sizeof(sensor_msgs::msg::Imu);
+    mtx_buffer.unlock();
+    memory_usage.emplace_back("sensor_buffer", sensor_bytes);
+    memory_usage.emplace_back("point_selected_surf", sizeof(point_selected_surf));
+    memory_usage.emplace_back("normvec", normvec->points.capacity() * sizeof(PointType));
+    size_t nearest_bytes = Nearest_Points.capacity() * sizeof(PointVector);
+    for (auto &points : Nearest_Points) nearest_bytes += points.capacity() * sizeof(PointType);
+    memory_usage.emplace_back("nearest_points", nearest_bytes);
+    memory_total = 0;
+    for (auto &usage : memory_usage) memory_total += usage.second;
+}
+
+string memory_usage_string() {
+    string usage_string;
+    for (auto &usage : memory_usage) {
+        char entry[64];
+        snprintf(entry, sizeof(entry), "%s%s %.1f MB", usage_string.empty() ? "" : ", ", usage.first.c_str(), usage.second / 1048576.0);
+        usage_string += entry;
+    }
+    return usage_string;
+}
+
+/*** the cells laid over the map must stay multiples of the map voxel ***/
+bool is_voxel_multiple(double size, double voxel) {
+    double ratio = size / voxel;
+    return ratio > 0.999 && fabs(ratio - round(ratio)) < 1e-3;
+}
+
+/*** why the map voxel cannot be coarsened to voxel, nullptr if it can ***/
+const char *coarser_voxel_blocker(double voxel) {
+    if (string(map_backend->name()) == "ivox") return "the ivox map keeps its voxels and only grows";
+    if (plane_cache.enabled() && !is_voxel_multiple(plane_cache_resolution, voxel))
+        return "mapping.plane_cache_resolution is not a multiple of it";
+    if (map_evictor.enabled() && !is_voxel_multiple(eviction_resolution, voxel))
+        return "mapping.eviction_resolution is not a multiple of it";
+    return nullptr;
+}
+
+/*** over memory_budget_mb, degrade one step at a time: coarser map voxel, then eviction, then the save buffers ***/
+void enforce_memory_budget() {
+    static int scan_num = 0;
+    if (memory_budget_mb <= 0 || ++scan_num % MEMORY_CHECK_PERIOD != 0) return;
+    collect_memory_usage();
+    double budget_bytes = memory_budget_mb * 1048576.0;
+    if (memory_total <= budget_bytes || lidar_end_time - memory_step_time < MEMORY_STEP_PERIOD) return;
+    memory_step_time = lidar_end_time;
+    RCLCPP_WARN(logger, "memory %.1f MB over the %.1f MB budget: %s", memory_total / 1048576.0, memory_budget_mb,
+                memory_usage_string().c_str());
+    if (memory_step == 0) {
+        /*** new points are sparser, the map grows slower ***/
+        memory_step = 1;
+        const char *blocker = coarser_voxel_blocker(filter_size_map_min * MEMORY_VOXEL_SCALE);
+        if (blocker == nullptr) {
+            filter_size_map_min *= MEMORY_VOXEL_SCALE;
+            map_backend->Set_Downsample_Size(filter_size_map_min);
+            RCLCPP_WARN(logger, "memory step 1: map voxel coarsened to %.2f m", filter_size_map_min);
+            return;
+        }
+        RCLCPP_WARN(logger, "memory step 1 skipped, a %.2f m map voxel: %s", filter_size_map_min * MEMORY_VOXEL_SCALE, blocker);
+    }
+    if (memory_step == 1) {
+        /*** the map sheds the cells unused the longest ***/
+        memory_step = 2;
+        int point_budget = max(int(map_backend->size() * MEMORY_EVICT_RATIO), 1);
+        if (map_point_budget > 0) point_budget = min(point_budget, map_point_budget);
+        map_evictor.Set_Point_Budget(point_budget);
+        RCLCPP_WARN(logger, "memory step 2: evicting the map down to %d points", point_budget);
+    } else {
+        /*** taken again whenever the budget is still exceeded: the pending scans go to disk, the logs are cut ***/
+        memory_step = 3;
+        if (pcl_wait_save->size() > 0) save_pcd_part();
+        pcl_wait_save->points.shrink_to_fit();
+        if (path.poses.size() > MEMORY_PATH_KEEP) path.poses.erase(path.poses.begin(), path.poses.end() - MEMORY_PATH_KEEP);
+        path.poses.shrink_to_fit();
+        /*** s_plot11 is filled by the lidar callbacks ***/
+        mtx_buffer.lock();
+        for (vector<double> *time_log : {&T1, &s_plot, &s_plot2, &s_plot3, &s_plot11}) {
+            time_log->clear();
+            time_log->shrink_to_fit();
+        }
+        mtx_buffer.unlock();
+        RCLCPP_WARN(logger, "memory step 3: save buffers dropped, path cut to the last %d poses", MEMORY_PATH_KEEP);
+    }
+}
+
+void publish_map_stats(const rclcpp::Publisher<diagnostic_msgs::msg::DiagnosticArray>::SharedPtr &pubMapStats,
+                       ofstream &fout_stats) {
+    MAP_BACKEND<PointType>::Map_Statistics stats;
+    map_backend->Get_Statistics(stats);
+    /*** the plane cache counters ride along with the map statistics ***/
+    if (plane_cache.enabled()) {
+        PLANE_CACHE<PointType>::Plane_Cache_Statistics cache_stats;
+        plane_cache.Get_Statistics(cache_stats);
+        int scan_lookup_num = cache_stats.scan_hit_num + cache_stats.scan_miss_num;
+        stats.fields.insert(stats.fields.end(), {
+                {"plane_cache_hit_num", to_string(cache_stats.hit_num)},
+                {"plane_cache_miss_num", to_string(cache_stats.miss_num)},
+                {"plane_cache_invalidate_num", to_string(cache_stats.invalidate_num)},
+                {"plane_cache_scan_hit_rate", to_string(scan_lookup_num > 0 ? double(cache_stats.scan_hit_num) / scan_lookup_num : 0.0)},
+                {"plane_cache_scan_miss_ms", to_string(cache_stats.scan_miss_time * 1e3)},
+                {"plane_cache_scan_saved_ms", to_string(cache_stats.scan_saved_time * 1e3)},
+                {"plane_cache_bytes", to_string(cache_stats.memory)}});
+    }
+    if (tile_store.enabled()) {
+        TILE_STORE<PointType>::Tile_Store_Statistics tile_stats;
+        tile_store.Get_Statistics(tile_stats);
+        stats.fields.insert(stats.fields.end(), {
+                {"tile_num", to_string(tile_stats.tile_num)},
+                {"tile_disk_point_num", to_string(tile_stats.disk_point_num)},
+                {"tile_written_point_num", to_string(tile_stats.written_point_num)},
+                {"tile_read_point_num", to_string(tile_stats.read_point_num)},
+                {"tile_failed_write_num", to_string(tile_stats.failed_write_num)},
+                {"tile_failed_point_num", to_string(tile_stats.failed_point_num)},
+                {"tile_lost_point_num", to_string(tile_stats.lost_point_num)},
+                {"tile_held_point_num", to_string(tile_stats.held_point_num)},
+                {"tile_pending_job_num", to_string(tile_stats.pending_job_num)}});
+    }
+    if (map_evictor.enabled()) {
+        MAP_EVICTOR<PointType>::Map_Evictor_Statistics evictor_stats;
+        map_evictor.Get_Statistics(evictor_stats);
+        stats.fields.insert(stats.fields.end(), {
+                {"eviction_cell_num", to_string(evictor_stats.cell_num)},
+                {"eviction_pass_num", to_string(evictor_stats.pass_num)},
+                {"eviction_starved_pass_num", to_string(evictor_stats.starved_pass_num)},
+                {"evicted_cell_num", to_string(evictor_stats.evicted_cell_num)},
+                {"evicted_point_num", to_string(evictor_stats.evicted_point_num)},
+                {"eviction_bytes", to_string(evictor_stats.memory)}});
+    }
+    collect_memory_usage();
+    for (auto &usage : memory_usage) stats.fields.emplace_back("memory_" + usage.first + "_bytes", to_string(usage.second));
+    stats.fields.emplace_back("memory_total_bytes", to_string(memory_total));
+    stats.fields.emplace_back("memory_step", to_string(memory_step));
+    vector<pair<string, string>> fields = stats.fields;
+    if (!stats.depth_histogram.empty()) {
+        int depth_bins = stats.depth_histogram.size();
+        while (depth_bins > 1 && stats.depth_histogram[depth_bins - 1] == 0) depth_bins--;
+        string depth_histogram;
+        for (int i = 0; i < depth_bins; i++) depth_histogram += (i > 0 ? " " : "") + to_string(stats.depth_histogram[i]);
+        fields.emplace_back("depth_histogram", depth_histogram);
+    }
+
+    diagnostic_msgs::msg::DiagnosticArray msg;
+    msg.header.stamp = get_ros_time(lidar_end_time);
+    diagnostic_msgs::msg::DiagnosticStatus status;
+    status.level = diagnostic_msgs::msg::DiagnosticStatus::OK;
+    status.name = map_backend->name();
+    for (auto &field : fields) {
+        diagnostic_msgs::msg::KeyValue key_value;
+        key_value.key = field.first;
+        key_value.value = field.second;
+        status.values.push_back(key_value);
+    }
+    msg.status.push_back(status);
+    pubMapStats->publish(msg);
+
+    /*** one row per scan, a depth histogram goes into one column per bin instead of one string ***/
+    if (!fout_stats) return;
+    if (fout_stats.tellp() == 0) {
+        fout_stats << "time";
+        for (auto &field : stats.fields) fout_stats << "," << field.first;
+        for (size_t i = 0; i < stats.depth_histogram.size(); i++) fout_stats << ",depth_" << i;
+        fout_stats << endl;
+    }
+    fout_stats << fixed << setprecision(6) << lidar_end_time;
+    for (auto &field : stats.fields) fout_stats << "," << field.second;
+    for (int depth_num : stats.depth_histogram) fout_stats << "," << depth_num;
+    fout_stats << endl;
+}
+
 template<typename T>
 void set_posestamp(T &out) {
     if (!use_imu_as_input) {
@@ -811,10 +1052,64 @@ int main(int argc, char **argv) {
                 ("/aft_mapped_to_init", 100000);
     }
 
+    rclcpp::Publisher<diagnostic_msgs::msg::DiagnosticArray>::SharedPtr pubMapStats;
+    ofstream fout_stats;
+    if (map_stats_en) {
+        pubMapStats = nh->create_publisher<diagnostic_msgs::msg::DiagnosticArray>("/map_stats", 100);
+        fout_stats.open(DEBUG_FILE_DIR("map_stats.csv"), ios::out);
+    }
+
     //auto plane_pub = nh->create_publisher<visualization_msgs::msg::Marker>
     //        ("/planner_normal", 1000);
     auto tf_broadcaster = std::make_shared<tf2_ros::TransformBroadcaster>(nh);
 //------------------------------------------------------------------------------------------------------
+    /*** the map structure scans are matched against ***/
+    Map_Backend_Config map_config;
+    map_config.downsample_size = filter_size_map_min;
+    map_config.leaf_bucket_size = leaf_bucket_size;
+    map_config.build_thread_num = MP_PROC_NUM;
+    map_config.rebuild_budget_ms = rebuild_budget_ms;
+    map_config.relayout_interval = relayout_interval;
+    map_config.knn_epsilon = knn_epsilon;
+    map_config.knn_max_visit = knn_max_visit;
+    map_config.ivox_resolution = ivox_grid_resolution;
+    map_config.ivox_nearby_type = ivox_nearby_type;
+    map_config.ivox_capacity = ivox_capacity;
+    map_config.ivox_voxel_points = ivox_voxel_points;
+    map_config.forest_chunk_size = forest_chunk_size;
+    map_backend = Create_Map_Backend<PointType>(map_backend_type, map_config);
+    if (map_backend == nullptr) {
+        RCLCPP_WARN(logger, "unknown mapping.map_backend %s, using ikdtree", map_backend_type.c_str());
+        map_backend = Create_Map_Backend<PointType>("ikdtree", map_config);
+    }
+    if (plane_cache_en) plane_cache.InitializePlaneCache(plane_cache_resolution, plane_cache_size);
+    if (eviction_resolution <= 0) eviction_resolution = filter_size_map_min;
+    /*** under a memory budget the cells are tracked from the start, eviction may be turned on mid-run ***/
+    if (map_point_budget > 0 || memory_budget_mb > 0)
+        map_evictor.InitializeMapEvictor(eviction_resolution, map_point_budget > 0 ? map_point_budget : INT_MAX, eviction_min_age);
+    if (fov_cull_en && map_backend_type != "ikdforest")
+        RCLCPP_WARN(logger, "mapping.fov_cull_en needs mapping.map_backend ikdforest, the map is not culled");
+    if (tile_store_en) {
+        string tile_dir = tile_store_dir.empty() ? root_dir + "Log/map_tiles" : tile_store_dir;
+        if (!tile_store.InitializeTileStore(tile_dir, tile_size))
+            RCLCPP_WARN(logger, "cannot use %s for map tiles, points leaving the local map are dropped", tile_dir.c_str());
+    }
+    /*** start from a map snapshot saved by a previous run, skipping the initial map build ***/
+    if (!map_snapshot.empty()) {
+        if (map_backend->Load(map_snapshot)) {
+            init_map = true;
+            plane_cache.Clear();
+            map_evictor.Clear();
+            if (map_evictor.enabled()) {
+                PointVector loaded_points;
+                map_backend->Get_Points(loaded_points);
+                map_evictor.Points_Added(loaded_points);
+            }
+            cout << "map snapshot loaded: " << map_backend->size() << " points" << endl;
+        } else {
+            RCLCPP_WARN(logger, "cannot load map snapshot %s into the %s map", map_snapshot.c_str(), map_backend->name());
+        }
+    }
     signal(SIGINT, SigHandle);
     rclcpp::Rate rate(5000);
     while (rclcpp::ok()) {
@@ -825,6 +1120,7 @@ int main(int argc, char **argv) {
         executor.spin_some(); // 处理当前可用的回调
 
         if (sync_packages(Measures)) {
+            map_evictor.Set_Time(Measures.lidar_beg_time);
             if (flg_first_scan) {
                 first_lidar_time = Measures.lidar_beg_time;
                 flg_first_scan = false;
@@ -890,6 +1186,8 @@ int main(int argc, char **argv) {
             }
             /*** Segment the map in lidar FOV ***/
             lasermap_fov_segment();
+            if (tile_store.enabled() && init_map) collect_map_tiles();
+            if (fov_cull_en) cull_map_to_view();
             /*** downsample the feature points in a scan ***/
             t1 = omp_get_wtime();
             if (space_down_sample) {
@@ -905,12 +1203,6 @@ int main(int argc, char **argv) {
 
             /*** initialize the map kdtree ***/
             if (!init_map) {
-                if (ikdtree.Root_Node == nullptr) //
-                    // if(feats_down_size > 5)
-                {
-                    ikdtree.set_downsample_param(filter_size_map_min);
-                }
-
                 feats_down_world->resize(feats_down_size);
                 for (int i = 0; i < feats_down_size; i++) {
                     pointBodyToWorld(&(feats_down_body->points[i]), &(feats_down_world->points[i]));
@@ -919,7 +1211,11 @@ int main(int argc, char **argv) {
                     init_feats_world->points.emplace_back(feats_down_world->points[i]);
                 }
                 if (init_feats_world->size() < init_map_size) continue;
-                ikdtree.Build(init_feats_world->points);
+                map_evictor.Clear();
+                map_evictor.Points_Added(init_feats_world->points);
+                map_backend->Build(std::move(init_feats_world->points));
+                plane_cache.Clear();
+                init_feats_world->clear();
                 init_map = true;
                 publish_init_kdtree(pubLaserCloudMap); //(pubLaserCloudFullRes);
                 continue;
@@ -1257,6 +1553,8 @@ int main(int argc, char **argv) {
 
             if (feats_down_size > 4) {
                 map_incremental();
+                /*** map upkeep right after the update, e.g. the periodic ikd-Tree relayout ***/
+                map_backend->Map_Updated();
             }
 
             t5 = omp_get_wtime();
@@ -1265,6 +1563,13 @@ int main(int argc, char **argv) {
             if (scan_pub_en || pcd_save_en) publish_frame_world(pubLaserCloudFullRes);
             if (scan_pub_en && scan_body_pub_en) publish_frame_body(pubLaserCloudFullRes_body);
 
+            /*** the scan is out, let the map spend its maintenance budget before the next one ***/
+            map_backend->Scan_Done();
+            evict_stale_points();
+            enforce_memory_budget();
+            plane_cache.End_Scan();
+            if (map_stats_en) publish_map_stats(pubMapStats, fout_stats);
+
             /*** Debug variables Logging ***/
             if (runtime_pos_log) {
                 frame_num++;
@@ -1273,14 +1578,14 @@ int main(int argc, char **argv) {
                 aver_time_match = aver_time_match * (frame_num - 1) / frame_num + (match_time) / frame_num;
                 aver_time_solve = aver_time_solve * (frame_num - 1) / frame_num + solve_time / frame_num;
                 aver_time_propag = aver_time_propag * (frame_num - 1) / frame_num + propag_time / frame_num;
-                T1[time_log_counter] = Measures.lidar_beg_time;
-                s_plot[time_log_counter] = t5 - t0;
-                s_plot2[time_log_counter] = feats_undistort->points.size();
-                s_plot3[time_log_counter] = aver_time_consu;
+                T1.push_back(Measures.lidar_beg_time);
+                s_plot.push_back(t5 - t0);
+                s_plot2.push_back(feats_undistort->points.size());
+                s_plot3.push_back(aver_time_consu);
                 time_log_counter++;
-                printf("[ mapping ]: time: IMU + Map + Input Downsample: %0.6f ave match: %0.6f ave solve: %0.6f  ave ICP: %0.6f  map incre: %0.6f ave total: %0.6f icp: %0.6f propogate: %0.6f \n",
+                printf("[ mapping ]: time: IMU + Map + Input Downsample: %0.6f ave match: %0.6f ave solve: %0.6f  ave ICP: %0.6f  map incre: %0.6f ave total: %0.6f icp: %0.6f propogate: %0.6f map points: %d \n",
                        t1 - t0, aver_time_match, aver_time_solve, t3 - t1, t5 - t3, aver_time_consu, aver_time_icp,
-                       aver_time_propag);
+                       aver_time_propag, map_backend->size());
                 if (!publish_odometry_without_downsample) {
                     if (!use_imu_as_input) {
                         state_out = kf_output.x_;
@@ -1317,6 +1622,7 @@ int main(int argc, char **argv) {
     }
     fout_out.close();
     fout_imu_pbp.close();
+    fout_stats.close();
 
     return 0;
 }
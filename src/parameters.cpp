@@ -9,12 +9,14 @@ double last_timestamp_lidar = -1.0, last_timestamp_imu = -1.0;
 int pcd_index = 0;
 
 std::string lid_topic, imu_topic;
-bool prop_at_freq_of_imu, check_satu, con_frame, cut_frame;
+std::string map_snapshot, map_backend_type, tile_store_dir;
+bool prop_at_freq_of_imu, check_satu, con_frame, cut_frame, plane_cache_en, tile_store_en, fov_cull_en;
 bool use_imu_as_input, space_down_sample, publish_odometry_without_downsample;
-int init_map_size, con_frame_num;
+int init_map_size, con_frame_num, leaf_bucket_size, knn_max_visit, relayout_interval;
+int ivox_nearby_type, ivox_capacity, ivox_voxel_points, plane_cache_size, map_point_budget;
 double match_s, satu_acc, satu_gyro, cut_frame_time_interval;
-float plane_thr;
-double filter_size_surf_min, filter_size_map_min, fov_deg;
+float plane_thr, knn_epsilon, rebuild_budget_ms, ivox_grid_resolution, plane_cache_resolution, tile_size, forest_chunk_size, eviction_resolution;
+double filter_size_surf_min, filter_size_map_min, fov_deg, fov_cull_margin, eviction_min_age, memory_budget_mb;
 double cube_len;
 float DET_RANGE;
 bool imu_en, gravity_align, non_station_start;
@@ -28,7 +30,7 @@ std::vector<double> gravity_init, gravity;
 std::vector<double> extrinT;
 std::vector<double> extrinR;
 bool runtime_pos_log, pcd_save_en, path_en, extrinsic_est_en = true;
-bool scan_pub_en, scan_body_pub_en;
+bool scan_pub_en, scan_body_pub_en, map_stats_en;
 shared_ptr<Preprocess> p_pre;
 double time_lag_imu_to_lidar = 0.0;
 
@@ -61,6 +63,30 @@ void readParameters(shared_ptr<rclcpp::Node> &nh) {
     nh->declare_parameter<double>("cube_side_length", 200);
     nh->declare_parameter<float>("mapping.det_range", 300.f);
     nh->declare_parameter<double>("mapping.fov_degree", 180);
+    nh->declare_parameter<int>("mapping.leaf_bucket_size", 0);
+    nh->declare_parameter<std::string>("mapping.map_snapshot", "");
+    nh->declare_parameter<float>("mapping.knn_epsilon", 0.f);
+    nh->declare_parameter<int>("mapping.knn_max_visit", 0);
+    nh->declare_parameter<int>("mapping.relayout_interval", 0);
+    nh->declare_parameter<float>("mapping.rebuild_budget_ms", 0.f);
+    nh->declare_parameter<std::string>("mapping.map_backend", "ikdtree");
+    nh->declare_parameter<float>("mapping.forest_chunk_size", 20.f);
+    nh->declare_parameter<float>("mapping.ivox_grid_resolution", 0.5f);
+    nh->declare_parameter<int>("mapping.ivox_nearby_type", 18);
+    nh->declare_parameter<int>("mapping.ivox_capacity", 1000000);
+    nh->declare_parameter<int>("mapping.ivox_voxel_points", 20);
+    nh->declare_parameter<bool>("mapping.plane_cache_en", false);
+    nh->declare_parameter<float>("mapping.plane_cache_resolution", 0.5f);
+    nh->declare_parameter<int>("mapping.plane_cache_size", 32768);
+    nh->declare_parameter<bool>("mapping.tile_store_en", false);
+    nh->declare_parameter<std::string>("mapping.tile_store_dir", "");
+    nh->declare_parameter<float>("mapping.tile_size", 50.f);
+    nh->declare_parameter<bool>("mapping.fov_cull_en", false);
+    nh->declare_parameter<double>("mapping.fov_cull_margin", 10.0);
+    nh->declare_parameter<int>("mapping.map_point_budget", 0);
+    nh->declare_parameter<float>("mapping.eviction_resolution", 0.f);
+    nh->declare_parameter<double>("mapping.eviction_min_age", 60.0);
+    nh->declare_parameter<double>("mapping.memory_budget_mb", 0.0);
     nh->declare_parameter<bool>("mapping.imu_en", true);
     nh->declare_parameter<bool>("mapping.start_in_aggressive_motion", false);
     nh->declare_parameter<bool>("mapping.extrinsic_est_en", true);
@@ -90,6 +116,7 @@ void readParameters(shared_ptr<rclcpp::Node> &nh) {
     nh->declare_parameter<bool>("publish.path_en", true);
     nh->declare_parameter<bool>("publish.scan_publish_en", true);
     nh->declare_parameter<bool>("publish.scan_bodyframe_pub_en", true);
+    nh->declare_parameter<bool>("publish.map_stats_en", false);
     nh->declare_parameter<bool>("runtime_pos_log_enable", false);
     nh->declare_parameter<bool>("pcd_save.pcd_save_en", false);
     nh->declare_parameter<int>("pcd_save.interval", -1);
@@ -121,6 +148,30 @@ void readParameters(shared_ptr<rclcpp::Node> &nh) {
     nh->get_parameter("cube_side_length", cube_len);
     nh->get_parameter("mapping.det_range", DET_RANGE);
     nh->get_parameter("mapping.fov_degree", fov_deg);
+    nh->get_parameter("mapping.leaf_bucket_size", leaf_bucket_size);
+    nh->get_parameter("mapping.map_snapshot", map_snapshot);
+    nh->get_parameter("mapping.knn_epsilon", knn_epsilon);
+    nh->get_parameter("mapping.knn_max_visit", knn_max_visit);
+    nh->get_parameter("mapping.relayout_interval", relayout_interval);
+    nh->get_parameter("mapping.rebuild_budget_ms", rebuild_budget_ms);
+    nh->get_parameter("mapping.map_backend", map_backend_type);
+    nh->get_parameter("mapping.forest_chunk_size", forest_chunk_size);
+    nh->get_parameter("mapping.ivox_grid_resolution", ivox_grid_resolution);
+    nh->get_parameter("mapping.ivox_nearby_type", ivox_nearby_type);
+    nh->get_parameter("mapping.ivox_capacity", ivox_capacity);
+    nh->get_parameter("mapping.ivox_voxel_points", ivox_voxel_points);
+    nh->get_parameter("mapping.plane_cache_en", plane_cache_en);
+    nh->get_parameter("mapping.plane_cache_resolution", plane_cache_resolution);
+    nh->get_parameter("mapping.plane_cache_size", plane_cache_size);
+    nh->get_parameter("mapping.tile_store_en", tile_store_en);
+    nh->get_parameter("mapping.tile_store_dir", tile_store_dir);
+    nh->get_parameter("mapping.tile_size", tile_size);
+    nh->get_parameter("mapping.fov_cull_en", fov_cull_en);
+    nh->get_parameter("mapping.fov_cull_margin", fov_cull_margin);
+    nh->get_parameter("mapping.map_point_budget", map_point_budget);
+    nh->get_parameter("mapping.eviction_resolution", eviction_resolution);
+    nh->get_parameter("mapping.eviction_min_age", eviction_min_age);
+    nh->get_parameter("mapping.memory_budget_mb", memory_budget_mb);
     nh->get_parameter("mapping.imu_en", imu_en);
     nh->get_parameter("mapping.start_in_aggressive_motion", non_station_start);
     nh->get_parameter("mapping.extrinsic_est_en", extrinsic_est_en);
@@ -150,6 +201,7 @@ void readParameters(shared_ptr<rclcpp::Node> &nh) {
     nh->get_parameter("publish.path_en", path_en);
     nh->get_parameter("publish.scan_publish_en", scan_pub_en);
     nh->get_parameter("publish.scan_bodyframe_pub_en", scan_body_pub_en);
+    nh->get_parameter("publish.map_stats_en", map_stats_en);
     nh->get_parameter("runtime_pos_log_enable", runtime_pos_log);
     nh->get_parameter("pcd_save.pcd_save_en", pcd_save_en);
     nh->get_parameter("pcd_save.interval", pcd_save_interval);
@@ -19,13 +19,15 @@ extern double last_timestamp_lidar, last_timestamp_imu;
 extern int pcd_index;
 
 extern std::string lid_topic, imu_topic;
-extern bool prop_at_freq_of_imu, check_satu, con_frame, cut_frame;
+extern std::string map_snapshot, map_backend_type, tile_store_dir;
+extern bool prop_at_freq_of_imu, check_satu, con_frame, cut_frame, plane_cache_en, tile_store_en, fov_cull_en;
 extern bool use_imu_as_input, space_down_sample;
 extern bool extrinsic_est_en, publish_odometry_without_downsample;
-extern int init_map_size, con_frame_num;
+extern int init_map_size, con_frame_num, leaf_bucket_size, knn_max_visit, relayout_interval;
+extern int ivox_nearby_type, ivox_capacity, ivox_voxel_points, plane_cache_size, map_point_budget;
 extern double match_s, satu_acc, satu_gyro, cut_frame_time_interval;
-extern float plane_thr;
-extern double filter_size_surf_min, filter_size_map_min, fov_deg;
+extern float plane_thr, knn_epsilon, rebuild_budget_ms, ivox_grid_resolution, plane_cache_resolution, tile_size, forest_chunk_size, eviction_resolution;
+extern double filter_size_surf_min, filter_size_map_min, fov_deg, fov_cull_margin, eviction_min_age, memory_budget_mb;
 extern double cube_len;
 extern float DET_RANGE;
 extern bool imu_en, gravity_align, non_station_start;
@@ -39,7 +41,7 @@ extern std::vector<double> gravity_init, gravity;
 extern std::vector<double> extrinT;
 extern std::vector<double> extrinR;
 extern bool runtime_pos_log, pcd_save_en, path_en;
-extern bool scan_pub_en, scan_body_pub_en;
+extern bool scan_pub_en, scan_body_pub_en, map_stats_en;
 extern shared_ptr<Preprocess> p_pre;
 extern double time_lag_imu_to_lidar;
 
@@ -0,0 +1,58 @@
+/*
+Description: converts a saved map (e.g. PCD/scans.pcd) into an ikd-Tree snapshot for mapping.map_snapshot.
+Usage: pcd_to_ikdtree <input.pcd> <output snapshot> [filter_size_map] [leaf_bucket_size]
+       filter_size_map > 0 downsamples the cloud the way the mapping node inserts points, use the
+       filter_size_map of the config that will load the snapshot.
+*/
+#include <ikd-Tree/ikd_Tree.h>
+#include <pcl/io/pcd_io.h>
+#include <pcl/point_cloud.h>
+
+typedef pcl::PointXYZINormal PointType;
+typedef KD_TREE<PointType>::PointVector PointVector;
+
+static double now_sec()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        printf("Usage: %s <input.pcd> <output snapshot> [filter_size_map] [leaf_bucket_size]\n", argv[0]);
+        return 1;
+    }
+    float filter_size_map = argc > 3 ? stof(argv[3]) : 0.0f;
+    int leaf_bucket_size = argc > 4 ? stoi(argv[4]) : 0;
+
+    pcl::PointCloud<PointType> cloud;
+    if (pcl::io::loadPCDFile(argv[1], cloud) != 0)
+    {
+        printf("Cannot read %s\n", argv[1]);
+        return 1;
+    }
+    printf("Loaded %zu points from %s\n", cloud.size(), argv[1]);
+
+    double t0 = now_sec();
+    KD_TREE<PointType> tree;
+    tree.Set_leaf_bucket_size(leaf_bucket_size);
+    PointVector points(cloud.points.begin(), cloud.points.end());
+    cloud.clear();
+    if (filter_size_map > 0.0f)
+    {
+        // Downsampled insertion keeps the point nearest to each voxel center, then the survivors are
+        // rebuilt into one balanced tree.
+        tree.set_downsample_param(filter_size_map);
+        tree.Add_Points(points, true);
+        BoxPointType everything = {{-INFINITY, -INFINITY, -INFINITY}, {INFINITY, INFINITY, INFINITY}};
+        tree.Box_Search(everything, points);
+    }
+    tree.Build(std::move(points));
+    printf("Built %d points in %.3f s\n", tree.validnum(), now_sec() - t0);
+
+    if (!tree.Save(argv[2]))
+        return 1;
+    printf("Saved %s\n", argv[2]);
+    return 0;
+}